@@ -0,0 +1,55 @@
+#ifndef _AIO_ENGINE_H_
+#define _AIO_ENGINE_H_
+
+#include <sys/uio.h>           /* struct iovec                                */
+
+/******************************************************************************/
+#define AIO_ENGINE_AUTO    0   /* io_uring when possible, else threads        */
+#define AIO_ENGINE_THREADS 1   /* always use the worker threads               */
+
+#define AIO_QUEUE_DEPTH   128  /* io_uring submission queue entries           */
+#define AIO_WORKERS         4  /* threads of the fallback engine              */
+
+/* One block transfer.  The caller owns the request, iov and the buffers it
+ * describes until done has been called.                                      */
+struct disk_aio {
+  int is_write;                /* 1 = write, 0 = read                         */
+  int start;                   /* first block                                 */
+  const struct iovec *iov;     /* whole blocks in total; NULL passes the      */
+                               /* request to sync_io as is (threads only)     */
+  int iovcnt;                  /* at most DISK_IOV_MAX                        */
+  void (*done)(struct disk_aio *req, int result);
+                               /* 0 or -1, called on an engine thread         */
+  void *arg;                   /* for the caller                              */
+  struct disk_aio *next;       /* engine private                              */
+};
+
+struct aio_engine_stats {
+  unsigned long submitted;     /* requests accepted                           */
+  unsigned long batches;       /* submission calls that carried them          */
+  int in_flight;               /* requests not completed yet                  */
+  int max_in_flight;           /* high-water mark of in_flight                */
+  int uring;                   /* 1 if requests go through io_uring           */
+};
+
+/* performs req synchronously; used by the worker threads and to finish a
+ * transfer io_uring cut short                                               */
+typedef int (*aio_sync_io)(void *ctx, struct disk_aio *req);
+
+/******************************************************************************/
+struct aio_engine;
+
+struct aio_engine *aio_engine_create(int fd, int block_size, int mode,
+                                     aio_sync_io sync_io, void *ctx);
+                               /* io_uring on fd (unless fd < 0 or mode is    */
+                               /* AIO_ENGINE_THREADS), else worker threads    */
+int aio_engine_submit(struct aio_engine *e, struct disk_aio **reqs, int n);
+                               /* queue n requests with one submission        */
+void aio_engine_drain(struct aio_engine *e);
+                               /* wait until every request has completed      */
+void aio_engine_destroy(struct aio_engine *e);
+                               /* drain, stop the threads and free            */
+void aio_engine_get_stats(struct aio_engine *e, struct aio_engine_stats *st);
+/******************************************************************************/
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef _BLOCK_CACHE_H_
+#define _BLOCK_CACHE_H_
+
+#include <sys/uio.h>           /* struct iovec                                */
+
+/******************************************************************************/
+struct block_cache_stats {
+  unsigned long hits;          /* block reads served from the cache           */
+  unsigned long misses;        /* block reads that went to the device         */
+  unsigned long evictions;     /* entries reclaimed by the CLOCK hand         */
+  unsigned long writebacks;    /* dirty blocks written to the device          */
+  unsigned long readahead;     /* blocks loaded by block_cache_prefetch       */
+  int capacity;                /* number of cache entries                     */
+  int used;                    /* entries currently holding a block           */
+  int dirty;                   /* entries not yet written back                */
+};
+
+/* moves whole blocks between the device and iov; is_write selects direction */
+typedef int (*block_device_io)(void *device, int is_write, int start,
+                               const struct iovec *iov, int iovcnt);
+
+struct block_cache;            /* one cache per open disk                     */
+
+/******************************************************************************/
+struct block_cache *block_cache_create(int capacity, int block_size,
+                                       block_device_io io, void *device);
+                               /* allocate a cache of capacity blocks of      */
+                               /* block_size bytes in front of io, which is   */
+                               /* passed device                               */
+void block_cache_destroy(struct block_cache *bc);
+                               /* drop every entry, dirty or not              */
+
+int block_cache_read(struct block_cache *bc, int start, int count, char *buf);
+                               /* read blocks, filling misses from the device */
+int block_cache_prefetch(struct block_cache *bc, int start, int count);
+                               /* load the blocks that are not cached yet,    */
+                               /* without copying them anywhere               */
+int block_cache_write(struct block_cache *bc, int start, int count, char *buf);
+                               /* update blocks in the cache, marking them    */
+                               /* dirty; the device sees them at flush time   */
+int block_cache_flush(struct block_cache *bc);
+                               /* write back all dirty blocks, coalescing     */
+                               /* consecutive ones into a single transfer     */
+
+char *block_cache_pin(struct block_cache *bc, int block);
+                               /* load a block and keep it resident until the */
+                               /* matching unpin; NULL if nothing can evict   */
+int block_cache_unpin(struct block_cache *bc, const char *data);
+                               /* release a pointer returned by pin; 0 if it  */
+                               /* is not a block of the cache                 */
+
+void block_cache_get_stats(struct block_cache *bc,
+                           struct block_cache_stats *st);
+/******************************************************************************/
+
+#endif
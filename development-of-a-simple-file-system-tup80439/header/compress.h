@@ -0,0 +1,20 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+// Block compression for compressed files (see fs_set_compression), in the
+// LZ4 block format: a sequence is a token byte (literal count in the high
+// four bits, match length - 4 in the low four, 15 meaning more length bytes
+// follow, each added until one is below 255), the literals, then the match as
+// a two-byte little-endian offset back into the output. The last sequence has
+// literals only. Matches are found with one hash probe per position, which
+// keeps compression cheap; decompression is a loop of memcpys.
+
+// Compress src_len bytes of src into dst, which holds dst_cap bytes. Returns
+// the compressed size, or 0 if it would not fit (the data is best stored as is).
+int lz_compress(const char *src, int src_len, char *dst, int dst_cap);
+
+// Decompress src_len bytes of src into dst, which must come out exactly
+// dst_len bytes long. Returns 0, or -1 if src is damaged.
+int lz_decompress(const char *src, int src_len, char *dst, int dst_len);
+
+#endif // COMPRESS_H
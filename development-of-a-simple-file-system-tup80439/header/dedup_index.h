@@ -0,0 +1,43 @@
+#ifndef DEDUP_INDEX_H
+#define DEDUP_INDEX_H
+
+// In-memory fingerprint index of the data blocks of deduplicated files (see
+// fs_set_deduplication), derived from their block tables at mount time. It
+// maps the hash of a block's contents to the data blocks holding it:
+//  - a chained hash table from fingerprint to block, the chains threaded
+//    through an array indexed by block so an entry costs no allocation;
+//  - the fingerprint of each indexed block, so a block can be dropped from
+//    its chain without reading it again.
+// A fingerprint only nominates a block: the caller compares the contents
+// before sharing it. A block is indexed while some block table names it,
+// and several blocks may carry the same fingerprint.
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    int *buckets;       // First block with a fingerprint hashed here, -1 if none
+    int mask;           // Number of buckets - 1 (a power of two)
+    int *next;          // By block: next block of its bucket, -1 at the end, -2 if not indexed
+    uint64_t *hashes;   // By block: its fingerprint, while indexed
+    int blocks;         // Number of data blocks tracked
+} dedup_index;
+
+// Fingerprint of bytes bytes of data (64-bit MurmurHash2)
+uint64_t dedup_hash(const char *data, size_t bytes);
+
+// Start an empty index of blocks data blocks
+int dedup_index_init(dedup_index *idx, int blocks);
+// Release the index
+void dedup_index_destroy(dedup_index *idx);
+
+// Most recently indexed block with fingerprint hash, or -1
+int dedup_index_find(const dedup_index *idx, uint64_t hash);
+// Index block, which is not indexed yet, under hash
+void dedup_index_insert(dedup_index *idx, int block, uint64_t hash);
+// Drop block from the index if it is there
+void dedup_index_remove(dedup_index *idx, int block);
+// 1 if block is indexed, 0 if not
+int dedup_index_contains(const dedup_index *idx, int block);
+
+#endif // DEDUP_INDEX_H
@@ -0,0 +1,48 @@
+#ifndef DIR_INDEX_H
+#define DIR_INDEX_H
+
+// In-memory index of the directory tree, derived from its entries at mount
+// time. It works as a dentry cache that always holds every entry:
+//  - an open-addressing hash table from (parent directory, name) to slot, so
+//    each component of a path is resolved with one probe sequence;
+//  - the entries of each directory as a doubly-linked list, for listing and
+//    for telling whether a directory is empty;
+//  - a bitmap of free slots so create does not have to scan for one.
+// Lookups, inserts and removals cost the same however many slots there are.
+// Every used slot whose parent is a directory is in exactly one bucket and
+// one sibling list; a slot is in neither while its bit in free is set.
+
+#include <stdint.h>
+#include "fs_management.h"
+
+typedef struct {
+    int *buckets;       // Slot of the entry hashed here, -1 if empty
+    int mask;           // Number of buckets - 1 (a power of two, >= 2 * slots)
+    uint64_t *free;     // Bit i set = slot i is free
+    int *first_child;   // By directory id: first entry in it, -1 if empty
+    int *next_sibling;  // By slot: next entry of the same directory, -1 at the end
+    int *prev_sibling;  // By slot: previous entry, -1 for the first
+    int slots;          // Number of directory slots tracked
+} dir_index;
+
+// Rebuild the index from slots directory entries. Entries whose parent is
+// not a directory cannot be reached and are left out.
+int dir_index_build(dir_index *idx, const files *dir, int slots);
+// Release the index
+void dir_index_destroy(dir_index *idx);
+
+// Slot of the entry called name in directory parent, or -1
+int dir_index_find(const dir_index *idx, const files *dir, int parent, const char *name);
+// First entry of directory parent, or -1 if it is empty
+int dir_index_first(const dir_index *idx, int parent);
+// Entry after slot in its directory, or -1
+int dir_index_next(const dir_index *idx, int slot);
+// Lowest free slot, or -1 if the directory region is full. The slot stays
+// free until dir_index_insert.
+int dir_index_free_slot(const dir_index *idx);
+// Index dir[slot], which has just been filled in
+void dir_index_insert(dir_index *idx, const files *dir, int slot);
+// Drop dir[slot] from the index before it is cleared, freeing the slot
+void dir_index_remove(dir_index *idx, const files *dir, int slot);
+
+#endif // DIR_INDEX_H
@@ -1,21 +1,130 @@
 #ifndef _DISK_H_
 #define _DISK_H_
 
+#include <sys/uio.h>           /* struct iovec                                */
+#include <sys/types.h>         /* off_t                                       */
+
+#include "block_cache.h"
+#include "aio_engine.h"
+
 /******************************************************************************/
-#define DISK_BLOCKS  8192      /* number of blocks on the disk                */
-#define BLOCK_SIZE   4096      /* block size on "disk"                        */
+#define DISK_BLOCKS  8192      /* number of blocks make_disk creates          */
+#define BLOCK_SIZE   4096      /* block size of make_disk and open_disk_ex    */
+#define DISK_MIN_BLOCK_SIZE 512
+#define DISK_MAX_BLOCK_SIZE 65536
+                               /* block sizes open_disk_blocksize_ex accepts  */
+                               /* (powers of two)                             */
+
+#define DISK_IOV_MAX 64        /* most iovecs accepted by one vectored call   */
+#define DISK_CACHE_DEFAULT_BLOCKS 1024
+                               /* block cache size used unless reconfigured   */
+
+#define DISK_BACKEND_PIO  0    /* pread/pwrite on the image file (default)    */
+#define DISK_BACKEND_MMAP 1    /* whole image mapped, block I/O is memcpy     */
+
+#define DISK_SPARSE       0    /* make_disk_ex: allocate space on first write */
+#define DISK_PREALLOCATE  1    /* make_disk_ex: reserve all space up front    */
 
 /******************************************************************************/
+typedef struct disk disk_t;    /* an open virtual disk                        */
+
 int make_disk(char *name);     /* create an empty, virtual disk file          */
+                               /* of DISK_BLOCKS blocks of BLOCK_SIZE bytes   */
+int make_disk_ex(char *name, off_t size, int flags);
+                               /* create an empty disk file of size bytes,    */
+                               /* sparse (ftruncate) or preallocated          */
+                               /* (fallocate); no data is written either way  */
+int disk_set_backend(int which);
+                               /* select the backend for the next open        */
+int disk_set_cache(int nblocks);
+                               /* block cache size for the next open;         */
+                               /* 0 disables the cache                        */
+int disk_set_aio(int mode);    /* AIO_ENGINE_AUTO or AIO_ENGINE_THREADS for   */
+                               /* disks whose engine has not started yet      */
+
+/* Every open disk_t is independent: its own handle, mapping and cache.      */
+disk_t *open_disk_ex(char *name);
+                               /* open a virtual disk (file), NULL on error   */
+disk_t *open_disk_blocksize_ex(char *name, int block_size);
+                               /* the same with blocks of block_size bytes;   */
+                               /* the disk has as many as fit in the file     */
+int close_disk_ex(disk_t *disk);
+                               /* write back, close and free the disk         */
+int disk_sync_ex(disk_t *disk);
+                               /* flush written blocks to stable storage      */
+int disk_cached_ex(disk_t *disk);
+                               /* 1 if block I/O goes through a block cache   */
+int disk_block_size_ex(disk_t *disk);
+                               /* bytes per block                             */
+int disk_blocks_ex(disk_t *disk);
+                               /* number of blocks                            */
+void disk_cache_stats_ex(disk_t *disk, struct block_cache_stats *st);
+                               /* hit/miss counters of the disk's cache       */
+
+char *block_ptr_ex(disk_t *disk, int block);
+                               /* address of a block inside the mapped image, */
+                               /* NULL unless opened with DISK_BACKEND_MMAP   */
+const char *block_pin_ex(disk_t *disk, int block);
+                               /* stable pointer to a cached or mapped block, */
+                               /* NULL if neither is available                */
+int block_unpin_ex(disk_t *disk, const char *ptr);
+                               /* release a pointer returned by block_pin_ex; */
+                               /* 0 if it is not a block of the cache         */
+
+int block_write_ex(disk_t *disk, int block, char *buf);
+                               /* write one block to disk                     */
+int block_read_ex(disk_t *disk, int block, char *buf);
+                               /* read one block from disk                    */
+int block_write_range_ex(disk_t *disk, int start, int count, char *buf);
+                               /* write count consecutive blocks from buf     */
+int block_read_range_ex(disk_t *disk, int start, int count, char *buf);
+                               /* read count consecutive blocks into buf      */
+int block_writev_ex(disk_t *disk, int start, const struct iovec *iov,
+                    int iovcnt);
+                               /* gather-write consecutive blocks starting at */
+                               /* start; the iovec lengths must add up to a   */
+                               /* whole number of blocks                      */
+int block_readv_ex(disk_t *disk, int start, const struct iovec *iov,
+                   int iovcnt);
+                               /* scatter-read counterpart of block_writev_ex */
+
+int disk_aio_submit_ex(disk_t *disk, struct disk_aio **reqs, int n);
+                               /* queue n asynchronous transfers in one batch;*/
+                               /* io_uring on an uncached, unmapped image,    */
+                               /* worker threads through the cache otherwise  */
+void disk_aio_drain_ex(disk_t *disk);
+                               /* wait for every queued transfer              */
+void disk_aio_stats_ex(disk_t *disk, struct aio_engine_stats *st);
+void disk_readahead_ex(disk_t *disk, int start, int count);
+                               /* start loading blocks that will be read      */
+                               /* soon: into the cache on a worker thread,    */
+                               /* else a hint to the kernel; never blocks     */
+
+/******************************************************************************/
+/* Single-disk interface: the same operations on one default disk.           */
 int open_disk(char *name);     /* open a virtual disk (file)                  */
+int open_disk_blocksize(char *name, int block_size);
+                               /* the same with blocks of block_size bytes    */
 int close_disk();              /* close a previously opened disk (file)       */
+disk_t *disk_default();        /* the disk opened by open_disk, or NULL       */
+int disk_sync();               /* flush written blocks to stable storage      */
+void disk_cache_stats(struct block_cache_stats *st);
+                               /* hit/miss counters of the open disk's cache  */
+
+char *block_ptr(int block);
+const char *block_pin(int block);
+int block_unpin(const char *ptr);
 
 int block_write(int block, char *buf);
-                               /* write a block of size BLOCK_SIZE to disk    */
 int block_read(int block, char *buf);
-                               /* read a block of size BLOCK_SIZE from disk   */
+int block_write_range(int start, int count, char *buf);
+int block_read_range(int start, int count, char *buf);
+int block_writev(int start, const struct iovec *iov, int iovcnt);
+int block_readv(int start, const struct iovec *iov, int iovcnt);
+int disk_aio_submit(struct disk_aio **reqs, int n);
+void disk_aio_drain();
+void disk_aio_stats(struct aio_engine_stats *st);
+void disk_readahead(int start, int count);
 /******************************************************************************/
 
 #endif
-
-
@@ -0,0 +1,41 @@
+#ifndef FREE_SPACE_H
+#define FREE_SPACE_H
+
+// In-memory index of free data blocks, derived from FAT1 at mount time (or,
+// on a lazy mount, as each block of FAT1 is read).
+// A set bit means the block is free; allocation is next-fit from a rotating
+// cursor so that a freshly formatted disk fills up in O(1) per block.
+// free_total always matches the set bits, so counting free blocks is O(1).
+
+#include <stdint.h>
+
+typedef struct {
+    uint64_t *map;   // Bit i set = block i is free
+    int entries;     // Number of blocks tracked
+    int words;       // Number of 64-bit words in map
+    int free_total;  // Number of set bits
+    int cursor;      // Next-fit starting point (block index)
+} free_space;
+
+// Rebuild the index from a FAT (-2 marks a free entry)
+int free_space_build(free_space *fsp, const int *fat, int entries);
+// Start an index of entries blocks with none known to be free, for a FAT
+// that is read piece by piece; free_space_add then indexes each piece
+int free_space_init(free_space *fsp, int entries);
+void free_space_add(free_space *fsp, const int *fat, int first, int count);
+// Release the index
+void free_space_destroy(free_space *fsp);
+
+// Claim up to want physically contiguous free blocks. The run starts at goal
+// if that block is free, otherwise it is the first run of want blocks after
+// the cursor (or the longest run if none is that long). Returns the first
+// block and stores the run length in *got, or returns -1 if the disk is full.
+int free_space_alloc_run(free_space *fsp, int goal, int want, int *got);
+// Return a block to the free pool
+void free_space_release(free_space *fsp, int block);
+// Take a block out of the free pool, if it is there
+void free_space_claim(free_space *fsp, int block);
+// Number of free blocks
+int free_space_count(const free_space *fsp);
+
+#endif // FREE_SPACE_H
@@ -8,18 +8,67 @@
 
 // Constants
 #define MAX_DISK_NAME_LENGTH 256
-#define MAX_FILE_SIZE (4096 * BLOCK_SIZE) // 16 MB
-#define DATA_BLOCKS_START 4096            // As per your boot sector
 #define MAX_FILE_DESCRIPTORS 32
 #define BLOCK_ARRAY_SIZE 4096
+#define PREALLOC_BLOCKS 16                // Blocks reserved past EOF when a file grows
+#define READAHEAD_MIN_BLOCKS 4            // Readahead window when a sequential stream starts
+#define READAHEAD_MAX_BLOCKS 64           // Largest readahead window
+#define COPY_RUN_BLOCKS 64                // Most blocks fs_copy moves with one read and one write
+#define MAX_FILENAME_LENGTH 79            // Characters in a file name, without the null terminator
+#define MAX_DIR_ENTRIES 4096              // Slots of the root directory region in new images, the most mount accepts
+#define ENTRY_FILE 1                      // files.isFile of a regular file
+#define ENTRY_DIR 2                       // files.isFile of a subdirectory
+#define FS_MOUNT_EAGER 0                  // mount reads the whole FAT and root directory (default)
+#define FS_MOUNT_LAZY 1                   // mount reads them block by block as they are first used
+#define FS_COPY_CLONE 1                   // fs_copy flag: share the source's blocks instead of copying them
+#define FS_MAX_SNAPSHOTS 8                // Snapshots an image can hold
+#define FS_SNAPSHOT_NAME_LENGTH 23        // Characters in a snapshot name, without the null terminator
+#define COMPRESS_EXTENT_BYTES 65536       // Logical bytes compressed as one unit in a compressed file
+#define ROOT_DIR_ID 0                     // files.parent of entries in the root; a directory in slot i has id i + 1
 
 // File Descriptor Structure
 typedef struct {
     int is_open;          // 1 if open, 0 if closed
     int file_index;       // Index into your rootDir array
     size_t offset;        // Current file offset (seek pointer)
+    int cursor_index;     // Logical block index of cursor_block within the file
+    int cursor_block;     // Last data block accessed through this descriptor, -1 if none
+    int ra_next;          // Logical block a sequential fs_read would start in
+    int ra_window;        // Readahead window in blocks, 0 while reads are not sequential
+    int ra_end;           // Logical block up to which readahead has been issued
 } file_descriptor;
 
+// One piece of a zero-copy read view (see fs_read_view)
+struct fs_iovec {
+    const void *base;     // First byte of this piece
+    size_t len;           // Number of bytes in this piece
+    void *backing;        // Owned by the file system, released by fs_release_view
+};
+
+// One entry of a directory listing (see fs_readdir)
+struct fs_dirent {
+    char name[MAX_FILENAME_LENGTH + 1];
+    int is_dir;           // 1 for a subdirectory, 0 for a file
+    size_t size;          // File size in bytes, 0 for a directory
+};
+
+// Asynchronous I/O (see fs_read_async). result is the number of bytes
+// transferred, or -1 if the request failed.
+typedef void (*fs_aio_callback)(void *arg, int result);
+
+struct fs_aio_completion {
+    void *arg;            // As passed to fs_read_async/fs_write_async
+    int result;
+};
+
+// One slot of the boot sector's snapshot table (see fs_snapshot_create)
+typedef struct {
+    char name[FS_SNAPSHOT_NAME_LENGTH + 1]; // Empty if the slot is free
+    int location;          // First data block of the snapshot's copy of FAT1, followed by its root directory
+    char timeCreated[9];   // Time of creation (hh:mm:ss)
+    char dateCreated[9];   // Date of creation (mm/dd/yy)
+} snapshot_entry;
+
 // Boot Sector Structure
 typedef struct {
     int dataOffset;
@@ -31,49 +80,164 @@ typedef struct {
     int sizeOfFat2;
     int root_location;
     int num_files; // Number of files in root
+    int journal_location; // First block of the metadata journal, 0 if none
+    int sizeOfJournal;
+    int sizeOfRoot; // Blocks of the root directory region, 0 in images with the old one-block format
+    int blockSize; // Bytes per block, 0 in images made before it was recorded (4096)
+    int totalBlocks; // Blocks on the disk, 0 in images made before it was recorded (8192)
+    int sharedBlocks; // 1 once files may share data blocks (fs_copy with FS_COPY_CLONE)
+    snapshot_entry snapshots[FS_MAX_SNAPSHOTS]; // Snapshots of the volume, all-zero in images made before them
 } boot_sector;
 
 // File Entry Structure
 typedef struct {
-    int isFile;            // 1 if this entry represents a file, 0 otherwise
+    int isFile;            // ENTRY_FILE or ENTRY_DIR, 0 if the slot is free
     int numOpen;           // Number of times the file is open
-    int fPointer;          // File pointer (unused in this struct, could be removed)
-    char filename[16];     // File name (15 chars max + null terminator)
+    int parent;            // Id of the directory holding the entry (ROOT_DIR_ID for the root)
+    char filename[MAX_FILENAME_LENGTH + 1]; // File name, null-terminated
     int firstDataBlock;    // Index of the first data block in the FAT
     size_t sizeInBytes;    // Size of the file in bytes
     char timeCreated[9];   // Time of creation (hh:mm:ss)
     char dateCreated[9];   // Date of creation (mm/dd/yy)
+    char compressed;       // 1 if the data is stored compressed (see fs_set_compression)
+    char deduplicated;     // 1 if the data is stored deduplicated (see fs_set_deduplication)
+    int storedBytes;       // Bytes of a compressed or deduplicated file's chain in use
 } files;
 
+// Shape of a new image (see make_fs_ex)
+typedef struct {
+    int block_size;       // Bytes per block, a power of two from 512 to 65536
+    int blocks;           // Blocks on the disk, metadata regions included
+    int preallocate;      // 1 to reserve the image's space up front, 0 for a sparse file
+} fs_geometry;
+
 // Global Variables
 extern char BLOCK_ARRAY[BLOCK_ARRAY_SIZE];
-extern int is_mounted; // 0 = not mounted, 1 = mounted
 
-extern file_descriptor file_descriptors[MAX_FILE_DESCRIPTORS];
-extern boot_sector bs;
-extern int FAT1[4096];
-extern int FAT2[4096];
-extern files rootDir[64];
-extern char mounted_disk_name[MAX_DISK_NAME_LENGTH];
+// A mounted file system. Each instance owns its disk handle, FATs, root
+// directory, descriptors and locks, so several images can be mounted at once.
+typedef struct fs fs_t;
 
 // Function Prototypes
 
 // Initialization Functions
-void initFAT(int FAT[]);
+void initFAT(int FAT[], int entries);
+// Make an image of BLOCK_SIZE * DISK_BLOCKS bytes
 int make_fs(char *disk_name);
+// Make an image of the given geometry. Only the metadata blocks are written;
+// the data region is left as a hole (or preallocated), so this takes about as
+// long for a large disk as for a small one.
+int make_fs_ex(char *disk_name, const fs_geometry *geometry);
 int mount_fs(char *disk_name);
 int unmount_fs(char *disk_name);
+// Select how the next mount_fs/fs_mount_ex reads the metadata: FS_MOUNT_EAGER
+// or FS_MOUNT_LAZY. A lazy mount only checks the boot sector and the journal;
+// an image that needs recovery is still read whole.
+int fs_set_mount_mode(int mode);
 int write_to_block(int block_num, void *data, size_t data_size);
 
-// File System Functions
+// File System Functions (on the file system mounted with mount_fs)
+// Names are paths from the root directory, with components separated by '/'
+// (a leading '/' is optional; "." and ".." are understood).
 int fs_open(char *fname);
 int fs_close(int fildes);
 int fs_create(char *fname);
 int fs_delete(char *fname);
 int fs_read(int fildes, void *buf, size_t nbyte);
+int fs_read_view(int fildes, size_t nbyte, struct fs_iovec *out, int *cnt);
+void fs_release_view(struct fs_iovec *view, int cnt);
 int fs_write(int fildes, void *buf, size_t nbyte);
 int fs_get_filesize(int fildes);
+int fs_get_free_blocks(void);
 int fs_lseek(int fildes, off_t offset);
 int fs_truncate(int fildes, off_t length);
+// Copy file src to a new file dst. The data moves in runs of up to
+// COPY_RUN_BLOCKS blocks into a chain allocated whole up front. With
+// FS_COPY_CLONE nothing is copied: dst shares src's blocks, and whichever file
+// is written first gets its own copy of the blocks it changes.
+int fs_copy(char *src, char *dst, int flags);
+// Turn compression of file fname on (on = 1) or off (on = 0); only an empty
+// file can change. A compressed file is stored as records of its extents of
+// COMPRESS_EXTENT_BYTES each, compressed on their way to the disk and
+// decompressed on the way back. Reads and writes go through a cache of one
+// extent, so sequential access decompresses and compresses each extent once.
+int fs_set_compression(char *fname, int on);
+// Turn deduplication of file fname on (on = 1) or off (on = 0); only an empty
+// file that is not compressed can change. The blocks of a deduplicated file
+// are stored by content: a block with the same bytes as one already stored
+// for any deduplicated file is not written again but shared, and a block of
+// zeros takes no space at all.
+int fs_set_deduplication(char *fname, int on);
+
+// Snapshots: fs_snapshot_create freezes the whole volume as it stands by
+// writing a copy of the FAT and the root directory; the data blocks stay
+// shared with the live files, which copy a block before they change it.
+// A snapshot stays on the image until fs_snapshot_delete. It is read through
+// fs_snapshot_mount_readonly, and must not be deleted while mounted that way.
+int fs_snapshot_create(char *name);
+int fs_snapshot_delete(char *name);
+
+// Directory Functions
+int fs_mkdir(char *path);
+// Remove an empty directory
+int fs_rmdir(char *path);
+// Store up to max entries of directory path in out. Returns the number of
+// entries in the directory (which may be more than max), or -1.
+int fs_readdir(char *path, struct fs_dirent *out, int max);
+
+// Durability: small writes are held in a per-file write-back buffer and
+// metadata (FATs, root directory) in memory until the last close of the file,
+// unmount_fs, or one of these. fs_fsync returns 0 once the file's data and
+// all metadata are on stable storage; fs_sync does the same for every file.
+// The metadata changes go to the journal, which mount_fs replays after a crash.
+int fs_fsync(int fildes);
+int fs_sync(void);
+
+// Asynchronous I/O Functions
+// Queue a read/write at the descriptor's offset, which advances at once; buf
+// must stay valid until completion. The callback runs on an I/O thread (or
+// before the call returns) and must not block on the file system; without a
+// callback the completion is queued for fs_aio_reap. Returns 0 if queued.
+int fs_read_async(int fildes, void *buf, size_t nbyte, fs_aio_callback callback, void *arg);
+int fs_write_async(int fildes, void *buf, size_t nbyte, fs_aio_callback callback, void *arg);
+// Collect up to max queued completions, waiting for at least min of them
+int fs_aio_reap(struct fs_aio_completion *out, int max, int min);
+// Wait until every queued request has completed
+void fs_aio_drain(void);
+
+// Instance Functions: the same operations on an fs_t from fs_mount_ex.
+// File descriptors are local to their instance.
+fs_t *fs_mount_ex(char *disk_name);
+int fs_unmount_ex(fs_t *fs);
+int fs_open_ex(fs_t *fs, char *fname);
+int fs_close_ex(fs_t *fs, int fildes);
+int fs_create_ex(fs_t *fs, char *fname);
+int fs_delete_ex(fs_t *fs, char *fname);
+int fs_read_ex(fs_t *fs, int fildes, void *buf, size_t nbyte);
+int fs_read_view_ex(fs_t *fs, int fildes, size_t nbyte, struct fs_iovec *out, int *cnt);
+void fs_release_view_ex(fs_t *fs, struct fs_iovec *view, int cnt);
+int fs_write_ex(fs_t *fs, int fildes, void *buf, size_t nbyte);
+int fs_get_filesize_ex(fs_t *fs, int fildes);
+int fs_get_free_blocks_ex(fs_t *fs);
+int fs_lseek_ex(fs_t *fs, int fildes, off_t offset);
+int fs_truncate_ex(fs_t *fs, int fildes, off_t length);
+int fs_copy_ex(fs_t *fs, char *src, char *dst, int flags);
+int fs_set_compression_ex(fs_t *fs, char *fname, int on);
+int fs_set_deduplication_ex(fs_t *fs, char *fname, int on);
+int fs_snapshot_create_ex(fs_t *fs, char *name);
+int fs_snapshot_delete_ex(fs_t *fs, char *name);
+// Mount snapshot name of an image as an instance of its own, alongside the
+// live file system or not. Every call that would change it fails.
+// Release it with fs_unmount_ex.
+fs_t *fs_snapshot_mount_readonly(char *disk_name, char *name);
+int fs_mkdir_ex(fs_t *fs, char *path);
+int fs_rmdir_ex(fs_t *fs, char *path);
+int fs_readdir_ex(fs_t *fs, char *path, struct fs_dirent *out, int max);
+int fs_read_async_ex(fs_t *fs, int fildes, void *buf, size_t nbyte, fs_aio_callback callback, void *arg);
+int fs_write_async_ex(fs_t *fs, int fildes, void *buf, size_t nbyte, fs_aio_callback callback, void *arg);
+int fs_aio_reap_ex(fs_t *fs, struct fs_aio_completion *out, int max, int min);
+void fs_aio_drain_ex(fs_t *fs);
+int fs_fsync_ex(fs_t *fs, int fildes);
+int fs_sync_ex(fs_t *fs);
 
 #endif // FS_MANAGEMENT_H
@@ -0,0 +1,88 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+// Write-ahead log of metadata changes, kept in a region of the image named by
+// the boot sector. Each transaction records only the FAT entries and root
+// directory slots that changed since the previous one and is followed by a
+// disk sync; mount replays the log over the home copies of the FATs and the
+// root directory. The home copies are rewritten only at a checkpoint, and then
+// with the last committed state, so replaying the log over them is always
+// correct, even after a crash in the middle of a checkpoint.
+
+#include <stdint.h>
+#include "fs_management.h"
+#include "disk.h"
+
+#define JOURNAL_BYTES (256 * 1024)  // Size of the region in new images, rounded up to whole blocks
+#define JOURNAL_MAGIC 0x4c4e524a     // "JRNL", in the header and every transaction
+
+// Metadata blocks named by bit: one per block of the FAT (the same block of
+// FAT1 and FAT2), then one per block of the root directory
+typedef struct {
+    uint64_t *bits;       // Bit i = FAT block i, bit fat_blocks + i = directory block i
+    int fat_blocks;
+    int dir_blocks;
+    int fat_per_block;    // FAT entries in a block
+    int dir_per_block;    // Directory entries in a block
+} meta_dirty;
+
+// Size an empty set for the regions of bs (whose blockSize must be set)
+int meta_dirty_init(meta_dirty *dirty, const boot_sector *bs);
+// Release the set
+void meta_dirty_free(meta_dirty *dirty);
+// Mark every block clean
+void meta_dirty_clear(meta_dirty *dirty);
+// Set the bit of the FAT block holding entry, or of the directory block
+// holding slot; atomic, as several threads may mark blocks at once
+void meta_dirty_fat(meta_dirty *dirty, int entry);
+void meta_dirty_dir(meta_dirty *dirty, int slot);
+
+typedef struct {
+    int location;                    // First block of the region, 0 if the image has none
+    int blocks;                      // Blocks in the region
+    int next;                        // Block of the region the next transaction goes to
+    unsigned int sequence;           // Sequence number of the next transaction
+    int block_size;                  // Bytes per block of the image
+    int fat_entries;                 // Entries in the FAT
+    int dir_slots;                   // Entries in the root directory region
+    meta_dirty home_dirty;           // Blocks whose home copy is older than the last commit
+    int *fat;                        // FAT as of the last commit
+    size_t fat_bytes;                // Size of fat: the whole FAT region
+    files dir[MAX_DIR_ENTRIES];      // Root directory as of the last commit
+} journal;
+
+// Write an empty log to a new image
+int journal_format(disk_t *disk, int location, int blocks);
+
+// 1 if the log at location starts with a transaction not yet checkpointed,
+// 0 if it is empty, -1 if it cannot be read
+int journal_pending(disk_t *disk, int location);
+
+// Replay the log of a freshly mounted image into fat (FAT1, as long as its
+// region, of which the first fat_entries are in use) and dir, then checkpoint
+// so that the log starts out empty. An image without a journal region
+// (bs->journal_location == 0) is accepted as is.
+// With fat and dir NULL (a lazy mount) the log must have nothing to replay;
+// the caller reports each piece of metadata with journal_fat_loaded and
+// journal_dir_loaded when it reads it.
+int journal_open(journal *j, disk_t *disk, const boot_sector *bs, int *fat, int fat_entries, files *dir);
+// Take FAT block block, or the whole directory, as just read into fat or
+// dir, as the last committed state
+void journal_fat_loaded(journal *j, const int *fat, int block);
+void journal_dir_loaded(journal *j, const files *dir);
+// Release what journal_open allocated
+void journal_close(journal *j);
+
+// Make everything written to the disk so far, and the metadata in fat and dir,
+// durable: sync the disk, then log the metadata changes as one transaction
+// and sync again. Only the blocks marked in dirty are looked at; the caller
+// marks a block whenever it changes something in it. Checkpoints first if the
+// log is too full. Without a journal region the dirty blocks are rewritten in
+// place.
+int journal_commit(journal *j, disk_t *disk, const boot_sector *bs, const int *fat, const files *dir, const meta_dirty *dirty);
+
+// Write the committed metadata blocks that changed to their home locations,
+// FAT2 as a copy of FAT1, and empty the log
+int journal_checkpoint(journal *j, disk_t *disk, const boot_sector *bs);
+
+#endif // JOURNAL_H
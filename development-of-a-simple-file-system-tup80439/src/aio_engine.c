@@ -0,0 +1,433 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "aio_engine.h"
+
+/******************************************************************************/
+struct aio_engine {
+  pthread_mutex_t lock;        /* guards everything up to the ring            */
+  pthread_cond_t idle;         /* in_flight dropped to zero                   */
+  pthread_cond_t work;         /* the queue gained a request                  */
+  struct disk_aio *head;       /* requests waiting for a worker, or for room  */
+  struct disk_aio *tail;       /* in the submission ring                      */
+  int stopping;
+  struct aio_engine_stats stats;
+  aio_sync_io sync_io;
+  void *ctx;
+  int block_size;              /* converts disk_aio.start to a byte offset    */
+  pthread_t threads[AIO_WORKERS];
+  int nthreads;
+
+  int fd;                      /* file the ring reads and writes              */
+  int ring_fd;                 /* -1 in thread mode                           */
+  unsigned ring_used;          /* entries submitted and not completed         */
+  unsigned unsubmitted;        /* entries in the ring the kernel has not taken */
+  unsigned sq_entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_len, cq_len, sqes_len;
+};
+
+/******************************************************************************/
+static size_t request_bytes(const struct disk_aio *req)
+{
+  size_t total = 0;
+
+  for (int i = 0; i < req->iovcnt; ++i)
+    total += req->iov[i].iov_len;
+
+  return total;
+}
+
+static void enqueue(struct aio_engine *e, struct disk_aio *req)
+{
+  req->next = NULL;
+  if (e->tail)
+    e->tail->next = req;
+  else
+    e->head = req;
+  e->tail = req;
+}
+
+static struct disk_aio *dequeue(struct aio_engine *e)
+{
+  struct disk_aio *req = e->head;
+
+  if (req && !(e->head = req->next))
+    e->tail = NULL;
+
+  return req;
+}
+
+/* Report a finished request and retire it.  The callback runs before the
+ * request stops counting as in flight, so a drain also waits for it.        */
+static void complete(struct aio_engine *e, struct disk_aio *req, int result)
+{
+  req->done(req, result);
+
+  pthread_mutex_lock(&e->lock);
+  if (--e->stats.in_flight == 0)
+    pthread_cond_broadcast(&e->idle);
+  pthread_mutex_unlock(&e->lock);
+}
+
+/******************************************************************************/
+static int uring_setup(struct aio_engine *e)
+{
+  struct io_uring_params p;
+  int fd;
+
+  memset(&p, 0, sizeof(p));
+  if ((fd = (int)syscall(__NR_io_uring_setup, AIO_QUEUE_DEPTH, &p)) < 0)
+    return -1;
+
+  e->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  e->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (e->cq_len > e->sq_len)
+      e->sq_len = e->cq_len;
+    e->cq_len = 0;
+  }
+  e->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  e->sq_ptr = mmap(NULL, e->sq_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (e->sq_ptr == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+
+  if (e->cq_len) {
+    e->cq_ptr = mmap(NULL, e->cq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (e->cq_ptr == MAP_FAILED) {
+      munmap(e->sq_ptr, e->sq_len);
+      close(fd);
+      return -1;
+    }
+  } else {
+    e->cq_ptr = e->sq_ptr;
+  }
+
+  e->sqes = mmap(NULL, e->sqes_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (e->sqes == MAP_FAILED) {
+    if (e->cq_len)
+      munmap(e->cq_ptr, e->cq_len);
+    munmap(e->sq_ptr, e->sq_len);
+    close(fd);
+    return -1;
+  }
+
+  e->sq_head = (unsigned *)((char *)e->sq_ptr + p.sq_off.head);
+  e->sq_tail = (unsigned *)((char *)e->sq_ptr + p.sq_off.tail);
+  e->sq_mask = (unsigned *)((char *)e->sq_ptr + p.sq_off.ring_mask);
+  e->sq_array = (unsigned *)((char *)e->sq_ptr + p.sq_off.array);
+  e->cq_head = (unsigned *)((char *)e->cq_ptr + p.cq_off.head);
+  e->cq_tail = (unsigned *)((char *)e->cq_ptr + p.cq_off.tail);
+  e->cq_mask = (unsigned *)((char *)e->cq_ptr + p.cq_off.ring_mask);
+  e->cqes = (struct io_uring_cqe *)((char *)e->cq_ptr + p.cq_off.cqes);
+  e->sq_entries = p.sq_entries;
+  e->ring_fd = fd;
+
+  return 0;
+}
+
+static void uring_teardown(struct aio_engine *e)
+{
+  munmap(e->sqes, e->sqes_len);
+  if (e->cq_len)
+    munmap(e->cq_ptr, e->cq_len);
+  munmap(e->sq_ptr, e->sq_len);
+  close(e->ring_fd);
+  e->ring_fd = -1;
+}
+
+/* Move queued requests into the submission ring while it has room and hand
+ * them, with any an earlier call failed to submit, to the kernel in one
+ * io_uring_enter.  Never more entries than the ring holds are outstanding,
+ * so the completion ring cannot overflow.
+ * Called with the lock held; a NULL request in the queue is the stop marker. */
+static void uring_push(struct aio_engine *e)
+{
+  unsigned tail = *e->sq_tail;
+  unsigned queued = e->unsubmitted;
+
+  while (e->head && (e->ring_used < e->sq_entries)) {
+    struct disk_aio *req = dequeue(e);
+    unsigned idx = tail & *e->sq_mask;
+    struct io_uring_sqe *sqe = &e->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req->is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = e->fd;
+    sqe->off = (unsigned long long)req->start * e->block_size;
+    sqe->addr = (unsigned long long)(unsigned long)req->iov;
+    sqe->len = (unsigned)req->iovcnt;
+    sqe->user_data = (unsigned long long)(unsigned long)req;
+    e->sq_array[idx] = idx;
+
+    ++tail;
+    ++queued;
+    ++e->ring_used;
+  }
+
+  if (!queued)
+    return;
+
+  __atomic_store_n(e->sq_tail, tail, __ATOMIC_RELEASE);
+  while (queued > 0) {
+    int n = (int)syscall(__NR_io_uring_enter, e->ring_fd, queued, 0, 0,
+                         NULL, 0);
+
+    if (n < 0) {
+      if ((errno == EINTR) || (errno == EAGAIN) || (errno == EBUSY))
+        continue;
+      /* the entries stay in the ring: the next uring_push, for a new
+       * request or from the reaper after a completion, submits them */
+      fprintf(stderr, "aio_engine: io_uring_enter failed: %s\n",
+              strerror(errno));
+      break;
+    }
+    queued -= (unsigned)n;
+  }
+  e->unsubmitted = queued;
+}
+
+static void *uring_reaper(void *arg)
+{
+  struct aio_engine *e = arg;
+  int stop = 0;
+
+  while (!stop) {
+    unsigned head, tail;
+
+    if ((syscall(__NR_io_uring_enter, e->ring_fd, 0, 1,
+                 IORING_ENTER_GETEVENTS, NULL, 0) < 0) && (errno != EINTR)) {
+      fprintf(stderr, "aio_engine: io_uring_enter failed: %s\n",
+              strerror(errno));
+      break;
+    }
+
+    head = *e->cq_head;
+    tail = __atomic_load_n(e->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+      struct io_uring_cqe *cqe = &e->cqes[head & *e->cq_mask];
+      struct disk_aio *req = (struct disk_aio *)(unsigned long)cqe->user_data;
+      int res = cqe->res;
+
+      __atomic_store_n(e->cq_head, ++head, __ATOMIC_RELEASE);
+
+      pthread_mutex_lock(&e->lock);
+      --e->ring_used;
+      pthread_mutex_unlock(&e->lock);
+
+      if (!req) {
+        stop = 1;
+        continue;
+      }
+
+      if ((res >= 0) && ((size_t)res == request_bytes(req))) {
+        complete(e, req, 0);
+      } else if ((res >= 0) || (res == -EAGAIN) || (res == -EINTR)) {
+        /* short transfer: whole blocks are idempotent, redo it in full */
+        complete(e, req, e->sync_io(e->ctx, req));
+      } else {
+        fprintf(stderr, "aio_engine: block %s at %d failed: %s\n",
+                req->is_write ? "write" : "read", req->start, strerror(-res));
+        complete(e, req, -1);
+      }
+    }
+
+    pthread_mutex_lock(&e->lock);
+    uring_push(e);
+    pthread_mutex_unlock(&e->lock);
+  }
+
+  return NULL;
+}
+
+/* Ask the reaper to exit once everything before it has completed. */
+static void uring_stop(struct aio_engine *e)
+{
+  unsigned tail, idx;
+
+  pthread_mutex_lock(&e->lock);
+  while (e->ring_used >= e->sq_entries) {
+    pthread_mutex_unlock(&e->lock);
+    sched_yield();
+    pthread_mutex_lock(&e->lock);
+  }
+  tail = *e->sq_tail;
+  idx = tail & *e->sq_mask;
+  memset(&e->sqes[idx], 0, sizeof(e->sqes[idx]));
+  e->sqes[idx].opcode = IORING_OP_NOP;
+  e->sq_array[idx] = idx;
+  ++e->ring_used;
+  __atomic_store_n(e->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  /* the kernel takes entries in ring order: any left over go first */
+  while ((syscall(__NR_io_uring_enter, e->ring_fd, e->unsubmitted + 1, 0, 0,
+                  NULL, 0) < 0) && (errno == EINTR))
+    ;
+  e->unsubmitted = 0;
+  pthread_mutex_unlock(&e->lock);
+}
+
+/******************************************************************************/
+static void *worker(void *arg)
+{
+  struct aio_engine *e = arg;
+
+  pthread_mutex_lock(&e->lock);
+  for (;;) {
+    struct disk_aio *req;
+
+    while (!e->head && !e->stopping)
+      pthread_cond_wait(&e->work, &e->lock);
+    if (!(req = dequeue(e)))
+      break;
+    pthread_mutex_unlock(&e->lock);
+
+    complete(e, req, e->sync_io(e->ctx, req));
+
+    pthread_mutex_lock(&e->lock);
+  }
+  pthread_mutex_unlock(&e->lock);
+
+  return NULL;
+}
+
+/******************************************************************************/
+struct aio_engine *aio_engine_create(int fd, int block_size, int mode,
+                                     aio_sync_io sync_io, void *ctx)
+{
+  struct aio_engine *e;
+  int want;
+
+  if (!sync_io || (block_size <= 0)) {
+    fprintf(stderr, "aio_engine_create: invalid configuration\n");
+    return NULL;
+  }
+
+  if (!(e = calloc(1, sizeof(*e)))) {
+    fprintf(stderr, "aio_engine_create: out of memory\n");
+    return NULL;
+  }
+
+  pthread_mutex_init(&e->lock, NULL);
+  pthread_cond_init(&e->idle, NULL);
+  pthread_cond_init(&e->work, NULL);
+  e->sync_io = sync_io;
+  e->ctx = ctx;
+  e->block_size = block_size;
+  e->fd = fd;
+  e->ring_fd = -1;
+
+  /* without io_uring (old kernel, seccomp, ...) fall back to threads */
+  if ((fd >= 0) && (mode == AIO_ENGINE_AUTO) && (uring_setup(e) == 0)) {
+    e->stats.uring = 1;
+    want = 1;
+  } else {
+    want = AIO_WORKERS;
+  }
+
+  for (e->nthreads = 0; e->nthreads < want; ++e->nthreads)
+    if (pthread_create(&e->threads[e->nthreads], NULL,
+                       e->stats.uring ? uring_reaper : worker, e) != 0)
+      break;
+
+  if (!e->nthreads) {
+    fprintf(stderr, "aio_engine_create: cannot start a thread\n");
+    if (e->stats.uring)
+      uring_teardown(e);
+    pthread_cond_destroy(&e->work);
+    pthread_cond_destroy(&e->idle);
+    pthread_mutex_destroy(&e->lock);
+    free(e);
+    return NULL;
+  }
+
+  return e;
+}
+
+int aio_engine_submit(struct aio_engine *e, struct disk_aio **reqs, int n)
+{
+  int i;
+
+  for (i = 0; i < n; ++i)
+    if (!reqs[i] || !reqs[i]->done || (reqs[i]->iovcnt <= 0)) {
+      fprintf(stderr, "aio_engine_submit: invalid request\n");
+      return -1;
+    }
+
+  pthread_mutex_lock(&e->lock);
+  for (i = 0; i < n; ++i)
+    enqueue(e, reqs[i]);
+
+  e->stats.submitted += n;
+  e->stats.batches++;
+  e->stats.in_flight += n;
+  if (e->stats.in_flight > e->stats.max_in_flight)
+    e->stats.max_in_flight = e->stats.in_flight;
+
+  if (e->stats.uring)
+    uring_push(e);
+  else
+    pthread_cond_broadcast(&e->work);
+  pthread_mutex_unlock(&e->lock);
+
+  return 0;
+}
+
+void aio_engine_drain(struct aio_engine *e)
+{
+  pthread_mutex_lock(&e->lock);
+  while (e->stats.in_flight > 0)
+    pthread_cond_wait(&e->idle, &e->lock);
+  pthread_mutex_unlock(&e->lock);
+}
+
+void aio_engine_destroy(struct aio_engine *e)
+{
+  if (!e)
+    return;
+
+  aio_engine_drain(e);
+
+  if (e->stats.uring) {
+    uring_stop(e);
+  } else {
+    pthread_mutex_lock(&e->lock);
+    e->stopping = 1;
+    pthread_cond_broadcast(&e->work);
+    pthread_mutex_unlock(&e->lock);
+  }
+
+  for (int i = 0; i < e->nthreads; ++i)
+    pthread_join(e->threads[i], NULL);
+
+  if (e->stats.uring)
+    uring_teardown(e);
+  pthread_cond_destroy(&e->work);
+  pthread_cond_destroy(&e->idle);
+  pthread_mutex_destroy(&e->lock);
+  free(e);
+}
+
+void aio_engine_get_stats(struct aio_engine *e, struct aio_engine_stats *st)
+{
+  pthread_mutex_lock(&e->lock);
+  *st = e->stats;
+  pthread_mutex_unlock(&e->lock);
+}
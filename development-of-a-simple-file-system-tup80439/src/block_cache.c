@@ -0,0 +1,457 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "disk.h"
+#include "block_cache.h"
+
+/******************************************************************************/
+typedef struct {
+  int block;                   /* disk block held here, -1 if unused          */
+  int next;                    /* next entry in the same hash bucket          */
+  int pins;                    /* outstanding block_cache_pin references      */
+  unsigned char referenced;    /* CLOCK reference bit                         */
+  unsigned char dirty;         /* modified since it was last written back     */
+} cache_entry;
+
+struct block_cache {
+  cache_entry *entries;
+  char *arena;                 /* capacity * block_size bytes of block data   */
+  int *buckets;                /* hash heads, block & (num_buckets - 1)       */
+  int num_buckets;
+  int capacity;
+  int block_size;              /* bytes per block                             */
+  int hand;                    /* CLOCK hand                                  */
+  block_device_io device;
+  void *device_ctx;            /* first argument of every device call         */
+  struct block_cache_stats stats;
+  unsigned long device_writes;         /* bumped on every write to device */
+  pthread_mutex_t lock;                /* guards everything above        */
+};
+
+#define ENTRY_DATA(bc, e) ((bc)->arena + (size_t)(e) * (bc)->block_size)
+
+/******************************************************************************/
+static int lookup(struct block_cache *bc, int block)
+{
+  int e;
+
+  for (e = bc->buckets[block & (bc->num_buckets - 1)]; e != -1;
+       e = bc->entries[e].next)
+    if (bc->entries[e].block == block)
+      return e;
+
+  return -1;
+}
+
+static void unhash(struct block_cache *bc, int e)
+{
+  int *link = &bc->buckets[bc->entries[e].block & (bc->num_buckets - 1)];
+
+  while (*link != e)
+    link = &bc->entries[*link].next;
+  *link = bc->entries[e].next;
+
+  bc->entries[e].block = -1;
+  bc->entries[e].next = -1;
+  bc->stats.used--;
+}
+
+static int device_transfer(struct block_cache *bc, int is_write, int block,
+                           char *data, int count)
+{
+  struct iovec iov;
+
+  iov.iov_base = data;
+  iov.iov_len = (size_t)count * bc->block_size;
+
+  if (is_write)
+    bc->device_writes++;
+
+  return bc->device(bc->device_ctx, is_write, block, &iov, 1);
+}
+
+/* Pick an entry with the CLOCK algorithm, write it back if it is dirty and
+ * detach it from its block.  Returns -1 if every entry is pinned.            */
+static int reclaim(struct block_cache *bc)
+{
+  int scanned;
+
+  for (scanned = 0; scanned < 2 * bc->capacity; ++scanned) {
+    int e = bc->hand;
+    cache_entry *ce = &bc->entries[e];
+
+    bc->hand = (bc->hand + 1) % bc->capacity;
+
+    if (ce->block == -1)
+      return e;
+    if (ce->pins)
+      continue;
+    if (ce->referenced) {
+      ce->referenced = 0;
+      continue;
+    }
+
+    if (ce->dirty) {
+      if (device_transfer(bc, 1, ce->block, ENTRY_DATA(bc, e), 1) < 0)
+        return -1;
+      ce->dirty = 0;
+      bc->stats.dirty--;
+      bc->stats.writebacks++;
+    }
+
+    unhash(bc, e);
+    bc->stats.evictions++;
+    return e;
+  }
+
+  return -1;
+}
+
+static int insert(struct block_cache *bc, int block)
+{
+  int e = reclaim(bc);
+  int *head;
+
+  if (e < 0)
+    return -1;
+
+  head = &bc->buckets[block & (bc->num_buckets - 1)];
+  bc->entries[e].block = block;
+  bc->entries[e].next = *head;
+  bc->entries[e].pins = 0;
+  bc->entries[e].referenced = 1;
+  bc->entries[e].dirty = 0;
+  *head = e;
+  bc->stats.used++;
+
+  return e;
+}
+
+/******************************************************************************/
+struct block_cache *block_cache_create(int blocks, int block_size,
+                                       block_device_io io, void *device_ctx)
+{
+  struct block_cache *bc;
+  int i;
+
+  if ((blocks <= 0) || (block_size <= 0) || !io) {
+    fprintf(stderr, "block_cache_create: invalid configuration\n");
+    return NULL;
+  }
+
+  if (!(bc = calloc(1, sizeof(*bc)))) {
+    fprintf(stderr, "block_cache_create: out of memory\n");
+    return NULL;
+  }
+
+  for (bc->num_buckets = 1; bc->num_buckets < blocks; bc->num_buckets <<= 1)
+    ;
+
+  bc->entries = malloc(sizeof(cache_entry) * blocks);
+  bc->block_size = block_size;
+  bc->arena = malloc((size_t)blocks * block_size);
+  bc->buckets = malloc(sizeof(int) * bc->num_buckets);
+  if (!bc->entries || !bc->arena || !bc->buckets) {
+    fprintf(stderr, "block_cache_create: out of memory\n");
+    free(bc->entries);
+    free(bc->arena);
+    free(bc->buckets);
+    free(bc);
+    return NULL;
+  }
+
+  for (i = 0; i < blocks; ++i) {
+    bc->entries[i].block = -1;
+    bc->entries[i].next = -1;
+    bc->entries[i].pins = 0;
+    bc->entries[i].referenced = 0;
+    bc->entries[i].dirty = 0;
+  }
+  for (i = 0; i < bc->num_buckets; ++i)
+    bc->buckets[i] = -1;
+
+  bc->capacity = blocks;
+  bc->hand = 0;
+  bc->device = io;
+  bc->device_ctx = device_ctx;
+  bc->stats.capacity = blocks;
+  pthread_mutex_init(&bc->lock, NULL);
+
+  return bc;
+}
+
+void block_cache_destroy(struct block_cache *bc)
+{
+  if (!bc)
+    return;
+
+  pthread_mutex_destroy(&bc->lock);
+  free(bc->entries);
+  free(bc->arena);
+  free(bc->buckets);
+  free(bc);
+}
+
+int block_cache_read(struct block_cache *bc, int start, int count, char *buf)
+{
+  int i = 0;
+
+  pthread_mutex_lock(&bc->lock);
+  while (i < count) {
+    int e = lookup(bc, start + i);
+    int j, rc;
+    unsigned long generation;
+
+    if (e >= 0) {
+      memcpy(buf + (size_t)i * bc->block_size, ENTRY_DATA(bc, e),
+             bc->block_size);
+      bc->entries[e].referenced = 1;
+      bc->stats.hits++;
+      ++i;
+      continue;
+    }
+
+    /* fetch the whole run of missing blocks straight into buf, without
+     * holding the lock so that other threads' hits are not stalled         */
+    for (j = i + 1; (j < count) && (lookup(bc, start + j) < 0); ++j)
+      ;
+    generation = bc->device_writes;
+    pthread_mutex_unlock(&bc->lock);
+    rc = device_transfer(bc, 0, start + i, buf + (size_t)i * bc->block_size,
+                         j - i);
+    pthread_mutex_lock(&bc->lock);
+    if (rc < 0) {
+      pthread_mutex_unlock(&bc->lock);
+      return -1;
+    }
+    bc->stats.misses += j - i;
+
+    for (; i < j; ++i) {
+      char *dst = buf + (size_t)i * bc->block_size;
+
+      /* another thread cached the block meanwhile: its copy is newest */
+      if ((e = lookup(bc, start + i)) >= 0) {
+        memcpy(dst, ENTRY_DATA(bc, e), bc->block_size);
+        continue;
+      }
+      /* a write-back may have raced with our read; fetch it again */
+      if ((bc->device_writes != generation) &&
+          (device_transfer(bc, 0, start + i, dst, 1) < 0)) {
+        pthread_mutex_unlock(&bc->lock);
+        return -1;
+      }
+      e = insert(bc, start + i);
+      if (e < 0)
+        continue;      /* everything is pinned; serve this one uncached */
+      memcpy(ENTRY_DATA(bc, e), dst, bc->block_size);
+    }
+  }
+  pthread_mutex_unlock(&bc->lock);
+
+  return 0;
+}
+
+int block_cache_prefetch(struct block_cache *bc, int start, int count)
+{
+  char *buf;
+  int i = 0;
+  int rc = 0;
+
+  if (!(buf = malloc((size_t)count * bc->block_size))) {
+    fprintf(stderr, "block_cache_prefetch: out of memory\n");
+    return -1;
+  }
+
+  pthread_mutex_lock(&bc->lock);
+  while (i < count) {
+    int j;
+    unsigned long generation;
+
+    if (lookup(bc, start + i) >= 0) {
+      ++i;
+      continue;
+    }
+
+    for (j = i + 1; (j < count) && (lookup(bc, start + j) < 0); ++j)
+      ;
+    generation = bc->device_writes;
+    pthread_mutex_unlock(&bc->lock);
+    rc = device_transfer(bc, 0, start + i, buf + (size_t)i * bc->block_size,
+                         j - i);
+    pthread_mutex_lock(&bc->lock);
+    if (rc < 0)
+      break;
+
+    /* a write-back may have raced with our read; unlike block_cache_read
+     * nobody is waiting for these blocks, so just leave them out            */
+    if (bc->device_writes != generation) {
+      i = j;
+      continue;
+    }
+
+    for (; i < j; ++i) {
+      int e;
+
+      if (lookup(bc, start + i) >= 0)
+        continue;
+      if ((e = insert(bc, start + i)) < 0)
+        continue;
+      memcpy(ENTRY_DATA(bc, e), buf + (size_t)i * bc->block_size,
+             bc->block_size);
+      bc->stats.readahead++;
+    }
+  }
+  pthread_mutex_unlock(&bc->lock);
+  free(buf);
+
+  return rc;
+}
+
+int block_cache_write(struct block_cache *bc, int start, int count, char *buf)
+{
+  int i;
+
+  pthread_mutex_lock(&bc->lock);
+  for (i = 0; i < count; ++i) {
+    char *src = buf + (size_t)i * bc->block_size;
+    int e = lookup(bc, start + i);
+
+    if (e < 0)
+      e = insert(bc, start + i);
+    if (e < 0) {
+      if (device_transfer(bc, 1, start + i, src, 1) < 0) {
+        pthread_mutex_unlock(&bc->lock);
+        return -1;
+      }
+      continue;
+    }
+
+    memcpy(ENTRY_DATA(bc, e), src, bc->block_size);
+    bc->entries[e].referenced = 1;
+    if (!bc->entries[e].dirty) {
+      bc->entries[e].dirty = 1;
+      bc->stats.dirty++;
+    }
+  }
+  pthread_mutex_unlock(&bc->lock);
+
+  return 0;
+}
+
+typedef struct {
+  int block;
+  int entry;
+} dirty_ref;
+
+static int compare_by_block(const void *a, const void *b)
+{
+  int x = ((const dirty_ref *)a)->block;
+  int y = ((const dirty_ref *)b)->block;
+
+  return (x > y) - (x < y);
+}
+
+int block_cache_flush(struct block_cache *bc)
+{
+  struct iovec iov[DISK_IOV_MAX];
+  dirty_ref *order;
+  int n = 0, i, j;
+  int rc = 0;
+
+  pthread_mutex_lock(&bc->lock);
+  if (!bc->stats.dirty) {
+    pthread_mutex_unlock(&bc->lock);
+    return 0;
+  }
+
+  if (!(order = malloc(sizeof(dirty_ref) * bc->stats.dirty))) {
+    pthread_mutex_unlock(&bc->lock);
+    fprintf(stderr, "block_cache_flush: out of memory\n");
+    return -1;
+  }
+
+  for (i = 0; i < bc->capacity; ++i)
+    if ((bc->entries[i].block != -1) && bc->entries[i].dirty) {
+      order[n].block = bc->entries[i].block;
+      order[n++].entry = i;
+    }
+  qsort(order, n, sizeof(dirty_ref), compare_by_block);
+
+  for (i = 0; i < n; i = j) {
+    int first = order[i].block;
+
+    for (j = i; (j < n) && (j - i < DISK_IOV_MAX) &&
+                (order[j].block == first + (j - i)); ++j) {
+      iov[j - i].iov_base = ENTRY_DATA(bc, order[j].entry);
+      iov[j - i].iov_len = bc->block_size;
+    }
+
+    bc->device_writes++;
+    if (bc->device(bc->device_ctx, 1, first, iov, j - i) < 0) {
+      rc = -1;
+      continue;
+    }
+
+    for (int k = i; k < j; ++k)
+      bc->entries[order[k].entry].dirty = 0;
+    bc->stats.dirty -= j - i;
+    bc->stats.writebacks += j - i;
+  }
+
+  pthread_mutex_unlock(&bc->lock);
+  free(order);
+
+  return rc;
+}
+
+char *block_cache_pin(struct block_cache *bc, int block)
+{
+  int e;
+
+  pthread_mutex_lock(&bc->lock);
+  if ((e = lookup(bc, block)) >= 0) {
+    bc->stats.hits++;
+  } else {
+    if ((e = insert(bc, block)) < 0) {
+      pthread_mutex_unlock(&bc->lock);
+      return NULL;
+    }
+    if (device_transfer(bc, 0, block, ENTRY_DATA(bc, e), 1) < 0) {
+      unhash(bc, e);
+      pthread_mutex_unlock(&bc->lock);
+      return NULL;
+    }
+    bc->stats.misses++;
+  }
+
+  bc->entries[e].referenced = 1;
+  bc->entries[e].pins++;
+  pthread_mutex_unlock(&bc->lock);
+
+  return ENTRY_DATA(bc, e);
+}
+
+int block_cache_unpin(struct block_cache *bc, const char *data)
+{
+  size_t e;
+
+  if ((data < bc->arena) ||
+      (data >= bc->arena + (size_t)bc->capacity * bc->block_size))
+    return 0;
+
+  e = (size_t)(data - bc->arena) / bc->block_size;
+  pthread_mutex_lock(&bc->lock);
+  if (bc->entries[e].pins > 0)
+    bc->entries[e].pins--;
+  pthread_mutex_unlock(&bc->lock);
+  return 1;
+}
+
+void block_cache_get_stats(struct block_cache *bc, struct block_cache_stats *st)
+{
+  pthread_mutex_lock(&bc->lock);
+  *st = bc->stats;
+  pthread_mutex_unlock(&bc->lock);
+}
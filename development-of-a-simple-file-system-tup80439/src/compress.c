@@ -0,0 +1,178 @@
+#include "compress.h"
+#include <stdint.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+#define HASH_BITS 12
+#define MAX_OFFSET 65535
+#define LAST_LITERALS 5     // The last bytes of the input are always literals
+#define MATCH_LIMIT 12      // No match starts in the last bytes of the input
+#define SKIP_TRIGGER 6      // Misses in a row before the search speeds up
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static unsigned int hash4(uint32_t value) {
+    return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Write a length of 15 or more as the bytes following its token
+static unsigned char *put_length(unsigned char *out, int length) {
+    for (length -= 15; length >= 255; length -= 255) {
+        *out++ = 255;
+    }
+    *out++ = (unsigned char)length;
+    return out;
+}
+
+// Append a sequence of literals followed by a match (none if match_length is
+// 0). Returns the new end of the output, or NULL if it does not fit.
+static unsigned char *put_sequence(unsigned char *out, const unsigned char *out_end, const unsigned char *literals,
+                                   int literal_length, int offset, int match_length) {
+    int match_code = match_length > 0 ? match_length - MIN_MATCH : 0;
+    // Token, length bytes, literals and offset at most
+    if (out_end - out < 1 + literal_length / 255 + 1 + literal_length + 2 + match_code / 255 + 1) {
+        return NULL;
+    }
+
+    unsigned char *token = out++;
+    *token = (unsigned char)((literal_length < 15 ? literal_length : 15) << 4);
+    if (literal_length >= 15) {
+        out = put_length(out, literal_length);
+    }
+    memcpy(out, literals, literal_length);
+    out += literal_length;
+
+    if (match_length > 0) {
+        *out++ = (unsigned char)offset;
+        *out++ = (unsigned char)(offset >> 8);
+        *token |= match_code < 15 ? match_code : 15;
+        if (match_code >= 15) {
+            out = put_length(out, match_code);
+        }
+    }
+    return out;
+}
+
+int lz_compress(const char *src, int src_len, char *dst, int dst_cap) {
+    const unsigned char *in = (const unsigned char *)src;
+    unsigned char *out = (unsigned char *)dst;
+    const unsigned char *out_end = out + dst_cap;
+    int table[1 << HASH_BITS]; // Last position + 1 with each hash, 0 if none
+    memset(table, 0, sizeof(table));
+
+    int anchor = 0; // First byte not covered by a sequence yet
+    int pos = 0;
+    int misses = 0;
+    while (pos < src_len - MATCH_LIMIT) {
+        uint32_t sequence = read32(in + pos);
+        unsigned int hash = hash4(sequence);
+        int candidate = table[hash] - 1;
+        table[hash] = pos + 1;
+        if (candidate < 0 || pos - candidate > MAX_OFFSET || read32(in + candidate) != sequence) {
+            // Step further the longer nothing matches, so incompressible data
+            // passes quickly
+            pos += 1 + (misses++ >> SKIP_TRIGGER);
+            continue;
+        }
+        misses = 0;
+
+        // Grow the match backwards over the pending literals, then forwards
+        while (pos > anchor && candidate > 0 && in[pos - 1] == in[candidate - 1]) {
+            pos--;
+            candidate--;
+        }
+        int length = MIN_MATCH;
+        while (pos + length < src_len - LAST_LITERALS && in[pos + length] == in[candidate + length]) {
+            length++;
+        }
+
+        out = put_sequence(out, out_end, in + anchor, pos - anchor, pos - candidate, length);
+        if (out == NULL) {
+            return 0;
+        }
+        pos += length;
+        anchor = pos;
+    }
+
+    out = put_sequence(out, out_end, in + anchor, src_len - anchor, 0, 0);
+    return out != NULL ? (int)(out - (unsigned char *)dst) : 0;
+}
+
+// Read the length bytes following a token. Returns -1 past the end of the input.
+static int get_length(const unsigned char **in, const unsigned char *in_end, int length) {
+    unsigned char byte;
+    do {
+        if (*in >= in_end) {
+            return -1;
+        }
+        byte = *(*in)++;
+        length += byte;
+    } while (byte == 255);
+    return length;
+}
+
+int lz_decompress(const char *src, int src_len, char *dst, int dst_len) {
+    const unsigned char *in = (const unsigned char *)src;
+    const unsigned char *in_end = in + src_len;
+    char *out = dst;
+    char *out_end = dst + dst_len;
+
+    for (;;) {
+        if (in >= in_end) {
+            return -1;
+        }
+        unsigned char token = *in++;
+        int literal_length = token >> 4;
+        if (literal_length == 15 && (literal_length = get_length(&in, in_end, literal_length)) == -1) {
+            return -1;
+        }
+        if (literal_length > in_end - in || literal_length > out_end - out) {
+            return -1;
+        }
+        memcpy(out, in, literal_length);
+        out += literal_length;
+        in += literal_length;
+        if (in == in_end) {
+            break; // The last sequence has no match
+        }
+
+        if (in_end - in < 2) {
+            return -1;
+        }
+        int offset = in[0] | in[1] << 8;
+        in += 2;
+        int match_length = token & 15;
+        if (match_length == 15 && (match_length = get_length(&in, in_end, match_length)) == -1) {
+            return -1;
+        }
+        match_length += MIN_MATCH;
+        if (offset == 0 || offset > out - dst || match_length > out_end - out) {
+            return -1;
+        }
+
+        // A match may overlap what it produces: copy it in pieces no longer
+        // than its offset, eight bytes at a time where that is allowed
+        const char *match = out - offset;
+        if (offset >= match_length) {
+            memcpy(out, match, match_length);
+            out += match_length;
+        } else {
+            char *end = out + match_length;
+            if (offset >= 8) {
+                while (end - out >= 8) {
+                    memcpy(out, match, 8);
+                    out += 8;
+                    match += 8;
+                }
+            }
+            while (out < end) {
+                *out++ = *match++;
+            }
+        }
+    }
+    return out == out_end ? 0 : -1;
+}
@@ -0,0 +1,105 @@
+#include "dedup_index.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define UNINDEXED -2
+
+uint64_t dedup_hash(const char *data, size_t bytes) {
+    const uint64_t m = 0xc6a4a7935bd1e995ull;
+    const int r = 47;
+    uint64_t hash = 0x9747b28cull ^ (bytes * m);
+
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t i = 0; i + 8 <= bytes; i += 8) {
+        uint64_t k;
+        memcpy(&k, p + i, sizeof(k));
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        hash ^= k;
+        hash *= m;
+    }
+
+    // Up to seven bytes are left over
+    size_t tail = bytes & ~(size_t)7;
+    if (tail < bytes) {
+        for (size_t i = bytes; i-- > tail;) {
+            hash ^= (uint64_t)p[i] << (8 * (i - tail));
+        }
+        hash *= m;
+    }
+
+    hash ^= hash >> r;
+    hash *= m;
+    hash ^= hash >> r;
+    return hash;
+}
+
+static unsigned int bucket_of(const dedup_index *idx, uint64_t hash) {
+    return (unsigned int)(hash ^ (hash >> 32)) & idx->mask;
+}
+
+int dedup_index_init(dedup_index *idx, int blocks) {
+    memset(idx, 0, sizeof(*idx));
+    // One bucket per block at most, and always at least two
+    int buckets = 2;
+    while (buckets < blocks) {
+        buckets *= 2;
+    }
+    idx->mask = buckets - 1;
+    idx->blocks = blocks;
+
+    idx->buckets = malloc(buckets * sizeof(int));
+    idx->next = malloc(blocks * sizeof(int));
+    idx->hashes = malloc(blocks * sizeof(uint64_t));
+    if (idx->buckets == NULL || idx->next == NULL || idx->hashes == NULL) {
+        dedup_index_destroy(idx);
+        return -1;
+    }
+    for (int i = 0; i < buckets; i++) {
+        idx->buckets[i] = -1;
+    }
+    for (int i = 0; i < blocks; i++) {
+        idx->next[i] = UNINDEXED;
+    }
+    return 0;
+}
+
+void dedup_index_destroy(dedup_index *idx) {
+    free(idx->buckets);
+    free(idx->next);
+    free(idx->hashes);
+    memset(idx, 0, sizeof(*idx));
+}
+
+int dedup_index_find(const dedup_index *idx, uint64_t hash) {
+    for (int block = idx->buckets[bucket_of(idx, hash)]; block != -1; block = idx->next[block]) {
+        if (idx->hashes[block] == hash) {
+            return block;
+        }
+    }
+    return -1;
+}
+
+void dedup_index_insert(dedup_index *idx, int block, uint64_t hash) {
+    unsigned int bucket = bucket_of(idx, hash);
+    idx->hashes[block] = hash;
+    idx->next[block] = idx->buckets[bucket];
+    idx->buckets[bucket] = block;
+}
+
+void dedup_index_remove(dedup_index *idx, int block) {
+    if (!dedup_index_contains(idx, block)) {
+        return;
+    }
+    int *link = &idx->buckets[bucket_of(idx, idx->hashes[block])];
+    while (*link != block) {
+        link = &idx->next[*link];
+    }
+    *link = idx->next[block];
+    idx->next[block] = UNINDEXED;
+}
+
+int dedup_index_contains(const dedup_index *idx, int block) {
+    return idx->next != NULL && block >= 0 && block < idx->blocks && idx->next[block] != UNINDEXED;
+}
@@ -197,37 +197,9 @@ int main() {
             scanf("%s", filename);
             printf("Enter destination filename: ");
             scanf("%s", copy_filename);
-            {
-                int src_fd = fs_open(filename);
-                if (src_fd < 0) {
-                    printf(RED "Failed to open source file '%s'.\n" RESET, filename);
-                    break;
-                }
-
-                if (fs_create(copy_filename) != 0) {
-                    printf(RED "Failed to create destination file '%s'.\n" RESET, copy_filename);
-                    fs_close(src_fd);
-                    break;
-                }
-
-                int dest_fd = fs_open(copy_filename);
-                if (dest_fd < 0) {
-                    printf(RED "Failed to open destination file '%s'.\n" RESET, copy_filename);
-                    fs_close(src_fd);
-                    break;
-                }
-
-                char buffer[BLOCK_SIZE];
-                int bytes;
-                while ((bytes = fs_read(src_fd, buffer, BLOCK_SIZE)) > 0) {
-                    if (fs_write(dest_fd, buffer, bytes) != bytes) {
-                        printf(RED "Error writing to destination file.\n" RESET);
-                        break;
-                    }
-                }
-
-                fs_close(src_fd);
-                fs_close(dest_fd);
+            if (fs_copy(filename, copy_filename, 0) != 0) {
+                printf(RED "Failed to copy '%s' to '%s'.\n" RESET, filename, copy_filename);
+            } else {
                 printf(GREEN "File '%s' copied to '%s'.\n" RESET, filename, copy_filename);
             }
             break;
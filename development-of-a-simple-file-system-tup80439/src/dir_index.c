@@ -0,0 +1,169 @@
+#include "dir_index.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NAME_LENGTH ((int)sizeof(((files *)0)->filename))
+
+// FNV-1a over the parent id and the name, which need not be terminated
+// within NAME_LENGTH
+static unsigned int hash_name(int parent, const char *name) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < (int)sizeof(parent); i++) {
+        hash ^= (unsigned char)(parent >> (8 * i));
+        hash *= 16777619u;
+    }
+    for (int i = 0; i < NAME_LENGTH && name[i] != '\0'; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static unsigned int home_bucket(const dir_index *idx, const files *entry) {
+    return hash_name(entry->parent, entry->filename) & idx->mask;
+}
+
+static void set_free(dir_index *idx, int slot, int is_free) {
+    uint64_t bit = (uint64_t)1 << (slot % 64);
+    if (is_free) {
+        idx->free[slot / 64] |= bit;
+    } else {
+        idx->free[slot / 64] &= ~bit;
+    }
+}
+
+// Is parent the id of a directory entry (or of the root)?
+static int is_directory(const files *dir, int slots, int parent) {
+    return parent == ROOT_DIR_ID || (parent > 0 && parent <= slots && dir[parent - 1].isFile == ENTRY_DIR);
+}
+
+int dir_index_build(dir_index *idx, const files *dir, int slots) {
+    dir_index_destroy(idx);
+
+    int buckets = 1;
+    while (buckets < 2 * slots) {
+        buckets *= 2;
+    }
+    idx->buckets = malloc(buckets * sizeof(int));
+    idx->free = calloc((slots + 63) / 64, sizeof(uint64_t));
+    idx->first_child = malloc((slots + 1) * sizeof(int));
+    idx->next_sibling = malloc(slots * sizeof(int));
+    idx->prev_sibling = malloc(slots * sizeof(int));
+    if (idx->buckets == NULL || idx->free == NULL || idx->first_child == NULL ||
+        idx->next_sibling == NULL || idx->prev_sibling == NULL) {
+        fprintf(stderr, "Error: Out of memory for directory index.\n");
+        dir_index_destroy(idx);
+        return -1;
+    }
+    memset(idx->buckets, -1, buckets * sizeof(int));
+    memset(idx->first_child, -1, (slots + 1) * sizeof(int));
+    idx->mask = buckets - 1;
+    idx->slots = slots;
+
+    for (int i = 0; i < slots; i++) {
+        if (!dir[i].isFile) {
+            set_free(idx, i, 1);
+        } else if (!is_directory(dir, slots, dir[i].parent)) {
+            fprintf(stderr, "Warning: Entry '%.*s' in slot %d has no parent directory.\n", NAME_LENGTH, dir[i].filename, i);
+        } else if (dir_index_find(idx, dir, dir[i].parent, dir[i].filename) == -1) {
+            dir_index_insert(idx, dir, i);
+        } else {
+            // Keep the first of two entries with one name, as lookups always found it
+            fprintf(stderr, "Warning: Duplicate file name '%.*s' in slot %d.\n", NAME_LENGTH, dir[i].filename, i);
+        }
+    }
+    return 0;
+}
+
+void dir_index_destroy(dir_index *idx) {
+    free(idx->buckets);
+    free(idx->free);
+    free(idx->first_child);
+    free(idx->next_sibling);
+    free(idx->prev_sibling);
+    memset(idx, 0, sizeof(*idx));
+}
+
+int dir_index_find(const dir_index *idx, const files *dir, int parent, const char *name) {
+    if (idx->buckets == NULL) {
+        return -1;
+    }
+    for (unsigned int b = hash_name(parent, name) & idx->mask; idx->buckets[b] != -1; b = (b + 1) & idx->mask) {
+        const files *entry = &dir[idx->buckets[b]];
+        if (entry->parent == parent && strncmp(entry->filename, name, NAME_LENGTH) == 0) {
+            return idx->buckets[b];
+        }
+    }
+    return -1;
+}
+
+int dir_index_first(const dir_index *idx, int parent) {
+    return idx->first_child != NULL && parent >= 0 && parent <= idx->slots ? idx->first_child[parent] : -1;
+}
+
+int dir_index_next(const dir_index *idx, int slot) {
+    return idx->next_sibling[slot];
+}
+
+int dir_index_free_slot(const dir_index *idx) {
+    for (int word = 0; word < (idx->slots + 63) / 64; word++) {
+        if (idx->free[word] != 0) {
+            return word * 64 + __builtin_ctzll(idx->free[word]);
+        }
+    }
+    return -1;
+}
+
+void dir_index_insert(dir_index *idx, const files *dir, int slot) {
+    unsigned int b = home_bucket(idx, &dir[slot]);
+    while (idx->buckets[b] != -1) {
+        b = (b + 1) & idx->mask;
+    }
+    idx->buckets[b] = slot;
+    set_free(idx, slot, 0);
+
+    // Link at the head of the parent's list
+    int parent = dir[slot].parent;
+    idx->prev_sibling[slot] = -1;
+    idx->next_sibling[slot] = idx->first_child[parent];
+    if (idx->first_child[parent] != -1) {
+        idx->prev_sibling[idx->first_child[parent]] = slot;
+    }
+    idx->first_child[parent] = slot;
+}
+
+void dir_index_remove(dir_index *idx, const files *dir, int slot) {
+    set_free(idx, slot, 1);
+    unsigned int hole = home_bucket(idx, &dir[slot]);
+    while (idx->buckets[hole] != slot) {
+        if (idx->buckets[hole] == -1) {
+            return; // Not indexed (a duplicate name or an orphan)
+        }
+        hole = (hole + 1) & idx->mask;
+    }
+
+    int prev = idx->prev_sibling[slot];
+    int next = idx->next_sibling[slot];
+    if (prev != -1) {
+        idx->next_sibling[prev] = next;
+    } else {
+        idx->first_child[dir[slot].parent] = next;
+    }
+    if (next != -1) {
+        idx->prev_sibling[next] = prev;
+    }
+
+    // Shift later entries of the probe sequence back into the hole, so that
+    // no lookup stops early at it
+    idx->buckets[hole] = -1;
+    for (unsigned int b = (hole + 1) & idx->mask; idx->buckets[b] != -1; b = (b + 1) & idx->mask) {
+        unsigned int home = home_bucket(idx, &dir[idx->buckets[b]]);
+        // Movable unless its home lies cyclically in (hole, b]
+        if (((b - home) & idx->mask) >= ((b - hole) & idx->mask)) {
+            idx->buckets[hole] = idx->buckets[b];
+            idx->buckets[b] = -1;
+            hole = b;
+        }
+    }
+}
@@ -3,21 +3,263 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include "disk.h"
 
 /******************************************************************************/
-static int active = 0;  /* is the virtual disk open (active) */
-static int handle;      /* file handle to virtual disk       */
+struct disk {
+  int handle;                  /* file handle to virtual disk                 */
+  char *mapping;               /* image, in DISK_BACKEND_MMAP                 */
+  struct block_cache *cache;   /* NULL when mapped or the cache is disabled   */
+  struct aio_engine *aio;      /* started by the first asynchronous request   */
+  int block_size;              /* bytes per block                             */
+  int blocks;                  /* whole blocks in the image                   */
+};
+
+static int backend = DISK_BACKEND_PIO;   /* backend used by open_disk_ex  */
+static int cache_blocks = DISK_CACHE_DEFAULT_BLOCKS;
+                                         /* cache size used by open_disk_ex */
+static disk_t *default_disk = NULL;      /* disk behind the legacy calls  */
+static int aio_mode = AIO_ENGINE_AUTO;   /* engine kind for new disks     */
+static pthread_mutex_t aio_start_lock = PTHREAD_MUTEX_INITIALIZER;
+                                         /* serializes engine start-up    */
 
 /******************************************************************************/
+static int check_range(disk_t *disk, const char *who, int start, int count)
+{
+  if (!disk) {
+    fprintf(stderr, "%s: disk not active\n", who);
+    return -1;
+  }
+
+  if ((start < 0) || (count < 0) || (start >= disk->blocks) ||
+      (count > disk->blocks - start)) {
+    fprintf(stderr, "%s: block index out of bounds\n", who);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Transfer every byte described by iov at byte offset pos, restarting the
+ * call after short transfers and EINTR.  Reads past the end of the image
+ * come back as zeroes, exactly like a freshly created disk.                  */
+static int transfer_all(disk_t *disk, const char *who, int is_write,
+                        struct iovec *iov, int iovcnt, off_t pos)
+{
+  if (disk->mapping) {
+    for (int i = 0; i < iovcnt; ++i) {
+      if (is_write)
+        memcpy(disk->mapping + pos, iov[i].iov_base, iov[i].iov_len);
+      else
+        memcpy(iov[i].iov_base, disk->mapping + pos, iov[i].iov_len);
+      pos += iov[i].iov_len;
+    }
+    return 0;
+  }
+
+  while (iovcnt > 0) {
+    int n = iovcnt < DISK_IOV_MAX ? iovcnt : DISK_IOV_MAX;
+    ssize_t done = is_write ? pwritev(disk->handle, iov, n, pos)
+                            : preadv(disk->handle, iov, n, pos);
+
+    if (done < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "%s: failed to %s: %s\n", who,
+              is_write ? "write" : "read", strerror(errno));
+      return -1;
+    }
+
+    if (done == 0) {
+      if (is_write) {
+        fprintf(stderr, "%s: device accepted no data\n", who);
+        return -1;
+      }
+      for (int i = 0; i < iovcnt; ++i)
+        memset(iov[i].iov_base, 0, iov[i].iov_len);
+      return 0;
+    }
+
+    pos += done;
+    while (iovcnt > 0 && (size_t)done >= iov->iov_len) {
+      done -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + done;
+      iov->iov_len -= done;
+    }
+  }
+
+  return 0;
+}
+
+/* Uncached transfer used by the block cache to reach the image.             */
+static int device_io(void *device, int is_write, int start,
+                     const struct iovec *iov, int iovcnt)
+{
+  disk_t *disk = device;
+  struct iovec local[DISK_IOV_MAX];
+
+  memcpy(local, iov, sizeof(struct iovec) * iovcnt);
+
+  return transfer_all(disk, is_write ? "block_write" : "block_read",
+                      is_write, local, iovcnt,
+                      (off_t)start * disk->block_size);
+}
+
+/* Route a vector through the block cache, one segment at a time when every
+ * segment holds whole blocks, otherwise through a linear staging buffer.     */
+static int cached_vector_io(disk_t *disk, int is_write, int start,
+                            const struct iovec *iov, int iovcnt, size_t total)
+{
+  char *staging;
+  size_t pos = 0;
+  int i, rc = 0;
+
+  for (i = 0; i < iovcnt; ++i)
+    if (iov[i].iov_len % disk->block_size)
+      break;
+
+  if (i == iovcnt) {
+    for (i = 0; (i < iovcnt) && (rc == 0); ++i) {
+      int count = (int)(iov[i].iov_len / disk->block_size);
+
+      rc = is_write
+             ? block_cache_write(disk->cache, start, count, iov[i].iov_base)
+             : block_cache_read(disk->cache, start, count, iov[i].iov_base);
+      start += count;
+    }
+    return rc;
+  }
+
+  if (!(staging = malloc(total))) {
+    fprintf(stderr, "block_vector_io: out of memory\n");
+    return -1;
+  }
+
+  if (is_write) {
+    for (i = 0; i < iovcnt; pos += iov[i++].iov_len)
+      memcpy(staging + pos, iov[i].iov_base, iov[i].iov_len);
+    rc = block_cache_write(disk->cache, start,
+                           (int)(total / disk->block_size), staging);
+  } else {
+    rc = block_cache_read(disk->cache, start,
+                          (int)(total / disk->block_size), staging);
+    for (i = 0; (i < iovcnt) && (rc == 0); pos += iov[i++].iov_len)
+      memcpy(iov[i].iov_base, staging + pos, iov[i].iov_len);
+  }
+
+  free(staging);
+
+  return rc;
+}
+
+static int block_vector_io(disk_t *disk, const char *who, int is_write,
+                           int start, const struct iovec *iov, int iovcnt)
+{
+  struct iovec local[DISK_IOV_MAX];
+  size_t total = 0;
+
+  if ((iovcnt <= 0) || (iovcnt > DISK_IOV_MAX)) {
+    fprintf(stderr, "%s: invalid iovec count %d\n", who, iovcnt);
+    return -1;
+  }
+
+  for (int i = 0; i < iovcnt; ++i) {
+    total += iov[i].iov_len;
+    local[i] = iov[i];
+  }
+
+  if (total % disk->block_size) {
+    fprintf(stderr, "%s: transfer is not a whole number of blocks\n", who);
+    return -1;
+  }
+
+  if (check_range(disk, who, start, (int)(total / disk->block_size)) < 0)
+    return -1;
+
+  if (disk->cache)
+    return cached_vector_io(disk, is_write, start, iov, iovcnt, total);
+
+  return transfer_all(disk, who, is_write, local, iovcnt,
+                      (off_t)start * disk->block_size);
+}
+
+static int block_range_io(disk_t *disk, const char *who, int is_write,
+                          int start, int count, char *buf)
+{
+  struct iovec iov;
+
+  if (check_range(disk, who, start, count) < 0)
+    return -1;
+
+  if (disk->cache)
+    return is_write ? block_cache_write(disk->cache, start, count, buf)
+                    : block_cache_read(disk->cache, start, count, buf);
+
+  iov.iov_base = buf;
+  iov.iov_len = (size_t)count * disk->block_size;
+
+  return transfer_all(disk, who, is_write, &iov, 1,
+                      (off_t)start * disk->block_size);
+}
+
+/******************************************************************************/
+int disk_set_backend(int which)
+{
+  if ((which != DISK_BACKEND_PIO) && (which != DISK_BACKEND_MMAP)) {
+    fprintf(stderr, "disk_set_backend: unknown backend %d\n", which);
+    return -1;
+  }
+
+  backend = which;
+
+  return 0;
+}
+
+int disk_set_cache(int nblocks)
+{
+  if (nblocks < 0) {
+    fprintf(stderr, "disk_set_cache: invalid cache size %d\n", nblocks);
+    return -1;
+  }
+
+  cache_blocks = nblocks;
+
+  return 0;
+}
+
+int disk_set_aio(int mode)
+{
+  if ((mode != AIO_ENGINE_AUTO) && (mode != AIO_ENGINE_THREADS)) {
+    fprintf(stderr, "disk_set_aio: unknown engine %d\n", mode);
+    return -1;
+  }
+
+  aio_mode = mode;
+
+  return 0;
+}
+
 int make_disk(char *name)
-{ 
-  int f, cnt;
-  char buf[BLOCK_SIZE];
+{
+  return make_disk_ex(name, (off_t)DISK_BLOCKS * BLOCK_SIZE, DISK_SPARSE);
+}
 
-  if (!name) {
-    fprintf(stderr, "make_disk: invalid file name\n");
+int make_disk_ex(char *name, off_t size, int flags)
+{
+  int f, rc;
+
+  if (!name || (size <= 0)) {
+    fprintf(stderr, "make_disk: invalid file name or size\n");
     return -1;
   }
 
@@ -26,102 +268,474 @@ int make_disk(char *name)
     return -1;
   }
 
-  memset(buf, 0, BLOCK_SIZE);
-  for (cnt = 0; cnt < DISK_BLOCKS; ++cnt)
-  write(f, buf, BLOCK_SIZE);
+  /* a hole reads back as zeroes, so neither way writes any data             */
+  if (flags & DISK_PREALLOCATE) {
+    if ((rc = posix_fallocate(f, 0, size)) != 0) {
+      fprintf(stderr, "make_disk: cannot allocate space: %s\n", strerror(rc));
+      close(f);
+      return -1;
+    }
+  } else if (ftruncate(f, size) < 0) {
+    perror("make_disk: cannot size file");
+    close(f);
+    return -1;
+  }
 
   close(f);
 
   return 0;
 }
 
-int open_disk(char *name)
+disk_t *open_disk_ex(char *name)
+{
+  return open_disk_blocksize_ex(name, BLOCK_SIZE);
+}
+
+disk_t *open_disk_blocksize_ex(char *name, int block_size)
 {
+  disk_t *disk;
+  struct stat st;
   int f;
 
   if (!name) {
     fprintf(stderr, "open_disk: invalid file name\n");
-    return -1;
+    return NULL;
   }  
-  
-  if (active) {
-    fprintf(stderr, "open_disk: disk is already open\n");
-    return -1;
+
+  if ((block_size < DISK_MIN_BLOCK_SIZE) ||
+      (block_size > DISK_MAX_BLOCK_SIZE) ||
+      (block_size & (block_size - 1))) {
+    fprintf(stderr, "open_disk: invalid block size %d\n", block_size);
+    return NULL;
   }
   
   if ((f = open(name, O_RDWR, 0644)) < 0) {
     perror("open_disk: cannot open file");
-    return -1;
+    return NULL;
   }
 
-  handle = f;
-  active = 1;
+  if (fstat(f, &st) < 0) {
+    perror("open_disk: cannot stat file");
+    close(f);
+    return NULL;
+  }
 
-  return 0;
+  if ((st.st_size < block_size) ||
+      (st.st_size / block_size > (off_t)0x7fffffff)) {
+    fprintf(stderr, "open_disk: image size does not fit the block size\n");
+    close(f);
+    return NULL;
+  }
+
+  if (!(disk = calloc(1, sizeof(*disk)))) {
+    fprintf(stderr, "open_disk: out of memory\n");
+    close(f);
+    return NULL;
+  }
+  disk->block_size = block_size;
+  disk->blocks = (int)(st.st_size / block_size);
+
+  if (backend == DISK_BACKEND_MMAP) {
+    size_t len = (size_t)disk->blocks * block_size;
+    void *p;
+
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, f, 0);
+    if (p == MAP_FAILED) {
+      perror("open_disk: cannot map file");
+      close(f);
+      free(disk);
+      return NULL;
+    }
+    disk->mapping = p;
+  }
+
+  disk->handle = f;
+
+  /* a mapped image already is its own cache */
+  if (!disk->mapping && (cache_blocks > 0) &&
+      !(disk->cache = block_cache_create(cache_blocks, block_size, device_io,
+                                         disk)))
+    fprintf(stderr, "open_disk: continuing without a block cache\n");
+
+  return disk;
 }
 
-int close_disk()
+int close_disk_ex(disk_t *disk)
 {
-  if (!active) {
+  if (!disk) {
     fprintf(stderr, "close_disk: no open disk\n");
     return -1;
   }
   
-  close(handle);
+  aio_engine_destroy(disk->aio);
+
+  if (disk->cache) {
+    if (block_cache_flush(disk->cache) < 0)
+      fprintf(stderr, "close_disk: failed to write back cached blocks\n");
+    block_cache_destroy(disk->cache);
+  }
 
-  active = handle = 0;
+  if (disk->mapping)
+    munmap(disk->mapping, (size_t)disk->blocks * disk->block_size);
+
+  close(disk->handle);
+  free(disk);
 
   return 0;
 }
 
-int block_write(int block, char *buf)
+int disk_sync_ex(disk_t *disk)
 {
-  if (!active) {
-    fprintf(stderr, "block_write: disk not active\n");
+  if (!disk) {
+    fprintf(stderr, "disk_sync: no open disk\n");
     return -1;
   }
 
-  if ((block < 0) || (block >= DISK_BLOCKS)) {
-    fprintf(stderr, "block_write: block index out of bounds\n");
+  if (disk->cache && (block_cache_flush(disk->cache) < 0)) {
+    fprintf(stderr, "disk_sync: failed to write back cached blocks\n");
     return -1;
   }
 
-  if (lseek(handle, block * BLOCK_SIZE, SEEK_SET) < 0) {
-    perror("block_write: failed to lseek");
+  if (disk->mapping &&
+      msync(disk->mapping, (size_t)disk->blocks * disk->block_size,
+            MS_SYNC) < 0) {
+    perror("disk_sync: failed to msync");
     return -1;
   }
 
-  if (write(handle, buf, BLOCK_SIZE) < 0) {
-    perror("block_write: failed to write");
+  if (fsync(disk->handle) < 0) {
+    perror("disk_sync: failed to fsync");
     return -1;
   }
 
   return 0;
 }
 
-int block_read(int block, char *buf)
+int disk_cached_ex(disk_t *disk)
 {
-  if (!active) {
-    fprintf(stderr, "block_read: disk not active\n");
-    return -1;
+  return disk && disk->cache;
+}
+
+int disk_block_size_ex(disk_t *disk)
+{
+  return disk ? disk->block_size : -1;
+}
+
+int disk_blocks_ex(disk_t *disk)
+{
+  return disk ? disk->blocks : -1;
+}
+
+void disk_cache_stats_ex(disk_t *disk, struct block_cache_stats *st)
+{
+  if (!disk || !disk->cache) {
+    memset(st, 0, sizeof(*st));
+    return;
   }
 
-  if ((block < 0) || (block >= DISK_BLOCKS)) {
-    fprintf(stderr, "block_read: block index out of bounds\n");
-    return -1;
+  block_cache_get_stats(disk->cache, st);
+}
+
+char *block_ptr_ex(disk_t *disk, int block)
+{
+  if (!disk || !disk->mapping || (block < 0) || (block >= disk->blocks))
+    return NULL;
+
+  return disk->mapping + (size_t)block * disk->block_size;
+}
+
+const char *block_pin_ex(disk_t *disk, int block)
+{
+  if (!disk)
+    return NULL;
+
+  if (disk->mapping)
+    return block_ptr_ex(disk, block);
+
+  if (!disk->cache || (block < 0) || (block >= disk->blocks))
+    return NULL;
+
+  return block_cache_pin(disk->cache, block);
+}
+
+int block_unpin_ex(disk_t *disk, const char *ptr)
+{
+  if (disk && disk->cache)
+    return block_cache_unpin(disk->cache, ptr);
+  return 0;
+}
+
+int block_write_ex(disk_t *disk, int block, char *buf)
+{
+  return block_range_io(disk, "block_write", 1, block, 1, buf);
+}
+
+int block_read_ex(disk_t *disk, int block, char *buf)
+{
+  return block_range_io(disk, "block_read", 0, block, 1, buf);
+}
+
+int block_write_range_ex(disk_t *disk, int start, int count, char *buf)
+{
+  return block_range_io(disk, "block_write", 1, start, count, buf);
+}
+
+int block_read_range_ex(disk_t *disk, int start, int count, char *buf)
+{
+  return block_range_io(disk, "block_read", 0, start, count, buf);
+}
+
+int block_writev_ex(disk_t *disk, int start, const struct iovec *iov,
+                    int iovcnt)
+{
+  return block_vector_io(disk, "block_writev", 1, start, iov, iovcnt);
+}
+
+int block_readv_ex(disk_t *disk, int start, const struct iovec *iov,
+                   int iovcnt)
+{
+  return block_vector_io(disk, "block_readv", 0, start, iov, iovcnt);
+}
+
+/* Synchronous path of the asynchronous engine: worker threads, and the
+ * retry of a transfer io_uring cut short.                                    */
+static int aio_sync_io_fn(void *ctx, struct disk_aio *req)
+{
+  disk_t *disk = ctx;
+
+  if (!req->iov)               /* a disk_readahead_ex request                 */
+    return block_cache_prefetch(disk->cache, req->start, req->iovcnt);
+
+  return block_vector_io(ctx, req->is_write ? "block_writev" : "block_readv",
+                         req->is_write, req->start, req->iov, req->iovcnt);
+}
+
+/* The disk's engine, started on first use.  io_uring talks to the image
+ * directly, which is only coherent when no cache or mapping holds newer
+ * copies of its blocks.                                                      */
+static struct aio_engine *aio_engine_of(disk_t *disk)
+{
+  struct aio_engine *aio;
+
+  pthread_mutex_lock(&aio_start_lock);
+  if (!disk->aio)
+    disk->aio = aio_engine_create(disk->cache || disk->mapping ? -1
+                                                                : disk->handle,
+                                  disk->block_size, aio_mode, aio_sync_io_fn,
+                                  disk);
+  aio = disk->aio;
+  pthread_mutex_unlock(&aio_start_lock);
+
+  return aio;
+}
+
+int disk_aio_submit_ex(disk_t *disk, struct disk_aio **reqs, int n)
+{
+  struct aio_engine *aio;
+
+  if (n <= 0)
+    return 0;
+
+  for (int i = 0; i < n; ++i) {
+    size_t total = 0;
+
+    if (!reqs[i] || (reqs[i]->iovcnt <= 0) ||
+        (reqs[i]->iovcnt > DISK_IOV_MAX)) {
+      fprintf(stderr, "disk_aio_submit: invalid request\n");
+      return -1;
+    }
+    for (int j = 0; j < reqs[i]->iovcnt; ++j)
+      total += reqs[i]->iov[j].iov_len;
+    if (total % disk->block_size) {
+      fprintf(stderr, "disk_aio_submit: transfer is not a whole number of "
+                      "blocks\n");
+      return -1;
+    }
+    if (check_range(disk, "disk_aio_submit", reqs[i]->start,
+                    (int)(total / disk->block_size)) < 0)
+      return -1;
   }
 
-  if (lseek(handle, block * BLOCK_SIZE, SEEK_SET) < 0) {
-    perror("block_read: failed to lseek");
+  if (!(aio = aio_engine_of(disk)))
     return -1;
+
+  return aio_engine_submit(aio, reqs, n);
+}
+
+static void readahead_done(struct disk_aio *req, int result)
+{
+  (void)result;
+  free(req);
+}
+
+void disk_readahead_ex(disk_t *disk, int start, int count)
+{
+  struct block_cache_stats st;
+  struct disk_aio *req;
+  struct aio_engine *aio;
+
+  if ((count <= 0) || (check_range(disk, "disk_readahead", start, count) < 0))
+    return;
+
+  if (disk->mapping) {
+    /* the mapping starts page aligned; blocks may be smaller than a page    */
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t from = (size_t)start * disk->block_size;
+    size_t to = from + (size_t)count * disk->block_size;
+
+    from -= from % page;
+    madvise(disk->mapping + from, to - from, MADV_WILLNEED);
+    return;
   }
 
-  if (read(handle, buf, BLOCK_SIZE) < 0) {
-    perror("block_read: failed to read");
+  if (!disk->cache) {
+    posix_fadvise(disk->handle, (off_t)start * disk->block_size,
+                  (off_t)count * disk->block_size, POSIX_FADV_WILLNEED);
+    return;
+  }
+
+  /* never let readahead take more than a quarter of the cache, or it would
+   * evict the blocks it loaded before they are read                          */
+  block_cache_get_stats(disk->cache, &st);
+  if (count > st.capacity / 4)
+    count = st.capacity / 4;
+  if (count <= 0)
+    return;
+
+  if (!(aio = aio_engine_of(disk)) || !(req = calloc(1, sizeof(*req))))
+    return;
+
+  req->start = start;
+  req->iovcnt = count;
+  req->done = readahead_done;
+  if (aio_engine_submit(aio, &req, 1) < 0)
+    free(req);
+}
+
+void disk_aio_drain_ex(disk_t *disk)
+{
+  if (disk && disk->aio)
+    aio_engine_drain(disk->aio);
+}
+
+void disk_aio_stats_ex(disk_t *disk, struct aio_engine_stats *st)
+{
+  if (!disk || !disk->aio) {
+    memset(st, 0, sizeof(*st));
+    return;
+  }
+
+  aio_engine_get_stats(disk->aio, st);
+}
+
+/******************************************************************************/
+/* Single-disk interface, kept for existing callers: it drives one default   */
+/* disk opened by open_disk.                                                  */
+int open_disk(char *name)
+{
+  return open_disk_blocksize(name, BLOCK_SIZE);
+}
+
+int open_disk_blocksize(char *name, int block_size)
+{
+  if (!name) {
+    fprintf(stderr, "open_disk: invalid file name\n");
+    return -1;
+  }  
+  
+  if (default_disk) {
+    fprintf(stderr, "open_disk: disk is already open\n");
     return -1;
   }
 
-  return 0;
+  return (default_disk = open_disk_blocksize_ex(name, block_size)) ? 0 : -1;
+}
+
+disk_t *disk_default()
+{
+  return default_disk;
+}
+
+int close_disk()
+{
+  int rc = close_disk_ex(default_disk);
+
+  default_disk = NULL;
+
+  return rc;
+}
+
+int disk_sync()
+{
+  return disk_sync_ex(default_disk);
+}
+
+void disk_cache_stats(struct block_cache_stats *st)
+{
+  disk_cache_stats_ex(default_disk, st);
+}
+
+char *block_ptr(int block)
+{
+  return block_ptr_ex(default_disk, block);
+}
+
+const char *block_pin(int block)
+{
+  return block_pin_ex(default_disk, block);
+}
+
+int block_unpin(const char *ptr)
+{
+  return block_unpin_ex(default_disk, ptr);
+}
+
+int block_write(int block, char *buf)
+{
+  return block_write_ex(default_disk, block, buf);
+}
+
+int block_read(int block, char *buf)
+{
+  return block_read_ex(default_disk, block, buf);
+}
+
+int block_write_range(int start, int count, char *buf)
+{
+  return block_write_range_ex(default_disk, start, count, buf);
+}
+
+int block_read_range(int start, int count, char *buf)
+{
+  return block_read_range_ex(default_disk, start, count, buf);
 }
 
+int block_writev(int start, const struct iovec *iov, int iovcnt)
+{
+  return block_writev_ex(default_disk, start, iov, iovcnt);
+}
+
+int block_readv(int start, const struct iovec *iov, int iovcnt)
+{
+  return block_readv_ex(default_disk, start, iov, iovcnt);
+}
+
+int disk_aio_submit(struct disk_aio **reqs, int n)
+{
+  return disk_aio_submit_ex(default_disk, reqs, n);
+}
 
+void disk_aio_drain()
+{
+  disk_aio_drain_ex(default_disk);
+}
+
+void disk_aio_stats(struct aio_engine_stats *st)
+{
+  disk_aio_stats_ex(default_disk, st);
+}
+
+void disk_readahead(int start, int count)
+{
+  disk_readahead_ex(default_disk, start, count);
+}
@@ -0,0 +1,163 @@
+#include "free_space.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+int free_space_init(free_space *fsp, int entries) {
+    free_space_destroy(fsp);
+
+    fsp->words = (entries + 63) / 64;
+    fsp->map = calloc(fsp->words, sizeof(uint64_t));
+    if (fsp->map == NULL) {
+        fprintf(stderr, "Error: Out of memory for free-space index.\n");
+        fsp->words = 0;
+        return -1;
+    }
+    fsp->entries = entries;
+    return 0;
+}
+
+void free_space_add(free_space *fsp, const int *fat, int first, int count) {
+    for (int i = first; i < first + count && i < fsp->entries; i++) {
+        if (fat[i] == -2 && !((fsp->map[i / 64] >> (i % 64)) & 1)) {
+            fsp->map[i / 64] |= (uint64_t)1 << (i % 64);
+            fsp->free_total++;
+        }
+    }
+}
+
+int free_space_build(free_space *fsp, const int *fat, int entries) {
+    if (free_space_init(fsp, entries) == -1) {
+        return -1;
+    }
+    free_space_add(fsp, fat, 0, entries);
+    return 0;
+}
+
+void free_space_destroy(free_space *fsp) {
+    free(fsp->map);
+    fsp->map = NULL;
+    fsp->entries = 0;
+    fsp->words = 0;
+    fsp->free_total = 0;
+    fsp->cursor = 0;
+}
+
+// Is block free?
+static int is_free(const free_space *fsp, int block) {
+    return (fsp->map[block / 64] >> (block % 64)) & 1;
+}
+
+// First free block in [from, to), or -1
+static int find_free(const free_space *fsp, int from, int to) {
+    int word = from / 64;
+    uint64_t bits = fsp->map[word] & (~(uint64_t)0 << (from % 64));
+    while (1) {
+        if (bits != 0) {
+            int block = word * 64 + __builtin_ctzll(bits);
+            return block < to ? block : -1;
+        }
+        if (++word * 64 >= to) {
+            return -1;
+        }
+        bits = fsp->map[word];
+    }
+}
+
+// Length of the run of free blocks starting at block, capped at limit
+static int free_run_length(const free_space *fsp, int block, int limit) {
+    int length = 0;
+    while (length < limit && block < fsp->entries) {
+        // Count the free bits from block up to the next used one in this word
+        uint64_t used = ~(fsp->map[block / 64] >> (block % 64));
+        int avail = used == 0 ? 64 - block % 64 : __builtin_ctzll(used);
+        if (avail == 0) {
+            break;
+        }
+        if (avail > 64 - block % 64) {
+            avail = 64 - block % 64;
+        }
+        length += avail;
+        block += avail;
+        if (block % 64 != 0) {
+            break; // Stopped at a used block inside the word
+        }
+    }
+    return length < limit ? length : limit;
+}
+
+int free_space_alloc_run(free_space *fsp, int goal, int want, int *got) {
+    *got = 0;
+    if (fsp->free_total == 0 || want <= 0) {
+        return -1;
+    }
+
+    int start = -1;
+    int length = 0;
+
+    // Extending in place keeps the chain physically contiguous
+    if (goal >= 0 && goal < fsp->entries && is_free(fsp, goal)) {
+        start = goal;
+        length = free_run_length(fsp, goal, want);
+    } else {
+        // First run of at least want blocks from the fsp->cursor, wrapping once;
+        // fall back to the longest run seen
+        int best = -1, best_length = 0;
+        int pass_from[2] = {fsp->cursor, 0};
+        int pass_to[2] = {fsp->entries, fsp->cursor};
+        for (int pass = 0; pass < 2 && best_length < want; pass++) {
+            int block = pass_from[pass];
+            while (block < pass_to[pass] && (block = find_free(fsp, block, pass_to[pass])) != -1) {
+                int run = free_run_length(fsp, block, want);
+                if (run > best_length) {
+                    best = block;
+                    best_length = run;
+                    if (run >= want) {
+                        break;
+                    }
+                }
+                block += run;
+            }
+        }
+        start = best;
+        length = best_length;
+    }
+
+    if (start == -1) {
+        return -1;
+    }
+
+    for (int block = start; block < start + length; block++) {
+        fsp->map[block / 64] &= ~((uint64_t)1 << (block % 64));
+    }
+    fsp->free_total -= length;
+    fsp->cursor = start + length < fsp->entries ? start + length : 0;
+    *got = length;
+    return start;
+}
+
+void free_space_release(free_space *fsp, int block) {
+    if (block < 0 || block >= fsp->entries) {
+        return;
+    }
+    uint64_t bit = (uint64_t)1 << (block % 64);
+    if (!(fsp->map[block / 64] & bit)) {
+        fsp->map[block / 64] |= bit;
+        fsp->free_total++;
+    }
+}
+
+void free_space_claim(free_space *fsp, int block) {
+    if (block < 0 || block >= fsp->entries) {
+        return;
+    }
+    uint64_t bit = (uint64_t)1 << (block % 64);
+    if (fsp->map[block / 64] & bit) {
+        fsp->map[block / 64] &= ~bit;
+        fsp->free_total--;
+    }
+}
+
+int free_space_count(const free_space *fsp) {
+    return fsp->free_total;
+}
@@ -1,34 +1,206 @@
 #include "fs_management.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include "disk.h"
+#include "free_space.h"
+#include "dir_index.h"
+#include "journal.h"
+#include "compress.h"
+#include "dedup_index.h"
 #include <string.h>
+#include <limits.h>
 #include <time.h>
 #include <sys/types.h> // For off_t
+#include <pthread.h>
 
 // Global variable definitions
 char BLOCK_ARRAY[BLOCK_ARRAY_SIZE];
-int is_mounted = 0; // 0 = not mounted, 1 = mounted
 
-file_descriptor file_descriptors[MAX_FILE_DESCRIPTORS];
+// Lazily built index from logical block number to data block for one file,
+// shared by all of its descriptors. blocks == NULL means not built yet; once
+// built it always covers the whole chain and is patched as the chain changes.
+typedef struct {
+    int *blocks;
+    int length;
+    int capacity;
+} block_map;
 
-boot_sector bs;
+// Write-back buffer of one open file: a copy of the data block that small
+// writes are merged into, so a stream of short records costs one block write
+// per block instead of a read and a write per record. block == -1 when empty.
+typedef struct {
+    char *data;           // One block, allocated on first use
+    int block;            // Data block held, -1 if none
+    int index;            // Logical position of block in the file
+    int dirty;            // 1 if data is newer than the disk
+} write_buffer;
 
-int FAT1[4096];
-int FAT2[4096];
-files rootDir[64];
+// Where the latest record of one extent of a compressed file is in its stream
+typedef struct {
+    size_t offset;        // Stream offset of the record header, NO_RECORD if none (all zeros)
+    int length;           // Logical bytes in the record
+    int stored;           // Bytes of payload after the header; length means stored raw
+} extent_slot;
 
-char mounted_disk_name[MAX_DISK_NAME_LENGTH];
+// In-memory state of a compressed file: where its extents are, built by
+// reading the record headers on first use, and a cache of one extent that
+// reads are served from and writes are merged into.
+typedef struct {
+    extent_slot *slots;   // By extent, NULL until built
+    int count;            // Extents covered by slots
+    int capacity;         // Extents slots has room for
+    size_t garbage;       // Stream bytes in records that have been superseded
+    char *data;           // COMPRESS_EXTENT_BYTES, allocated on first use
+    int index;            // Extent held in data
+    int cached;           // 1 if data holds extent index
+    int dirty;            // 1 if data is newer than its record
+} extent_map;
 
-int write_to_block(int block_num, void *data, size_t data_size) {
-    if (data_size > BLOCK_SIZE) {
-        fprintf(stderr, "Error: Data size (%zu bytes) exceeds block size (%d bytes)\n", data_size, BLOCK_SIZE);
+// One logical block of a deduplicated file, as its block table stores it
+typedef struct {
+    int block;            // Data block holding it, DEDUP_HOLE for a block of zeros
+    int unused;
+    uint64_t hash;        // dedup_hash of its bytes
+} dedup_entry;
+
+// In-memory state of a deduplicated file: its block table, read from its
+// chain on first use, and a buffer of one block that partial writes are
+// merged into before the block is stored.
+typedef struct {
+    dedup_entry *entries; // By logical block, NULL until read
+    int count;            // Blocks of the file
+    int capacity;         // Entries entries has room for
+    int dirty_first;      // Blocks of the table newer than the chain,
+    int dirty_last;       // none if dirty_last < dirty_first
+    char *data;           // One block, allocated on first use
+    int index;            // Logical block held in data
+    int cached;           // 1 if data holds block index
+    int dirty;            // 1 if data is newer than the stored block
+    int spare;            // Data block set aside for storing data,
+    int has_spare;        // so a full disk cannot lose it, if has_spare
+    int *dropped;         // Data blocks let go of since the table was
+    int dropped_count;    // last written, which the table on disk may
+    int dropped_capacity; // still name
+} dedup_table;
+
+// Root directory entry of images made before the directory region, which had
+// one block of these (boot_sector.sizeOfRoot == 0)
+typedef struct {
+    int isFile;
+    int numOpen;
+    int fPointer;
+    char filename[16];
+    int firstDataBlock;
+    size_t sizeInBytes;
+    char timeCreated[9];
+    char dateCreated[9];
+} legacy_files;
+
+// Everything one mounted image needs; nothing here is shared between
+// instances, so any number of images can be mounted side by side.
+//
+// Locking, outermost first:
+//  - dir_lock: read-locked by every call that uses the directory or an open
+//    descriptor, write-locked to create/delete files and directories and to
+//    mount/unmount
+//  - file_locks[i]: serializes data I/O, seeks and truncates on rootDir[i],
+//    together with its descriptors' offsets/cursors, its block map and its
+//    write buffer (or extent map, or block table)
+//  - fd_lock: claiming and releasing descriptor slots
+//  - alloc_lock: the free-space index, free <-> used FAT transitions,
+//    reading FAT blocks in on a lazy mount, the block reference counts,
+//    the blocks waiting for a commit to be freed and the fingerprint index
+//    (the snapshot counts change only with the directory write-locked too)
+//  - aio_lock: in-flight asynchronous requests and their completion queue
+// Functions named *_locked expect their caller to hold what they need.
+struct fs {
+    int mounted;                                  // 0 = not mounted, 1 = mounted
+    char disk_name[MAX_DISK_NAME_LENGTH];
+    disk_t *disk;
+
+    boot_sector bs;
+    size_t block_size;                            // Bytes per block, from the boot sector
+    int *FAT1;                                    // FAT2 on disk is a copy, written at flush time
+    int fat_entries;                              // Entries of FAT1, one per data block
+    int fat_per_block;                            // Entries in a block of FAT1
+    uint64_t *fat_loaded;                         // Bit i = block i of FAT1 has been read
+    int fat_unloaded;                             // Blocks of FAT1 not read yet (lazy mounts)
+    int fat_next_unloaded;                        // No block before this one is unread
+    int dir_loaded;                               // 0 until the root directory has been read (lazy mounts)
+    int *refs;                                    // Chains through each data block, NULL while no blocks are shared
+    unsigned char *frozen;                        // Snapshots holding each data block, NULL while there are none
+    uint64_t *pending;                            // Bit i = data block i was freed since the last commit
+    int pending_count;                            // Bits set in pending
+    int read_only;                                // 1 for a snapshot mounted with fs_snapshot_mount_readonly
+    files rootDir[MAX_DIR_ENTRIES];
+    int dir_slots;                                // Entries of rootDir the image has
+    dir_index dir_index;                          // Name -> rootDir slot, and the free slots
+    file_descriptor file_descriptors[MAX_FILE_DESCRIPTORS];
+    block_map block_maps[MAX_DIR_ENTRIES];
+    write_buffer write_buffers[MAX_DIR_ENTRIES];
+    extent_map extent_maps[MAX_DIR_ENTRIES];
+    dedup_table dedup_tables[MAX_DIR_ENTRIES];
+    dedup_index dedup_index;                      // Data blocks of deduplicated files by contents
+    free_space space;
+    journal journal;                              // Metadata as last committed, and the log
+    meta_dirty meta_dirty;                        // Blocks changed since the last commit
+
+    pthread_rwlock_t dir_lock;
+    pthread_mutex_t file_locks[MAX_DIR_ENTRIES];
+    pthread_mutex_t fd_lock;
+    pthread_mutex_t alloc_lock;
+
+    pthread_mutex_t aio_lock;
+    pthread_cond_t aio_cond;                      // A request finished or was reaped
+    struct aio_op *aio_ops;                       // Submitted, not finished yet
+    struct aio_op *aio_done;                      // Finished, waiting for fs_aio_reap
+    struct aio_op *aio_done_tail;
+    int aio_done_count;
+    int aio_running;                              // Submitted, completion not delivered yet
+};
+
+// How the next mount reads the metadata (see fs_set_mount_mode)
+static int mount_mode = FS_MOUNT_EAGER;
+
+// The instance behind mount_fs/unmount_fs and the other fildes-only calls.
+// It is never freed, so its locks stay valid across mounts.
+static fs_t default_fs = {
+    .dir_lock = PTHREAD_RWLOCK_INITIALIZER,
+    .file_locks = {[0 ... MAX_DIR_ENTRIES - 1] = PTHREAD_MUTEX_INITIALIZER},
+    .fd_lock = PTHREAD_MUTEX_INITIALIZER,
+    .alloc_lock = PTHREAD_MUTEX_INITIALIZER,
+    .aio_lock = PTHREAD_MUTEX_INITIALIZER,
+    .aio_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static int close_locked(fs_t *fs, int fildes);
+static int unshare_chain(fs_t *fs, int file_index, int last);
+static int unfreeze_blocks(fs_t *fs, int file_index, size_t offset, size_t nbyte);
+static int extent_flush(fs_t *fs, int file_index);
+static int extent_release(fs_t *fs, int file_index);
+static void extent_map_free(fs_t *fs, int file_index);
+static int dedup_flush(fs_t *fs, int file_index);
+static int dedup_release(fs_t *fs, int file_index);
+static int count_table_refs(fs_t *fs, int file_index);
+
+// Write data_size bytes to a block of disk, zero-padding the rest
+static int write_padded_block(disk_t *disk, int block_num, void *data, size_t data_size) {
+    int block_size = disk_block_size_ex(disk);
+    if (data_size > (size_t)block_size) {
+        fprintf(stderr, "Error: Data size (%zu bytes) exceeds block size (%d bytes)\n", data_size, block_size);
         return -1;
     }
 
-    char buffer[BLOCK_SIZE] = {0}; // Zero-initialize the buffer
+    char *buffer = calloc(1, block_size); // Zero-initialize the buffer
+    if (buffer == NULL) {
+        fprintf(stderr, "Error: Out of memory for block %d\n", block_num);
+        return -1;
+    }
     memcpy(buffer, data, data_size); // Copy data into the buffer
 
-    if (block_write(block_num, buffer) == -1) {
+    int result = block_write_ex(disk, block_num, buffer);
+    free(buffer);
+    if (result == -1) {
         fprintf(stderr, "Error: Failed to write to block %d\n", block_num);
         return -1;
     }
@@ -36,703 +208,5067 @@ int write_to_block(int block_num, void *data, size_t data_size) {
     return 0; // Success
 }
 
-
-void initFAT(int FAT[]){
-  for (int i = 0; i < 4096; i++)
-  {
-    FAT[i] = -2;
-  }
+int write_to_block(int block_num, void *data, size_t data_size) {
+    return write_padded_block(default_fs.disk, block_num, data, data_size);
 }
 
-//make the file system by calling make_disk
-int make_fs(char *disk_name) {
-    initFAT(FAT1);
-    initFAT(FAT2);
-    for (int i = 0; i < MAX_FILE_DESCRIPTORS; i++) {
-        file_descriptors[i].is_open = 0;
-    }
-
-    if (make_disk(disk_name) == -1) {
-        printf("Disk could not be created\n");
-        return -1;
+// Read count blocks of FAT1 from first on into memory. A block that cannot
+// be read from FAT1 is taken from its copy in FAT2.
+static int read_fat_blocks(fs_t *fs, int first, int count) {
+    char *data = (char *)(fs->FAT1 + (size_t)first * fs->fat_per_block);
+    if (block_read_range_ex(fs->disk, fs->bs.fat1_location + first, count, data) == 0) {
+        return 0;
     }
-
-    if (open_disk(disk_name) == -1) {
-        printf("Disk could not be opened\n");
-        return -1;
+    for (int b = first; b < first + count; b++, data += fs->block_size) {
+        if (block_read_ex(fs->disk, fs->bs.fat1_location + b, data) == -1 &&
+            (b >= fs->bs.sizeOfFat2 || block_read_ex(fs->disk, fs->bs.fat2_location + b, data) == -1)) {
+            fprintf(stderr, "Error: Failed to read FAT block %d.\n", b);
+            return -1;
+        }
     }
+    fprintf(stderr, "Warning: FAT1 could not be read, blocks %d-%d recovered from FAT2.\n", first, first + count - 1);
+    return 0;
+}
 
-    // Initialize the boot sector
-    bs.dataOffset = 4096; 
-    bs.locationOfBoot = 0;
-    bs.sizeOfBoot = 1;    
-    bs.fat1_location = 100; // Block index for FAT1
-    bs.sizeOfFat1 = 4; 
-    bs.fat2_location = 200; // Block index for FAT2
-    bs.sizeOfFat2 = 4;
-    bs.root_location = 300; // Block index for root directory
-    bs.num_files = 0;  
+static int fat_block_loaded(fs_t *fs, int fat_block) {
+    return (__atomic_load_n(&fs->fat_loaded[fat_block / 64], __ATOMIC_ACQUIRE) >> (fat_block % 64)) & 1;
+}
 
-    for (int i = 0; i < 64; i++) {
-        rootDir[i].isFile = 0;
+// Read block fat_block of FAT1 in, on a lazy mount: its entries join the
+// free-space index and the journal's committed copy. Caller holds alloc_lock.
+static int fault_fat_block_locked(fs_t *fs, int fat_block) {
+    if (fat_block_loaded(fs, fat_block)) {
+        return 0;
     }
-
-    // Write boot sector
-    if (write_to_block(0, &bs, sizeof(bs)) == -1) {
-        close_disk();
+    if (read_fat_blocks(fs, fat_block, 1) == -1) {
         return -1;
     }
+    journal_fat_loaded(&fs->journal, fs->FAT1, fat_block);
+    free_space_add(&fs->space, fs->FAT1, fat_block * fs->fat_per_block, fs->fat_per_block);
+    fs->fat_unloaded--;
+    __atomic_fetch_or(&fs->fat_loaded[fat_block / 64], (uint64_t)1 << (fat_block % 64), __ATOMIC_RELEASE);
+    return 0;
+}
 
-    // Write FAT1 across 4 blocks
-    for (int i = 0; i < bs.sizeOfFat1; i++) {
-        if (write_to_block(bs.fat1_location + i, &FAT1[i * (BLOCK_SIZE / sizeof(int))], BLOCK_SIZE) == -1) {
-            close_disk();
-            return -1;
+// Read in the lowest FAT block not read yet; 0 if there was none left.
+// Caller holds alloc_lock.
+static int fault_next_fat_block_locked(fs_t *fs) {
+    while (fs->fat_unloaded > 0) {
+        int fat_block = fs->fat_next_unloaded++;
+        if (!fat_block_loaded(fs, fat_block)) {
+            return fault_fat_block_locked(fs, fat_block) == -1 ? -1 : 1;
         }
     }
+    return 0;
+}
+
+// FAT entry of data block block. Its FAT block is read in first if the mount
+// is lazy and it has not been yet; -1 (end of chain) if that fails.
+// fat_get_locked is for callers holding alloc_lock.
+static int fat_get_locked(fs_t *fs, int block) {
+    if (fault_fat_block_locked(fs, block / fs->fat_per_block) == -1) {
+        return -1;
+    }
+    return fs->FAT1[block];
+}
 
-    // Write FAT2 across 4 blocks
-    for (int i = 0; i < bs.sizeOfFat2; i++) {
-        if (write_to_block(bs.fat2_location + i, &FAT2[i * (BLOCK_SIZE / sizeof(int))], BLOCK_SIZE) == -1) {
-            close_disk();
+static int fat_get(fs_t *fs, int block) {
+    if (!fat_block_loaded(fs, block / fs->fat_per_block)) {
+        pthread_mutex_lock(&fs->alloc_lock);
+        int result = fault_fat_block_locked(fs, block / fs->fat_per_block);
+        pthread_mutex_unlock(&fs->alloc_lock);
+        if (result == -1) {
             return -1;
         }
     }
+    return fs->FAT1[block];
+}
 
-    // Write the root directory
-    if (write_to_block(bs.root_location, rootDir, sizeof(rootDir)) == -1) {
-        close_disk();
-        return -1;
-    }
+// Set a FAT entry and mark its block for the next commit. Many threads may do
+// this at once (each under its file's lock or alloc_lock), hence the atomic OR.
+// The block of FAT1 holding it has been read, as block came from a chain or
+// from the free-space index.
+static void set_fat(fs_t *fs, int block, int value) {
+    fs->FAT1[block] = value;
+    meta_dirty_fat(&fs->meta_dirty, block);
+}
 
-    // Ensure the disk is closed to reset the active state
-    close_disk();
+// Note a change to rootDir[slot] for the next commit
+static void dir_changed(fs_t *fs, int slot) {
+    meta_dirty_dir(&fs->meta_dirty, slot);
+}
 
-    return 0;
+// Bytes at the start of a file's chain that hold its data: its size, the
+// length of the record stream of a compressed file, or of the block table of
+// a deduplicated one
+static size_t chain_bytes(const files *entry) {
+    return entry->compressed || entry->deduplicated ? (size_t)entry->storedBytes : entry->sizeInBytes;
 }
 
-//mounts a file system that is stored on the virtual disk with name disk_name
-//Using the mount operation the disk becomes ready to use
-int mount_fs(char *disk_name) {
-    if (is_mounted) {
-        fprintf(stderr, "Error: File system is already mounted.\n");
-        return -1;
+// Hand a block nothing uses any more back to the free-space index. If the
+// last commit still has it in use, it waits in fs->pending until the next
+// one: reused before that, a crash would leave the committed owner with
+// another file's data. Caller holds alloc_lock.
+static void free_block_locked(fs_t *fs, int block) {
+    if (fs->pending == NULL || fs->journal.fat[block] == -2) {
+        free_space_release(&fs->space, block);
+        return;
     }
+    fs->pending[block / 64] |= (uint64_t)1 << (block % 64);
+    fs->pending_count++;
+}
 
-    // Attempt to open the disk only if it is not already open
-    if (open_disk(disk_name) == -1) {
-        fprintf(stderr, "Error: Could not open disk '%s'.\n", disk_name);
-        return -1;
+// Mark a data block free in the FAT and, unless a snapshot still holds it,
+// in the free-space index
+static void release_block(fs_t *fs, int block) {
+    set_fat(fs, block, -2);
+    if (fs->frozen == NULL || fs->frozen[block] == 0) {
+        free_block_locked(fs, block);
     }
+}
 
-    strncpy(mounted_disk_name, disk_name, MAX_DISK_NAME_LENGTH - 1);
-    mounted_disk_name[MAX_DISK_NAME_LENGTH - 1] = '\0'; // Ensure null-termination
-
+// Blocks freed since the last commit, which the next one makes reusable
+static int pending_blocks(fs_t *fs) {
+    pthread_mutex_lock(&fs->alloc_lock);
+    int count = fs->pending_count;
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return count;
+}
 
-    // Read the boot sector (block 0)
-    if (block_read(0, (char *)&bs) == -1) {
-        fprintf(stderr, "Error: Failed to read boot sector.\n");
-        close_disk(); // Close the disk if reading fails
+// Refuse a change to a snapshot mounted read-only
+static int check_writable(fs_t *fs) {
+    if (fs->read_only) {
+        fprintf(stderr, "Error: File system is mounted read-only.\n");
         return -1;
     }
+    return 0;
+}
 
-    // Verify the boot sector
-    if (bs.sizeOfBoot <= 0 || bs.fat1_location <= 0 || bs.root_location <= 0) {
-        fprintf(stderr, "Error: Invalid boot sector.\n");
-        close_disk(); // Close the disk if verification fails
-        return -1;
+// A chain lets go of block: it is freed unless other chains still run
+// through it, in which case its FAT entry stays as it is. Caller holds
+// alloc_lock.
+static void drop_block_locked(fs_t *fs, int block) {
+    if (fs->refs != NULL && fs->refs[block] > 1) {
+        fs->refs[block]--;
+        return;
+    }
+    if (fs->refs != NULL) {
+        fs->refs[block] = 0;
     }
+    release_block(fs, block);
+}
 
-    int entries_per_block = BLOCK_SIZE / sizeof(int);
+// Allocate count data blocks as one chain, taking physically contiguous runs
+// from the free-space index and starting at goal when that block is free.
+// Returns the first block of the chain, or -1 if the disk is full. The chain
+// is shorter than count when the disk fills up part way.
+static int allocate_chain(fs_t *fs, int goal, int count) {
+    int first_block = -1;
+    int last_block = -1;
 
-    // Read FAT1
-    for (int i = 0; i < bs.sizeOfFat1; i++) {
-        if (block_read(bs.fat1_location + i, (char *)&FAT1[i * entries_per_block]) == -1) {
-            fprintf(stderr, "Error: Failed to read FAT1.\n");
-            close_disk();
-            return -1;
-        }
+    pthread_mutex_lock(&fs->alloc_lock);
+    // On a lazy mount only the FAT blocks read so far are indexed: read the
+    // one holding goal, then more until enough free blocks are known
+    if (goal >= 0 && goal < fs->fat_entries) {
+        fault_fat_block_locked(fs, goal / fs->fat_per_block);
+    }
+    while (free_space_count(&fs->space) < count && fault_next_fat_block_locked(fs) == 1) {
     }
+    while (count > 0) {
+        int run_length;
+        int run_start = free_space_alloc_run(&fs->space, goal, count, &run_length);
+        if (run_start == -1) {
+            break;
+        }
 
-    // Read FAT2
-    for (int i = 0; i < bs.sizeOfFat2; i++) {
-        if (block_read(bs.fat2_location + i, (char *)&FAT2[i * entries_per_block]) == -1) {
-            fprintf(stderr, "Error: Failed to read FAT2.\n");
-            close_disk();
-            return -1;
+        for (int block = run_start; block < run_start + run_length; block++) {
+            int next_block = block + 1 < run_start + run_length ? block + 1 : -1;
+            set_fat(fs, block, next_block);
+            if (fs->refs != NULL) {
+                fs->refs[block] = 1;
+            }
+        }
+        if (last_block == -1) {
+            first_block = run_start;
+        } else {
+            set_fat(fs, last_block, run_start);
         }
-    }
 
-    // Read the root directory
-    if (block_read(bs.root_location, (char *)rootDir) == -1) {
-        fprintf(stderr, "Error: Failed to read root directory.\n");
-        close_disk();
-        return -1;
+        last_block = run_start + run_length - 1;
+        count -= run_length;
+        goal = last_block + 1;
     }
+    pthread_mutex_unlock(&fs->alloc_lock);
 
-    is_mounted = 1; // Mark the file system as mounted
-    printf("File system successfully mounted.\n");
-    return 0;
+    return first_block;
 }
 
-int unmount_fs(char *disk_name) {
-    if (!is_mounted) {
-        fprintf(stderr, "Error: File system is not mounted.\n");
-        return -1;
-    }
-
-    // Compare the provided disk name with the mounted disk name
-    if (strcmp(disk_name, mounted_disk_name) != 0) {
-        fprintf(stderr, "Error: Disk name '%s' does not match the mounted disk '%s'.\n", disk_name, mounted_disk_name);
-        return -1;
+// Number of blocks to allocate when a chain of chain_length blocks must grow
+// by wanted blocks. While space is plentiful PREALLOC_BLOCKS extra blocks are
+// reserved past the write, so that files growing side by side still get
+// contiguous extents; fs_close gives back whatever stays unused.
+static int blocks_to_allocate(fs_t *fs, int chain_length, int wanted) {
+    int count = wanted;
+    pthread_mutex_lock(&fs->alloc_lock);
+    // Blocks not read in yet count as free: a lazy mount knows no better
+    // without reading them
+    int free_blocks = free_space_count(&fs->space) + fs->fat_unloaded * fs->fat_per_block;
+    pthread_mutex_unlock(&fs->alloc_lock);
+    if (free_blocks - wanted > PREALLOC_BLOCKS * MAX_FILE_DESCRIPTORS) {
+        count += PREALLOC_BLOCKS;
     }
-
-    // Proceed with unmounting
-    for (int i = 0; i < MAX_FILE_DESCRIPTORS; i++) {
-        if (file_descriptors[i].is_open) {
-            fs_close(i);
-        }
+    if (chain_length + count > fs->fat_entries) {
+        count = fs->fat_entries - chain_length; // No file outgrows the data region
     }
+    return count;
+}
 
-    // No need to open the disk again since it's already open
-
-    int entries_per_block = BLOCK_SIZE / sizeof(int);
+static void block_map_free(fs_t *fs, int file_index) {
+    free(fs->block_maps[file_index].blocks);
+    fs->block_maps[file_index].blocks = NULL;
+    fs->block_maps[file_index].length = 0;
+    fs->block_maps[file_index].capacity = 0;
+}
 
-    // Write FAT1 to disk
-    for (int i = 0; i < bs.sizeOfFat1; i++) {
-        if (write_to_block(bs.fat1_location + i, &FAT1[i * entries_per_block], BLOCK_SIZE) == -1) {
-            fprintf(stderr, "Error: Failed to write FAT1 to disk.\n");
-            goto cleanup;
+// Append block to a built map; on allocation failure the map is dropped and
+// will be rebuilt from the FAT on the next random access
+static void block_map_push(fs_t *fs, block_map *map, int block) {
+    if (map->length == map->capacity) {
+        int capacity = map->capacity ? map->capacity * 2 : 64;
+        int *blocks = realloc(map->blocks, capacity * sizeof(int));
+        if (blocks == NULL) {
+            block_map_free(fs, map - fs->block_maps);
+            return;
         }
+        map->blocks = blocks;
+        map->capacity = capacity;
     }
+    map->blocks[map->length++] = block;
+}
 
-    // Write FAT2 to disk
-    for (int i = 0; i < bs.sizeOfFat2; i++) {
-        if (write_to_block(bs.fat2_location + i, &FAT2[i * entries_per_block], BLOCK_SIZE) == -1) {
-            fprintf(stderr, "Error: Failed to write FAT2 to disk.\n");
-            goto cleanup;
-        }
+// Record the chain starting at first_block, just linked to the end of the
+// file, in its map if the map has been built
+static void block_map_append_chain(fs_t *fs, int file_index, int first_block) {
+    block_map *map = &fs->block_maps[file_index];
+    for (int block = first_block; map->blocks != NULL && block != -1; block = fat_get(fs, block)) {
+        block_map_push(fs, map, block);
     }
+}
 
-    // Write root directory to disk
-    if (write_to_block(bs.root_location, rootDir, sizeof(rootDir)) == -1) {
-        fprintf(stderr, "Error: Failed to write root directory to disk.\n");
-        goto cleanup;
+// The map of a file, built from its FAT chain on first use. NULL if memory
+// for it cannot be had.
+static block_map *block_map_get(fs_t *fs, int file_index) {
+    block_map *map = &fs->block_maps[file_index];
+    if (map->blocks == NULL) {
+        map->capacity = 64;
+        map->length = 0;
+        map->blocks = malloc(map->capacity * sizeof(int));
+        block_map_append_chain(fs, file_index, fs->rootDir[file_index].firstDataBlock);
     }
+    return map->blocks != NULL ? map : NULL;
+}
 
-    // Mark as unmounted and close the disk
-    is_mounted = 0;
-    if (close_disk() == -1) {
-        fprintf(stderr, "Error: Failed to close the disk.\n");
-        return -1;
+// Return the block following current_block in the chain of file_index. If
+// current_block is the last one (it is block chain_length - 1 of the file),
+// the chain is first extended by wanted blocks, plus any reservation.
+// Returns -1 if the chain had to grow and the disk is full.
+static int next_block_or_allocate(fs_t *fs, int file_index, int current_block, int chain_length, int wanted) {
+    int next_block = fat_get(fs, current_block);
+    if (next_block != -1) {
+        return next_block;
     }
 
-    printf("File system successfully unmounted.\n");
-    return 0;
-
-cleanup:
-    close_disk();  // Ensure the disk is closed in case of an error
-    is_mounted = 0;
-    return -1;
+    next_block = allocate_chain(fs, current_block + 1, blocks_to_allocate(fs, chain_length, wanted));
+    if (next_block != -1) {
+        set_fat(fs, current_block, next_block);
+        block_map_append_chain(fs, file_index, next_block);
+    }
+    return next_block;
 }
 
-//fs functions
-int fs_open(char *fname) {
-    // Find the file in rootDir
-    int file_index = -1;
-    for (int i = 0; i < 64; i++) {
-        if (rootDir[i].isFile && strcmp(rootDir[i].filename, fname) == 0) {
-            file_index = i;
-            break;
-        }
+// Keep the first blocks_to_keep blocks of a file's chain and free the rest.
+// Returns -1, changing nothing, if the new last block is shared and there is
+// no room for a copy of it.
+static int free_chain_after(fs_t *fs, int file_index, int blocks_to_keep) {
+    int current_block = fs->rootDir[file_index].firstDataBlock;
+    int prev_block = -1;
+    int block_count = 0;
+
+    while (current_block != -1 && block_count < blocks_to_keep) {
+        prev_block = current_block;
+        current_block = fat_get(fs, current_block);
+        block_count++;
     }
-    if (file_index == -1) {
-        fprintf(stderr, "Error: File not found.\n");
-        return -1;
+    if (current_block == -1) {
+        return 0; // Nothing past the blocks kept
     }
 
-    // Find an available file descriptor
-    for (int fd = 0; fd < MAX_FILE_DESCRIPTORS; fd++) {
-        if (!file_descriptors[fd].is_open) {
-            file_descriptors[fd].is_open = 1;
-            file_descriptors[fd].file_index = file_index;
-            file_descriptors[fd].offset = 0;
-            return fd;
+    // The new last block is about to end the chain: if it is shared, the
+    // file needs a copy of its own first
+    if (prev_block != -1 && fs->refs != NULL) {
+        if (unshare_chain(fs, file_index, blocks_to_keep - 1) == -1) {
+            return -1;
         }
+        prev_block = fs->block_maps[file_index].blocks[blocks_to_keep - 1];
     }
 
-    fprintf(stderr, "Error: Maximum number of file descriptors reached.\n");
-    return -1;
-}
-
-int fs_close(int fildes) {
-    if (fildes < 0 || fildes >= MAX_FILE_DESCRIPTORS) {
-        fprintf(stderr, "Error: Invalid file descriptor.\n");
-        return -1;
+    // Now current_block is the block to free and onwards
+    pthread_mutex_lock(&fs->alloc_lock);
+    while (current_block != -1) {
+        int next_block = fat_get_locked(fs, current_block);
+        drop_block_locked(fs, current_block); // Mark as free
+        current_block = next_block;
     }
+    pthread_mutex_unlock(&fs->alloc_lock);
 
-    if (!file_descriptors[fildes].is_open) {
-        fprintf(stderr, "Error: File descriptor not open.\n");
-        return -1;
+    // Update the FAT to indicate the new end of the file
+    if (prev_block != -1) {
+        set_fat(fs, prev_block, -1);
+    } else {
+        // If prev_block is -1, the file no longer has any blocks
+        fs->rootDir[file_index].firstDataBlock = -1;
+        dir_changed(fs, file_index);
     }
 
-    file_descriptors[fildes].is_open = 0;
+    // The block map keeps exactly the surviving prefix
+    if (fs->block_maps[file_index].length > block_count) {
+        fs->block_maps[file_index].length = block_count;
+    }
     return 0;
 }
 
-int fs_create(char *fname) {
-    if (!is_mounted) {
-        fprintf(stderr, "Error: File system is not mounted.\n");
-        return -1;
+// Starting point for a walk to logical block target of the descriptor's file.
+// Sequential access continues from the cached chain cursor; anything else is
+// looked up in the file's block map, which lands on target itself or, past
+// the end of the chain, on its last block. Without a map the walk starts at
+// the cursor if it is not past target, otherwise at the first block.
+// Stores the logical index of the returned block in *index.
+static int walk_start(fs_t *fs, int fildes, int target, int *index) {
+    file_descriptor *fd = &fs->file_descriptors[fildes];
+    int cursor_usable = fd->cursor_block != -1 && fd->cursor_index <= target;
+    if (cursor_usable && target - fd->cursor_index <= 1) {
+        *index = fd->cursor_index;
+        return fd->cursor_block;
     }
 
-    if (fname == NULL || strlen(fname) == 0) {
-        fprintf(stderr, "Error: File name cannot be null or empty.\n");
-        return -1;
+    block_map *map = block_map_get(fs, fd->file_index);
+    if (map != NULL) {
+        if (map->length == 0) {
+            *index = 0;
+            return -1;
+        }
+        *index = target < map->length ? target : map->length - 1;
+        return map->blocks[*index];
     }
 
-    if (strlen(fname) > 15) {
-        fprintf(stderr, "Error: File name too long.\n");
-        return -1;
+    if (cursor_usable) {
+        *index = fd->cursor_index;
+        return fd->cursor_block;
     }
+    *index = 0;
+    return fs->rootDir[fd->file_index].firstDataBlock;
+}
 
-    // Check if the file already exists
-    for (int i = 0; i < 64; i++) {
-        if (rootDir[i].isFile && strcmp(rootDir[i].filename, fname) == 0) {
-            fprintf(stderr, "Error: File already exists.\n");
-            return -1;
-        }
+// Remember that logical block index of the descriptor's file is block
+static void set_cursor(fs_t *fs, int fildes, int index, int block) {
+    fs->file_descriptors[fildes].cursor_index = index;
+    fs->file_descriptors[fildes].cursor_block = block;
+}
+
+// Physical block holding logical block target of the descriptor's file, or -1
+// if the chain is shorter. Sequential access only hops from the cursor.
+static int locate_block(fs_t *fs, int fildes, int target) {
+    int index;
+    int block = walk_start(fs, fildes, target, &index);
+    while (block != -1 && index < target) {
+        block = fat_get(fs, block);
+        index++;
     }
+    if (block != -1) {
+        set_cursor(fs, fildes, index, block);
+    }
+    return block;
+}
 
-    // Find an empty slot in the root directory
-    for (int i = 0; i < 64; i++) {
-        if (!rootDir[i].isFile) {
-            // Fill out each member of the files struct
-            rootDir[i].isFile = 1;           // Mark as a valid file
-            rootDir[i].numOpen = 0;          // File is not open yet
-            rootDir[i].fPointer = 0;         // Not used, but initialized to 0
-            strncpy(rootDir[i].filename, fname, 15); // Copy file name
-            rootDir[i].filename[15] = '\0';  // Ensure null-termination
-            rootDir[i].firstDataBlock = -1;  // No data blocks allocated yet
-            rootDir[i].sizeInBytes = 0;      // Initial file size is 0
-
-            // Set timeCreated and dateCreated
-            time_t now = time(NULL);
-            struct tm *t = localtime(&now);
-            snprintf(rootDir[i].timeCreated, sizeof(rootDir[i].timeCreated), "%02d:%02d:%02d",
-                     t->tm_hour, t->tm_min, t->tm_sec);
-            snprintf(rootDir[i].dateCreated, sizeof(rootDir[i].dateCreated), "%02d/%02d/%02d",
-                     t->tm_mon + 1, t->tm_mday, (t->tm_year + 1900) % 100); // Last two digits of the year
-
-            bs.num_files++; // Increment the file count in the boot sector
-
-            printf("File '%s' created and added to rootDir at index %d.\n", fname, i);
-            return 0;
+// Drop the cursors of every descriptor on file_index that point at or past
+// logical block first_freed, which is about to be released
+static void invalidate_cursors(fs_t *fs, int file_index, int first_freed) {
+    pthread_mutex_lock(&fs->fd_lock);
+    for (int fd = 0; fd < MAX_FILE_DESCRIPTORS; fd++) {
+        if (fs->file_descriptors[fd].is_open && fs->file_descriptors[fd].file_index == file_index &&
+            fs->file_descriptors[fd].cursor_index >= first_freed) {
+            set_cursor(fs, fd, 0, -1);
         }
     }
-
-    fprintf(stderr, "Error: Maximum number of files reached.\n");
-    return -1;
+    pthread_mutex_unlock(&fs->fd_lock);
 }
 
-int fs_delete(char *fname) {
-    if (!is_mounted) {
-        fprintf(stderr, "Error: File system is not mounted.\n");
-        return -1;
-    }
+// Called after a read of bytes start .. end - 1 on the descriptor. A read
+// that starts in the block where the previous one ended is sequential: the
+// first opens a window of READAHEAD_MIN_BLOCKS past the data read, and the
+// window doubles each time the stream moves on to a new block, up to
+// READAHEAD_MAX_BLOCKS. Any other read closes it. Whenever half of what was
+// prefetched has been consumed, the window is topped up in the background.
+static void readahead(fs_t *fs, int fildes, size_t start, size_t end) {
+    file_descriptor *fd = &fs->file_descriptors[fildes];
+    int next = end / fs->block_size; // Block holding the next byte of the stream
 
-    if (fname == NULL || strlen(fname) == 0) {
-        fprintf(stderr, "Error: File name cannot be null or empty.\n");
-        return -1;
+    if ((int)(start / fs->block_size) != fd->ra_next) {
+        fd->ra_next = next;
+        fd->ra_window = 0;
+        fd->ra_end = 0;
+        return;
+    }
+    if (next == fd->ra_next) {
+        return; // Still inside the same block
     }
 
-    // Find the file in rootDir
-    int file_index = -1;
-    for (int i = 0; i < 64; i++) {
-        if (rootDir[i].isFile && strcmp(rootDir[i].filename, fname) == 0) {
-            file_index = i;
-            break;
-        }
+    fd->ra_next = next;
+    fd->ra_window = fd->ra_window == 0 ? READAHEAD_MIN_BLOCKS : fd->ra_window * 2;
+    if (fd->ra_window > READAHEAD_MAX_BLOCKS) {
+        fd->ra_window = READAHEAD_MAX_BLOCKS;
     }
-    if (file_index == -1) {
-        fprintf(stderr, "Error: File '%s' not found.\n", fname);
-        return -1;
+    if (fd->ra_end < next) {
+        fd->ra_end = next;
+    }
+    if (fd->ra_end - next > fd->ra_window / 2) {
+        return;
     }
 
-    // Check if the file is open in any file descriptor
-    for (int fd = 0; fd < MAX_FILE_DESCRIPTORS; fd++) {
-        if (file_descriptors[fd].is_open && file_descriptors[fd].file_index == file_index) {
-            fprintf(stderr, "Error: File '%s' is currently open.\n", fname);
-            return -1;
-        }
+    size_t file_size = fs->rootDir[fd->file_index].sizeInBytes;
+    int limit = next + fd->ra_window;
+    if (limit > (int)((file_size + fs->block_size - 1) / fs->block_size)) {
+        limit = (file_size + fs->block_size - 1) / fs->block_size;
+    }
+    if (fd->ra_end >= limit || fd->cursor_block == -1 || fd->cursor_index > fd->ra_end) {
+        return;
     }
 
-    // Now, proceed to delete the file
-    // First, free all data blocks used by the file
-    int current_block = rootDir[file_index].firstDataBlock;
-    while (current_block != -1) {
-        if (current_block < 0 || current_block >= 4096) {
-            fprintf(stderr, "Error: Invalid block number %d in FAT chain.\n", current_block);
-            break;
+    // Hop from the cursor (the last block read) to the first block not
+    // prefetched yet, then hand each contiguous run of the rest to the disk
+    int index = fd->cursor_index;
+    int block = fd->cursor_block;
+    while (block != -1 && index < fd->ra_end) {
+        block = fat_get(fs, block);
+        index++;
+    }
+    while (block != -1 && index < limit) {
+        int run_start = block;
+        int run_length = 1;
+        while (index + run_length < limit && fat_get(fs, block) == block + 1) {
+            block++;
+            run_length++;
         }
-        int next_block = FAT1[current_block];
-        FAT1[current_block] = -2; // Mark as free
-        FAT2[current_block] = -2; // Mark as free in the copy
-        current_block = next_block;
+        disk_readahead_ex(fs->disk, fs->bs.dataOffset + run_start, run_length);
+        index += run_length;
+        block = fat_get(fs, block);
     }
+    fd->ra_end = index;
+}
 
-    // Remove the file's entry from rootDir
-    rootDir[file_index].isFile = 0; // Mark slot as free
-    // Optionally clear other fields
-    memset(&rootDir[file_index], 0, sizeof(files)); // Clear the entire structure
+// One physically contiguous piece of a read or write: nbytes starting
+// block_offset bytes into data block first_block, within blocks first_block ..
+// first_block + num_blocks - 1, transferred to/from data. first_index is the
+// position of first_block in the file; live_bytes (writes only) is how much
+// file data, as of before the write, starts at first_block.
+typedef struct {
+    int first_block;
+    int num_blocks;
+    int first_index;
+    size_t block_offset;
+    char *data;
+    size_t nbytes;
+    size_t live_bytes;
+} io_run;
 
-    // Decrease the number of files
-    if (bs.num_files > 0) {
-        bs.num_files--;
-    }
+// Called for every run of a read or write, in file order; ctx is passed
+// through. Returns -1 to stop the transfer.
+typedef int (*run_visitor)(fs_t *fs, const io_run *run, void *ctx);
 
-    printf("File '%s' deleted successfully.\n", fname);
-    return 0;
-}
+// Lay out the vectored transfer of a run: partial head/tail blocks go through
+// the head/tail bounce buffers, whole blocks in between straight to/from the
+// run's data. Returns the iovec count (at most 3).
+static int run_layout(fs_t *fs, const io_run *run, char *head, char *tail, struct iovec *iov, int *has_head, int *has_tail) {
+    int iovcnt = 0;
+    size_t end = run->block_offset + run->nbytes;  // End of the range, relative to first_block
+    size_t tail_bytes = end % fs->block_size;          // Bytes used in a partial last block
+    *has_head = run->block_offset != 0 || end < fs->block_size;
+    *has_tail = tail_bytes != 0 && (run->num_blocks > 1 || !*has_head);
+    int middle_blocks = run->num_blocks - *has_head - *has_tail;
 
-int fs_read(int fildes, void *buf, size_t nbyte) {
-    if (!is_mounted) {
-        fprintf(stderr, "Error: File system is not mounted.\n");
-        return -1;
+    if (*has_head) {
+        iov[iovcnt].iov_base = head;
+        iov[iovcnt++].iov_len = fs->block_size;
+    }
+    if (middle_blocks > 0) {
+        iov[iovcnt].iov_base = run->data + (*has_head ? fs->block_size - run->block_offset : 0);
+        iov[iovcnt++].iov_len = (size_t)middle_blocks * fs->block_size;
+    }
+    if (*has_tail) {
+        iov[iovcnt].iov_base = tail;
+        iov[iovcnt++].iov_len = fs->block_size;
     }
+    return iovcnt;
+}
 
-    // Validate the file descriptor
-    if (fildes < 0 || fildes >= MAX_FILE_DESCRIPTORS || !file_descriptors[fildes].is_open) {
-        fprintf(stderr, "Error: Invalid or closed file descriptor.\n");
-        return -1;
+// Copy the wanted bytes of the bounce buffers of a finished read to its data
+static void run_finish_read(fs_t *fs, const io_run *run, const char *head, const char *tail, int has_head, int has_tail) {
+    size_t tail_bytes = (run->block_offset + run->nbytes) % fs->block_size;
+    if (has_head) {
+        size_t head_bytes = run->nbytes < fs->block_size - run->block_offset ? run->nbytes : fs->block_size - run->block_offset;
+        memcpy(run->data, head + run->block_offset, head_bytes);
+    }
+    if (has_tail) {
+        memcpy(run->data + run->nbytes - tail_bytes, tail, tail_bytes);
     }
+}
 
-    int file_index = file_descriptors[fildes].file_index;
-    size_t file_offset = file_descriptors[fildes].offset;
-    size_t file_size = rootDir[file_index].sizeInBytes;
+// 1 if a block holding live_bytes of file data from its start keeps any of
+// them outside bytes offset .. offset + nbytes - 1 when those are written
+static int keeps_live_bytes(fs_t *fs, size_t offset, size_t nbytes, size_t live_bytes) {
+    size_t live = live_bytes < fs->block_size ? live_bytes : fs->block_size;
+    return (offset > 0 && live > 0) || offset + nbytes < live;
+}
 
-    // Check if the file pointer is at or beyond the end of the file
-    if (file_offset >= file_size) {
-        return 0; // Nothing to read
-    }
+// Fill the bounce buffers of a write: a partial head/tail block is read first
+// only if it holds live bytes outside the written range; blocks that are new,
+// past EOF or fully overwritten are never read.
+static int run_fill_write(fs_t *fs, const io_run *run, char *head, char *tail, int has_head, int has_tail) {
+    size_t end = run->block_offset + run->nbytes;
+    size_t tail_bytes = end % fs->block_size;
+    int last_block = run->first_block + run->num_blocks - 1;
 
-    // Calculate the number of bytes to read
-    size_t bytes_to_read = nbyte;
-    if (file_offset + nbyte > file_size) {
-        bytes_to_read = file_size - file_offset;
+    if (has_head) {
+        size_t head_bytes = run->nbytes < fs->block_size - run->block_offset ? run->nbytes : fs->block_size - run->block_offset;
+        if (keeps_live_bytes(fs, run->block_offset, head_bytes, run->live_bytes)) {
+            if (block_read_ex(fs->disk, fs->bs.dataOffset + run->first_block, head) == -1) {
+                fprintf(stderr, "Error: Failed to read data block %d.\n", run->first_block);
+                return -1;
+            }
+        } else {
+            memset(head, 0, fs->block_size); // Nothing live to preserve
+        }
+        memcpy(head + run->block_offset, run->data, head_bytes);
     }
+    if (has_tail) {
+        // The tail is written from its start, so only a live suffix matters
+        if (run->live_bytes > end) {
+            if (block_read_ex(fs->disk, fs->bs.dataOffset + last_block, tail) == -1) {
+                fprintf(stderr, "Error: Failed to read data block %d.\n", last_block);
+                return -1;
+            }
+        } else {
+            memset(tail + tail_bytes, 0, fs->block_size - tail_bytes);
+        }
+        memcpy(tail, run->data + run->nbytes - tail_bytes, tail_bytes);
+    }
+    return 0;
+}
 
-    size_t bytes_remaining = bytes_to_read;
-    size_t buffer_offset = 0; // Offset into buf
-    size_t block_offset = file_offset % BLOCK_SIZE;
-    int block_index_within_file = file_offset / BLOCK_SIZE;
+// Read a run with one vectored read: whole blocks land directly in the
+// destination, partial head/tail blocks go through bounce buffers.
+// A run_visitor; ctx is unused.
+static int read_run(fs_t *fs, const io_run *run, void *ctx) {
+    char head[DISK_MAX_BLOCK_SIZE]; // Only the first block_size bytes are used
+    char tail[DISK_MAX_BLOCK_SIZE];
+    struct iovec iov[3];
+    int has_head, has_tail;
+    char *mapped = block_ptr_ex(fs->disk, fs->bs.dataOffset + run->first_block);
+    (void)ctx;
 
-    // Get the starting data block
-    int current_block = rootDir[file_index].firstDataBlock;
-    if (current_block == -1) {
-        // No data blocks allocated yet
+    // A mapped image can be copied from directly, no bounce buffers needed
+    if (mapped) {
+        memcpy(run->data, mapped + run->block_offset, run->nbytes);
         return 0;
     }
 
-    // Traverse to the starting block
-    for (int i = 0; i < block_index_within_file; i++) {
-        current_block = FAT1[current_block];
-        if (current_block == -1) {
-            // Reached end of file before expected
-            return -1;
-        }
+    int iovcnt = run_layout(fs, run, head, tail, iov, &has_head, &has_tail);
+    if (block_readv_ex(fs->disk, fs->bs.dataOffset + run->first_block, iov, iovcnt) == -1) {
+        fprintf(stderr, "Error: Failed to read data blocks %d-%d.\n", run->first_block, run->first_block + run->num_blocks - 1);
+        return -1;
     }
 
-    while (bytes_remaining > 0 && current_block != -1) {
-        // Read the data block
-        char block_data[BLOCK_SIZE];
-        if (block_read(bs.dataOffset + current_block, block_data) == -1) {
-            fprintf(stderr, "Error: Failed to read data block %d.\n", current_block);
-            return -1;
-        }
-
-        size_t bytes_in_block = BLOCK_SIZE - block_offset;
-        size_t bytes_to_copy = bytes_remaining < bytes_in_block ? bytes_remaining : bytes_in_block;
+    run_finish_read(fs, run, head, tail, has_head, has_tail);
+    return 0;
+}
 
-        memcpy((char *)buf + buffer_offset, block_data + block_offset, bytes_to_copy);
+// Write counterpart of read_run: the run goes out in one vectored write.
+static int write_run(fs_t *fs, const io_run *run, void *ctx) {
+    char head[DISK_MAX_BLOCK_SIZE]; // Only the first block_size bytes are used
+    char tail[DISK_MAX_BLOCK_SIZE];
+    struct iovec iov[3];
+    int has_head, has_tail;
+    char *mapped = block_ptr_ex(fs->disk, fs->bs.dataOffset + run->first_block);
+    (void)ctx;
 
-        buffer_offset += bytes_to_copy;
-        bytes_remaining -= bytes_to_copy;
-        file_offset += bytes_to_copy;
-        block_offset = 0; // Reset block offset for subsequent blocks
+    // A mapped image is updated in place; the bytes around the range stay intact
+    if (mapped) {
+        memcpy(mapped + run->block_offset, run->data, run->nbytes);
+        return 0;
+    }
 
-        // Move to next block
-        current_block = FAT1[current_block];
+    int iovcnt = run_layout(fs, run, head, tail, iov, &has_head, &has_tail);
+    if (run_fill_write(fs, run, head, tail, has_head, has_tail) == -1) {
+        return -1;
+    }
+
+    if (block_writev_ex(fs->disk, fs->bs.dataOffset + run->first_block, iov, iovcnt) == -1) {
+        fprintf(stderr, "Error: Failed to write data blocks %d-%d.\n", run->first_block, run->first_block + run->num_blocks - 1);
+        return -1;
+    }
+    return 0;
+}
+
+// Write back the file's buffered block if it is dirty (for a compressed file,
+// its cached extent; for a deduplicated one, its buffer and block table)
+static int write_buffer_flush(fs_t *fs, int file_index) {
+    if (fs->rootDir[file_index].compressed) {
+        return extent_flush(fs, file_index);
+    }
+    if (fs->rootDir[file_index].deduplicated) {
+        return dedup_flush(fs, file_index);
+    }
+    write_buffer *wb = &fs->write_buffers[file_index];
+    if (!wb->dirty) {
+        return 0;
+    }
+    if (block_write_ex(fs->disk, fs->bs.dataOffset + wb->block, wb->data) == -1) {
+        fprintf(stderr, "Error: Failed to write data block %d.\n", wb->block);
+        return -1;
+    }
+    wb->dirty = 0;
+    return 0;
+}
+
+// Write back every file's buffer, e.g. before a commit makes the sizes and
+// chains pointing at the data durable. Returns -1 if any of them failed.
+static int write_buffers_flush_all(fs_t *fs) {
+    int result = 0;
+    for (int i = 0; i < fs->dir_slots; i++) {
+        if (write_buffer_flush(fs, i) == -1) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+// Forget the buffered block without writing it, e.g. because the disk copy is
+// about to be replaced or freed
+static void write_buffer_drop(fs_t *fs, int file_index) {
+    fs->write_buffers[file_index].block = -1;
+    fs->write_buffers[file_index].dirty = 0;
+}
+
+// Write back and free the buffer, once the file is no longer open
+static int write_buffer_release(fs_t *fs, int file_index) {
+    int result;
+    if (fs->rootDir[file_index].compressed) {
+        result = extent_release(fs, file_index);
+    } else if (fs->rootDir[file_index].deduplicated) {
+        result = dedup_release(fs, file_index);
+    } else {
+        result = write_buffer_flush(fs, file_index);
+    }
+    free(fs->write_buffers[file_index].data);
+    fs->write_buffers[file_index].data = NULL;
+    write_buffer_drop(fs, file_index);
+    return result;
+}
+
+// Merge a write that lies within one block into the file's buffer. Switching
+// to another block writes the old one back and loads the new one, unless
+// nothing live in it survives the write.
+static int write_buffer_put(fs_t *fs, int file_index, const io_run *run) {
+    write_buffer *wb = &fs->write_buffers[file_index];
+    if (wb->block != run->first_block) {
+        if (write_buffer_flush(fs, file_index) == -1) {
+            return -1;
+        }
+        write_buffer_drop(fs, file_index);
+        if (wb->data == NULL && (wb->data = malloc(fs->block_size)) == NULL) {
+            return write_run(fs, run, NULL); // No memory for a buffer, write through
+        }
+        if (keeps_live_bytes(fs, run->block_offset, run->nbytes, run->live_bytes)) {
+            if (block_read_ex(fs->disk, fs->bs.dataOffset + run->first_block, wb->data) == -1) {
+                fprintf(stderr, "Error: Failed to read data block %d.\n", run->first_block);
+                return -1;
+            }
+        } else {
+            memset(wb->data, 0, fs->block_size); // Nothing live to preserve
+        }
+        wb->block = run->first_block;
+        wb->index = run->first_index;
+    }
+    memcpy(wb->data + run->block_offset, run->data, run->nbytes);
+    wb->dirty = 1;
+    return 0;
+}
+
+// Move run past its first blocks, which cover nbytes of its data
+static void run_skip(fs_t *fs, io_run *run, int blocks, size_t nbytes) {
+    size_t skipped = (size_t)blocks * fs->block_size;
+    run->first_block += blocks;
+    run->num_blocks -= blocks;
+    run->first_index += blocks;
+    run->block_offset = 0;
+    run->data += nbytes;
+    run->nbytes -= nbytes;
+    run->live_bytes = run->live_bytes > skipped ? run->live_bytes - skipped : 0;
+}
+
+// Write a run through the file's write buffer: partial head and tail blocks
+// are merged into the buffer, whole blocks go straight to the disk (replacing
+// a buffered copy). A mapped image is written in place. A run_visitor; ctx
+// points to the file's rootDir index.
+static int buffered_write_run(fs_t *fs, const io_run *run, void *ctx) {
+    int file_index = *(int *)ctx;
+    if (block_ptr_ex(fs->disk, fs->bs.dataOffset + run->first_block)) {
+        return write_run(fs, run, NULL);
+    }
+
+    io_run rest = *run;
+    if (rest.block_offset > 0 || rest.nbytes < fs->block_size) {
+        io_run head = rest;
+        head.num_blocks = 1;
+        if (head.nbytes > fs->block_size - head.block_offset) {
+            head.nbytes = fs->block_size - head.block_offset;
+        }
+        if (write_buffer_put(fs, file_index, &head) == -1) {
+            return -1;
+        }
+        run_skip(fs, &rest, 1, head.nbytes);
+    }
+
+    int whole_blocks = rest.nbytes / fs->block_size;
+    if (whole_blocks > 0) {
+        io_run middle = rest;
+        middle.num_blocks = whole_blocks;
+        middle.nbytes = (size_t)whole_blocks * fs->block_size;
+        write_buffer *wb = &fs->write_buffers[file_index];
+        if (wb->block >= middle.first_block && wb->block < middle.first_block + whole_blocks) {
+            write_buffer_drop(fs, file_index);
+        }
+        if (write_run(fs, &middle, NULL) == -1) {
+            return -1;
+        }
+        run_skip(fs, &rest, whole_blocks, middle.nbytes);
+    }
+
+    if (rest.nbytes > 0) {
+        rest.num_blocks = 1;
+        return write_buffer_put(fs, file_index, &rest);
+    }
+    return 0;
+}
+
+
+
+// Asynchronous requests (fs_read_async/fs_write_async). A request is planned
+// under the file lock just like its synchronous counterpart: the offset moves,
+// blocks are allocated and partial blocks are prepared at once, then all of
+// its runs are queued on the disk's engine in one batch. Until it finishes it
+// is listed in fs->aio_ops with the logical blocks it covers; synchronous
+// calls on the file, and asynchronous ones that overlap it, wait for it.
+typedef struct aio_op aio_op;
+
+typedef struct {
+    struct disk_aio req;
+    struct iovec iov[3];
+    io_run run;
+    char *head;           // Bounce blocks for a partial head/tail, or NULL
+    char *tail;
+    int has_head;
+    int has_tail;
+    aio_op *op;
+} aio_piece;
+
+struct aio_op {
+    fs_t *fs;
+    int file_index;
+    int first_index;      // First logical block covered
+    int last_index;       // Last logical block covered
+    int is_write;
+    fs_aio_callback callback;
+    void *arg;
+    int result;           // Bytes transferred, or -1 once a piece failed
+    int pending;          // Pieces not completed yet
+    aio_piece *pieces;
+    int num_pieces;
+    int capacity;
+    aio_op *next;         // In fs->aio_ops, then in the completion queue
+};
+
+// Is a request in flight on file_index that covers part of logical blocks
+// first..last? With writes_only, in-flight reads do not count.
+static int aio_conflict(fs_t *fs, int file_index, int first, int last, int writes_only) {
+    for (aio_op *op = fs->aio_ops; op != NULL; op = op->next) {
+        if (op->file_index == file_index && op->first_index <= last && first <= op->last_index &&
+            (op->is_write || !writes_only)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Wait until no request in flight on file_index covers part of first..last
+static void aio_wait_range(fs_t *fs, int file_index, int first, int last, int writes_only) {
+    pthread_mutex_lock(&fs->aio_lock);
+    while (aio_conflict(fs, file_index, first, last, writes_only)) {
+        pthread_cond_wait(&fs->aio_cond, &fs->aio_lock);
+    }
+    pthread_mutex_unlock(&fs->aio_lock);
+}
+
+// Wait until no request on file_index is in flight
+static void aio_wait_file(fs_t *fs, int file_index) {
+    aio_wait_range(fs, file_index, 0, fs->fat_entries, 0);
+}
+
+
+// Wait until every asynchronous request has delivered its completion; with
+// discard, also drop completions nobody reaped (used at unmount)
+static void aio_wait_idle(fs_t *fs, int discard) {
+    pthread_mutex_lock(&fs->aio_lock);
+    while (fs->aio_running > 0) {
+        pthread_cond_wait(&fs->aio_cond, &fs->aio_lock);
+    }
+    while (discard && fs->aio_done != NULL) {
+        aio_op *op = fs->aio_done;
+        fs->aio_done = op->next;
+        free(op);
+    }
+    if (discard) {
+        fs->aio_done_tail = NULL;
+        fs->aio_done_count = 0;
+    }
+    pthread_mutex_unlock(&fs->aio_lock);
+}
+
+
+// Shared blocks. fs_copy with FS_COPY_CLONE points a new file at the chain
+// of another, and fs->refs counts the chains running through each data block.
+// A block on more than one chain never changes in place, neither its data nor
+// its FAT entry. Every chain through a block goes on to its successor, so the
+// count never drops along a chain: the shared blocks of a file are the rest
+// of its chain from some block on. To change one of them the file copies the
+// shared blocks from there up to it and links the copies in, the last copy
+// pointing back into the shared chain.
+//
+// The counts are not stored. While bs.sharedBlocks is set, mount rebuilds
+// them by walking every file's chain.
+
+// Copy the data of blocks from[i] to blocks to[i], i < count, with one read
+// and one write for every run of up to COPY_RUN_BLOCKS blocks that are
+// consecutive on both sides
+static int copy_blocks(fs_t *fs, const int *from, const int *to, int count) {
+    char *buf = malloc((size_t)COPY_RUN_BLOCKS * fs->block_size);
+    if (buf == NULL) {
+        fprintf(stderr, "Error: Out of memory for copying blocks.\n");
+        return -1;
+    }
+    for (int i = 0; i < count;) {
+        int run_length = 1;
+        while (i + run_length < count && run_length < COPY_RUN_BLOCKS &&
+               from[i + run_length] == from[i] + run_length && to[i + run_length] == to[i] + run_length) {
+            run_length++;
+        }
+        if (block_read_range_ex(fs->disk, fs->bs.dataOffset + from[i], run_length, buf) == -1 ||
+            block_write_range_ex(fs->disk, fs->bs.dataOffset + to[i], run_length, buf) == -1) {
+            fprintf(stderr, "Error: Failed to copy data blocks %d-%d.\n", from[i], from[i] + run_length - 1);
+            free(buf);
+            return -1;
+        }
+        i += run_length;
+    }
+    free(buf);
+    return 0;
+}
+
+// Free count blocks listed in blocks, which no other chain holds
+static void release_listed(fs_t *fs, const int *blocks, int count) {
+    pthread_mutex_lock(&fs->alloc_lock);
+    for (int i = 0; i < count; i++) {
+        drop_block_locked(fs, blocks[i]);
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+}
+
+// Allocate a chain of exactly count blocks and list them in blocks. Returns
+// -1, allocating nothing, if the disk does not have that many free.
+static int allocate_listed(fs_t *fs, int goal, int count, int *blocks) {
+    int block = allocate_chain(fs, goal, count);
+    int length = 0;
+    while (block != -1 && length < count) {
+        blocks[length++] = block;
+        block = fat_get(fs, block);
+    }
+    if (length == count) {
+        return 0;
+    }
+
+    release_listed(fs, blocks, length);
+    fprintf(stderr, "Error: No free data blocks available.\n");
+    return -1;
+}
+
+// Make blocks 0 .. last of a file's chain (all of it, if it is shorter) its
+// own, so that their data and FAT entries may change: the shared ones among
+// them are copied, and the copies take their place in the chain, the block
+// map and the descriptors' cursors. Caller holds the file's lock. Returns -1
+// if the copies do not fit on the disk.
+static int unshare_chain(fs_t *fs, int file_index, int last) {
+    if (fs->refs == NULL || fs->rootDir[file_index].firstDataBlock == -1) {
+        return 0;
+    }
+    block_map *map = block_map_get(fs, file_index);
+    if (map == NULL) {
+        fprintf(stderr, "Error: Out of memory for block map.\n");
+        return -1;
+    }
+    if (last >= map->length) {
+        last = map->length - 1; // The write appends: the last block's FAT entry changes
+    }
+
+    // Find the first shared block; the counts only grow along the chain
+    pthread_mutex_lock(&fs->alloc_lock);
+    if (fs->refs[map->blocks[last]] <= 1) {
+        pthread_mutex_unlock(&fs->alloc_lock);
+        return 0;
+    }
+    int low = 0;
+    int high = last;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (fs->refs[map->blocks[middle]] > 1) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    // Shared blocks never change, so they can be copied without alloc_lock.
+    // Requests in flight on the blocks given up must be done with them.
+    int first = low;
+    int count = last - first + 1;
+    aio_wait_range(fs, file_index, first, last, 0);
+    int *copies = malloc(count * sizeof(int));
+    if (copies == NULL) {
+        fprintf(stderr, "Error: Out of memory for block map.\n");
+        return -1;
+    }
+    int goal = first > 0 ? map->blocks[first - 1] + 1 : -1;
+    if (allocate_listed(fs, goal, count, copies) == -1 ||
+        copy_blocks(fs, map->blocks + first, copies, count) == -1) {
+        free(copies);
+        return -1;
+    }
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    set_fat(fs, copies[count - 1], fat_get_locked(fs, map->blocks[last]));
+    if (first == 0) {
+        fs->rootDir[file_index].firstDataBlock = copies[0];
+        dir_changed(fs, file_index);
+    } else {
+        set_fat(fs, map->blocks[first - 1], copies[0]);
+    }
+    for (int i = 0; i < count; i++) {
+        drop_block_locked(fs, map->blocks[first + i]);
+        map->blocks[first + i] = copies[i];
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+    free(copies);
+
+    // Nothing may still point at the blocks given up. The write buffer only
+    // ever holds one of them clean, as a file is flushed before it is shared.
+    invalidate_cursors(fs, file_index, first);
+    if (fs->write_buffers[file_index].index >= first && fs->write_buffers[file_index].index <= last) {
+        write_buffer_drop(fs, file_index);
+    }
+    return 0;
+}
+
+// Count the chains through every data block into fs->refs, and the block
+// table entries naming each data block of deduplicated files. Called at
+// mount for images with shared blocks, and when blocks are first shared.
+static int count_refs(fs_t *fs) {
+    fs->refs = calloc(fs->fat_entries, sizeof(int));
+    if (fs->refs == NULL) {
+        fprintf(stderr, "Error: Out of memory for block reference counts.\n");
+        return -1;
+    }
+    for (int i = 0; i < fs->dir_slots; i++) {
+        if (fs->rootDir[i].isFile != ENTRY_FILE) {
+            continue;
+        }
+        // A damaged chain ends at a bad block number or after fat_entries steps
+        int steps = 0;
+        for (int block = fs->rootDir[i].firstDataBlock; block >= 0 && block < fs->fat_entries && steps < fs->fat_entries;
+             block = fat_get(fs, block), steps++) {
+            fs->refs[block]++;
+        }
+        if (fs->rootDir[i].deduplicated && count_table_refs(fs, i) == -1) {
+            free(fs->refs);
+            fs->refs = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Start counting the chains through each data block, if that is not done yet.
+// Until the counts are rebuilt at every mount, freeing a shared block would
+// hand it out twice: the boot sector must say so before any block is shared
+// on disk.
+static int enable_refs(fs_t *fs) {
+    if (fs->refs != NULL) {
+        return 0;
+    }
+    if (!fs->bs.sharedBlocks) {
+        fs->bs.sharedBlocks = 1;
+        if (write_padded_block(fs->disk, 0, &fs->bs, sizeof(fs->bs)) == -1 || disk_sync_ex(fs->disk) == -1) {
+            fprintf(stderr, "Error: Failed to write boot sector.\n");
+            return -1;
+        }
+    }
+    return count_refs(fs);
+}
+
+
+// Snapshots. fs_snapshot_create writes a copy of FAT1 and the root directory
+// to a run of data blocks named in the boot sector's snapshot table, and the
+// data blocks stay where they are. In the copy of FAT1 each file's chain ends
+// at its size, and every other block is free.
+// fs->frozen counts the snapshots whose copy uses each data block. Such a
+// block never changes in place: a write to it goes to a fresh block that
+// takes its place in the file's chain, and once no file has it, it stays out
+// of the free-space index until the last snapshot holding it is deleted. Its
+// FAT entry may change freely, as every snapshot has a FAT of its own.
+//
+// The counts are not stored: mount rebuilds them from the copies of FAT1.
+
+// Number of snapshots in the table
+static int snapshot_count(const boot_sector *bs) {
+    int count = 0;
+    for (int i = 0; i < FS_MAX_SNAPSHOTS; i++) {
+        if (bs->snapshots[i].name[0] != '\0') {
+            count++;
+        }
+    }
+    return count;
+}
+
+// Slot of the snapshot called name in the table, or -1
+static int find_snapshot(const boot_sector *bs, const char *name) {
+    for (int i = 0; i < FS_MAX_SNAPSHOTS; i++) {
+        if (bs->snapshots[i].name[0] != '\0' && strncmp(bs->snapshots[i].name, name, FS_SNAPSHOT_NAME_LENGTH + 1) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Blocks of a snapshot's copy of the metadata
+static int snapshot_blocks(const boot_sector *bs) {
+    return bs->sizeOfFat1 + bs->sizeOfRoot;
+}
+
+// Read the copy of FAT1 of snapshot slot into fat, which has room for
+// sizeOfFat1 blocks
+static int read_snapshot_fat(fs_t *fs, int slot, int *fat) {
+    int location = fs->bs.snapshots[slot].location;
+    if (location < 0 || location > fs->fat_entries - snapshot_blocks(&fs->bs)) {
+        fprintf(stderr, "Error: Invalid location of snapshot '%s'.\n", fs->bs.snapshots[slot].name);
+        return -1;
+    }
+    if (block_read_range_ex(fs->disk, fs->bs.dataOffset + location, fs->bs.sizeOfFat1, (char *)fat) == -1) {
+        fprintf(stderr, "Error: Failed to read snapshot '%s'.\n", fs->bs.snapshots[slot].name);
+        return -1;
+    }
+    return 0;
+}
+
+// Count the snapshots holding every data block into fs->frozen, and take
+// the blocks that only snapshots still hold out of the free-space index.
+// Called at mount for images with snapshots.
+static int load_frozen(fs_t *fs) {
+    fs->frozen = calloc(fs->fat_entries, 1);
+    int *fat = malloc((size_t)fs->bs.sizeOfFat1 * fs->block_size);
+    if (fs->frozen == NULL || fat == NULL) {
+        fprintf(stderr, "Error: Out of memory for snapshots.\n");
+        free(fat);
+        return -1;
+    }
+    for (int i = 0; i < FS_MAX_SNAPSHOTS; i++) {
+        if (fs->bs.snapshots[i].name[0] == '\0') {
+            continue;
+        }
+        if (read_snapshot_fat(fs, i, fat) == -1) {
+            free(fat);
+            return -1;
+        }
+        for (int block = 0; block < fs->fat_entries; block++) {
+            if (fat[block] != -2) {
+                fs->frozen[block]++;
+                free_space_claim(&fs->space, block);
+            }
+        }
+    }
+    free(fat);
+    return 0;
+}
+
+// Give a file fresh blocks in place of those a snapshot holds among the ones
+// a write of nbyte bytes at offset changes. The fresh blocks get the data of
+// the old ones, except those the write covers whole. The blocks are the
+// file's own (see unshare_chain), and the counts cannot change under a
+// reader of the directory. Caller holds the file's lock. Returns -1 if the
+// fresh blocks do not fit on the disk.
+static int unfreeze_blocks(fs_t *fs, int file_index, size_t offset, size_t nbyte) {
+    if (fs->frozen == NULL || fs->rootDir[file_index].firstDataBlock == -1) {
+        return 0;
+    }
+    block_map *map = block_map_get(fs, file_index);
+    if (map == NULL) {
+        fprintf(stderr, "Error: Out of memory for block map.\n");
+        return -1;
+    }
+    int first = offset / fs->block_size;
+    int last = (offset + nbyte - 1) / fs->block_size;
+    if (last >= map->length) {
+        last = map->length - 1; // The rest of the write goes to new blocks
+    }
+    int count = 0;
+    for (int i = first; i <= last; i++) {
+        if (fs->frozen[map->blocks[i]]) {
+            count++;
+        }
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    // Which blocks to replace, their replacements, and the pairs to copy
+    int *lists = malloc(4 * (size_t)count * sizeof(int));
+    if (lists == NULL) {
+        fprintf(stderr, "Error: Out of memory for block map.\n");
+        return -1;
+    }
+    int *indexes = lists;
+    int *fresh = lists + count;
+    int *from = lists + 2 * count;
+    int *to = lists + 3 * count;
+    for (int i = first, n = 0; i <= last; i++) {
+        if (fs->frozen[map->blocks[i]]) {
+            indexes[n++] = i;
+        }
+    }
+    int goal = indexes[0] > 0 ? map->blocks[indexes[0] - 1] + 1 : -1;
+    if (allocate_listed(fs, goal, count, fresh) == -1) {
+        free(lists);
+        return -1;
+    }
+    int copied = 0;
+    for (int k = 0; k < count; k++) {
+        size_t start = (size_t)indexes[k] * fs->block_size;
+        if (start < offset || start + fs->block_size > offset + nbyte) {
+            from[copied] = map->blocks[indexes[k]];
+            to[copied++] = fresh[k];
+        }
+    }
+    if (copy_blocks(fs, from, to, copied) == -1) {
+        release_listed(fs, fresh, count);
+        free(lists);
+        return -1;
+    }
+
+    // The old blocks keep their data for the snapshots, so requests still
+    // reading them need not be waited for. The write buffer only ever holds
+    // one of them clean, as every file is flushed when a snapshot is taken.
+    write_buffer *wb = &fs->write_buffers[file_index];
+    pthread_mutex_lock(&fs->alloc_lock);
+    for (int k = 0; k < count; k++) {
+        int i = indexes[k];
+        if (wb->block == map->blocks[i]) {
+            write_buffer_drop(fs, file_index);
+        }
+        set_fat(fs, fresh[k], fat_get_locked(fs, map->blocks[i]));
+        if (i == 0) {
+            fs->rootDir[file_index].firstDataBlock = fresh[k];
+            dir_changed(fs, file_index);
+        } else {
+            set_fat(fs, map->blocks[i - 1], fresh[k]);
+        }
+        drop_block_locked(fs, map->blocks[i]);
+        map->blocks[i] = fresh[k];
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    invalidate_cursors(fs, file_index, indexes[0]);
+    free(lists);
+    return 0;
+}
+
+// Compressed files (fs_set_compression). The chain of a compressed file holds
+// a stream of records, storedBytes long: a header naming one extent of
+// COMPRESS_EXTENT_BYTES logical bytes, then its bytes, compressed unless that
+// would not make them smaller. Writing an extent back appends a new record
+// and leaves the old one as garbage; once garbage makes up more than half of
+// the stream (checked at the last close and at a truncate) the live records
+// are copied to a chain of their own and the old chain is let go.
+// Only the records are stored: the extent map is rebuilt by reading their
+// headers in stream order, where the last record of an extent is the one
+// that counts. The stream is appended to like any file is written, so
+// shared and frozen blocks are copied first and the chain grows with a
+// reservation past its end.
+
+#define RECORD_MAGIC 0x52504d43  // "CMPR", at the start of every record
+#define NO_RECORD ((size_t)-1)   // extent_slot.offset of an extent never written
+
+typedef struct {
+    int magic;            // RECORD_MAGIC
+    int extent;           // Logical extent the record holds
+    int length;           // Bytes of the extent in the record; the rest are zeros
+    int stored;           // Bytes of payload that follow, length if stored raw
+} record_header;
+
+// Read nbyte bytes at offset of a compressed file's stream into buf, one
+// vectored read per physically contiguous run of its chain
+static int stream_read(fs_t *fs, int file_index, size_t offset, void *buf, size_t nbyte) {
+    block_map *map = block_map_get(fs, file_index);
+    if (map == NULL) {
+        fprintf(stderr, "Error: Out of memory for block map.\n");
+        return -1;
+    }
+    int index = offset / fs->block_size;
+    size_t block_offset = offset % fs->block_size;
+    size_t done = 0;
+    while (done < nbyte) {
+        if (index >= map->length) {
+            fprintf(stderr, "Error: Chain of '%s' is shorter than its records.\n", fs->rootDir[file_index].filename);
+            return -1;
+        }
+        int run_length = 1;
+        size_t run_bytes = fs->block_size - block_offset;
+        while (run_bytes < nbyte - done && index + run_length < map->length &&
+               map->blocks[index + run_length] == map->blocks[index] + run_length) {
+            run_length++;
+            run_bytes += fs->block_size;
+        }
+        if (run_bytes > nbyte - done) {
+            run_bytes = nbyte - done;
+        }
+        io_run run = {map->blocks[index], run_length, index, block_offset, (char *)buf + done, run_bytes, 0};
+        if (read_run(fs, &run, NULL) == -1) {
+            return -1;
+        }
+        done += run_bytes;
+        index += run_length;
+        block_offset = 0;
+    }
+    return 0;
+}
+
+// Make a file's chain ready for nbyte bytes to be written at offset: shared
+// and frozen blocks among them are copied, as for any write, and the chain
+// grows, with a reservation past its end. Returns the block map, or NULL if
+// that fails; the chain may then have grown part of the way.
+static block_map *stream_reserve(fs_t *fs, int file_index, size_t offset, size_t nbyte) {
+    files *entry = &fs->rootDir[file_index];
+    int last_index = (offset + nbyte - 1) / fs->block_size;
+
+    // The blocks written change, and so does the FAT entry of the last one
+    if (unshare_chain(fs, file_index, last_index) == -1 ||
+        unfreeze_blocks(fs, file_index, offset, nbyte) == -1) {
+        return NULL;
+    }
+
+    block_map *map = block_map_get(fs, file_index);
+    if (map != NULL && map->length <= last_index) {
+        int tail = map->length > 0 ? map->blocks[map->length - 1] : -1;
+        int first = allocate_chain(fs, tail != -1 ? tail + 1 : -1,
+                                   blocks_to_allocate(fs, map->length, last_index + 1 - map->length));
+        if (first != -1) {
+            if (tail == -1) {
+                entry->firstDataBlock = first;
+                dir_changed(fs, file_index);
+            } else {
+                set_fat(fs, tail, first);
+            }
+            block_map_append_chain(fs, file_index, first);
+            map = block_map_get(fs, file_index);
+        }
+    }
+    if (map == NULL) {
+        fprintf(stderr, "Error: Out of memory for block map.\n");
+        return NULL;
+    }
+    if (map->length <= last_index) {
+        fprintf(stderr, "Error: No free data blocks available.\n");
+        return NULL;
+    }
+    return map;
+}
+
+// Write nbyte bytes of buf at offset of a file's chain, which grows as
+// needed. What the first block holds before offset stays; nothing after the
+// bytes written does. The caller sets storedBytes.
+static int stream_write(fs_t *fs, int file_index, size_t offset, const char *buf, size_t nbyte) {
+    block_map *map = stream_reserve(fs, file_index, offset, nbyte);
+    if (map == NULL) {
+        return -1;
+    }
+
+    // Only the head of the first block holds bytes that stay
+    int index = offset / fs->block_size;
+    size_t block_offset = offset % fs->block_size;
+    size_t done = 0;
+    while (done < nbyte) {
+        int run_length = 1;
+        size_t run_bytes = fs->block_size - block_offset;
+        while (run_bytes < nbyte - done && map->blocks[index + run_length] == map->blocks[index] + run_length) {
+            run_length++;
+            run_bytes += fs->block_size;
+        }
+        if (run_bytes > nbyte - done) {
+            run_bytes = nbyte - done;
+        }
+        io_run run = {map->blocks[index], run_length, index, block_offset, (char *)buf + done, run_bytes, block_offset};
+        if (write_run(fs, &run, NULL) == -1) {
+            return -1;
+        }
+        done += run_bytes;
+        index += run_length;
+        block_offset = 0;
+    }
+    return 0;
+}
+
+// Bytes of record payload a compressed file's chain has room for past the
+// end of its stream, after trying to make room for want of them. None if
+// that fails: the chain may have grown part of the way, but a block a
+// snapshot holds among it still has to be copied before it can be written.
+static size_t stream_room(fs_t *fs, int file_index, size_t want) {
+    size_t offset = fs->rootDir[file_index].storedBytes + sizeof(record_header);
+    block_map *map = stream_reserve(fs, file_index, offset - sizeof(record_header), sizeof(record_header) + want);
+    if (map == NULL) {
+        return 0;
+    }
+    size_t capacity = (size_t)map->length * fs->block_size;
+    return capacity > offset ? capacity - offset : 0;
+}
+
+// Append nbyte bytes of buf to the end of a compressed file's stream
+static int stream_append(fs_t *fs, int file_index, const char *buf, size_t nbyte) {
+    files *entry = &fs->rootDir[file_index];
+    size_t offset = entry->storedBytes;
+    if (nbyte > (size_t)INT_MAX - offset) {
+        fprintf(stderr, "Error: Maximum file size reached.\n");
+        return -1;
+    }
+    if (stream_write(fs, file_index, offset, buf, nbyte) == -1) {
+        return -1;
+    }
+    entry->storedBytes = offset + nbyte;
+    dir_changed(fs, file_index);
+    return 0;
+}
+
+// Make room in an extent map for count extents; new ones have no record
+static int extent_map_reserve(extent_map *em, int count) {
+    if (em->slots == NULL || count > em->capacity) {
+        int capacity = em->capacity > 0 ? em->capacity : 16;
+        while (capacity < count) {
+            capacity *= 2;
+        }
+        extent_slot *slots = realloc(em->slots, capacity * sizeof(extent_slot));
+        if (slots == NULL) {
+            fprintf(stderr, "Error: Out of memory for extent map.\n");
+            return -1;
+        }
+        em->slots = slots;
+        em->capacity = capacity;
+    }
+    for (; em->count < count; em->count++) {
+        em->slots[em->count].offset = NO_RECORD;
+        em->slots[em->count].length = 0;
+        em->slots[em->count].stored = 0;
+    }
+    return 0;
+}
+
+static void extent_map_free(fs_t *fs, int file_index) {
+    extent_map *em = &fs->extent_maps[file_index];
+    free(em->slots);
+    free(em->data);
+    memset(em, 0, sizeof(*em));
+}
+
+// The extent map of a compressed file, built from its record headers on
+// first use. NULL if it cannot be had.
+static extent_map *extent_map_get(fs_t *fs, int file_index) {
+    extent_map *em = &fs->extent_maps[file_index];
+    if (em->slots != NULL) {
+        return em;
+    }
+
+    files *entry = &fs->rootDir[file_index];
+    int count = (entry->sizeInBytes + COMPRESS_EXTENT_BYTES - 1) / COMPRESS_EXTENT_BYTES;
+    em->count = 0;
+    em->garbage = 0;
+    if (extent_map_reserve(em, count) == -1) {
+        return NULL;
+    }
+    size_t offset = 0;
+    while (offset < (size_t)entry->storedBytes) {
+        record_header header;
+        if (stream_read(fs, file_index, offset, &header, sizeof(header)) == -1) {
+            extent_map_free(fs, file_index);
+            return NULL;
+        }
+        size_t bytes = sizeof(header) + (size_t)header.stored;
+        if (header.magic != RECORD_MAGIC || header.extent < 0 || header.length <= 0 ||
+            header.length > COMPRESS_EXTENT_BYTES || header.stored <= 0 || header.stored > header.length ||
+            bytes > entry->storedBytes - offset) {
+            fprintf(stderr, "Error: Damaged record at offset %zu of '%s'.\n", offset, entry->filename);
+            extent_map_free(fs, file_index);
+            return NULL;
+        }
+        if (header.extent >= count) {
+            em->garbage += bytes; // Cut off by a truncate
+        } else {
+            extent_slot *slot = &em->slots[header.extent];
+            if (slot->offset != NO_RECORD) {
+                em->garbage += sizeof(header) + slot->stored;
+            }
+            slot->offset = offset;
+            slot->length = header.length;
+            slot->stored = header.stored;
+        }
+        offset += bytes;
+    }
+    return em;
+}
+
+// Fill dst, COMPRESS_EXTENT_BYTES long, with extent e of a compressed file
+static int extent_read(fs_t *fs, int file_index, extent_map *em, int e, char *dst) {
+    extent_slot *slot = &em->slots[e];
+    if (slot->offset == NO_RECORD) {
+        memset(dst, 0, COMPRESS_EXTENT_BYTES);
+        return 0;
+    }
+
+    size_t payload = slot->offset + sizeof(record_header);
+    if (slot->stored == slot->length) {
+        if (stream_read(fs, file_index, payload, dst, slot->length) == -1) {
+            return -1;
+        }
+    } else {
+        char *packed = malloc(slot->stored);
+        if (packed == NULL) {
+            fprintf(stderr, "Error: Out of memory for decompression.\n");
+            return -1;
+        }
+        int result = stream_read(fs, file_index, payload, packed, slot->stored);
+        if (result == 0 && (result = lz_decompress(packed, slot->stored, dst, slot->length)) == -1) {
+            fprintf(stderr, "Error: Damaged record of extent %d of '%s'.\n", e, fs->rootDir[file_index].filename);
+        }
+        free(packed);
+        if (result == -1) {
+            return -1;
+        }
+    }
+    memset(dst + slot->length, 0, COMPRESS_EXTENT_BYTES - slot->length);
+    return 0;
+}
+
+// Append a record of the cached extent of a compressed file if it has changed
+static int extent_flush(fs_t *fs, int file_index) {
+    extent_map *em = &fs->extent_maps[file_index];
+    if (!em->dirty) {
+        return 0;
+    }
+
+    // The record holds the extent up to the end of the file
+    size_t start = (size_t)em->index * COMPRESS_EXTENT_BYTES;
+    size_t size = fs->rootDir[file_index].sizeInBytes;
+    int length = size - start < COMPRESS_EXTENT_BYTES ? (int)(size - start) : COMPRESS_EXTENT_BYTES;
+    char *record = malloc(sizeof(record_header) + length);
+    if (record == NULL) {
+        fprintf(stderr, "Error: Out of memory for compression.\n");
+        return -1;
+    }
+    record_header header = {RECORD_MAGIC, em->index, length, 0};
+    header.stored = lz_compress(em->data, length, record + sizeof(header), length - 1);
+    if (header.stored == 0) {
+        header.stored = length; // Compression would not save anything
+        memcpy(record + sizeof(header), em->data, length);
+    }
+    memcpy(record, &header, sizeof(header));
+
+    size_t offset = fs->rootDir[file_index].storedBytes;
+    int result = stream_append(fs, file_index, record, sizeof(header) + header.stored);
+    free(record);
+    if (result == -1) {
+        return -1;
+    }
+
+    extent_slot *slot = &em->slots[em->index];
+    if (slot->offset != NO_RECORD) {
+        em->garbage += sizeof(header) + slot->stored;
+    }
+    slot->offset = offset;
+    slot->length = header.length;
+    slot->stored = header.stored;
+    em->dirty = 0;
+    return 0;
+}
+
+// Write count blocks of buf to the data blocks listed in blocks, one write
+// per run that is consecutive on the disk
+static int write_listed(fs_t *fs, const int *blocks, int count, const char *buf) {
+    for (int i = 0; i < count;) {
+        int run_length = 1;
+        while (i + run_length < count && blocks[i + run_length] == blocks[i] + run_length) {
+            run_length++;
+        }
+        if (block_write_range_ex(fs->disk, fs->bs.dataOffset + blocks[i], run_length,
+                                 (char *)buf + (size_t)i * fs->block_size) == -1) {
+            fprintf(stderr, "Error: Failed to write data blocks %d-%d.\n", blocks[i], blocks[i] + run_length - 1);
+            return -1;
+        }
+        i += run_length;
+    }
+    return 0;
+}
+
+// Rewrite the stream of a compressed file with only the latest record of
+// each extent, in extent order, to a chain allocated whole, and let go of the
+// old chain. Changes nothing if it fails.
+static int extent_compact(fs_t *fs, int file_index, extent_map *em) {
+    files *entry = &fs->rootDir[file_index];
+    size_t total = 0;
+    for (int e = 0; e < em->count; e++) {
+        if (em->slots[e].offset != NO_RECORD) {
+            total += sizeof(record_header) + em->slots[e].stored;
+        }
+    }
+
+    int blocks = (total + fs->block_size - 1) / fs->block_size;
+    size_t chunk = (size_t)COPY_RUN_BLOCKS * fs->block_size;
+    int *list = malloc((blocks > 0 ? blocks : 1) * sizeof(int));
+    char *buf = malloc(chunk + sizeof(record_header) + COMPRESS_EXTENT_BYTES);
+    if (list == NULL || buf == NULL) {
+        fprintf(stderr, "Error: Out of memory for copying blocks.\n");
+        free(list);
+        free(buf);
+        return -1;
+    }
+    if (blocks > 0 && allocate_listed(fs, -1, blocks, list) == -1) {
+        free(list);
+        free(buf);
+        return -1;
+    }
+
+    // Gather the records and write them out COPY_RUN_BLOCKS blocks at a time
+    size_t filled = 0;
+    int written = 0;
+    int result = 0;
+    for (int e = 0; e < em->count && result == 0; e++) {
+        if (em->slots[e].offset == NO_RECORD) {
+            continue;
+        }
+        size_t bytes = sizeof(record_header) + em->slots[e].stored;
+        result = stream_read(fs, file_index, em->slots[e].offset, buf + filled, bytes);
+        filled += bytes;
+        while (result == 0 && filled >= chunk) {
+            result = write_listed(fs, list + written, COPY_RUN_BLOCKS, buf);
+            written += COPY_RUN_BLOCKS;
+            filled -= chunk;
+            memmove(buf, buf + chunk, filled);
+        }
+    }
+    if (result == 0 && filled > 0) {
+        int rest = (filled + fs->block_size - 1) / fs->block_size;
+        memset(buf + filled, 0, (size_t)rest * fs->block_size - filled);
+        result = write_listed(fs, list + written, rest, buf);
+    }
+    free(buf);
+    if (result == -1) {
+        release_listed(fs, list, blocks);
+        free(list);
+        return -1;
+    }
+
+    int old_block = entry->firstDataBlock;
+    entry->firstDataBlock = blocks > 0 ? list[0] : -1;
+    entry->storedBytes = total;
+    dir_changed(fs, file_index);
+    free(list);
+    pthread_mutex_lock(&fs->alloc_lock);
+    while (old_block >= 0 && old_block < fs->fat_entries) {
+        int next_block = fat_get_locked(fs, old_block);
+        drop_block_locked(fs, old_block);
+        old_block = next_block;
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+    block_map_free(fs, file_index);
+    invalidate_cursors(fs, file_index, 0);
+
+    size_t offset = 0;
+    for (int e = 0; e < em->count; e++) {
+        if (em->slots[e].offset != NO_RECORD) {
+            em->slots[e].offset = offset;
+            offset += sizeof(record_header) + em->slots[e].stored;
+        }
+    }
+    em->garbage = 0;
+    return 0;
+}
+
+// Write back the cached extent of a compressed file nobody has open any more,
+// compact its stream if it is mostly garbage, and free the map. If the
+// extent cannot be written back the map stays, so that the next open, close
+// or sync tries again; unmount gives up on it with extent_discard.
+static int extent_release(fs_t *fs, int file_index) {
+    extent_map *em = &fs->extent_maps[file_index];
+    if (extent_flush(fs, file_index) == -1) {
+        return -1;
+    }
+    int result = 0;
+    if (!fs->read_only && em->slots != NULL &&
+        em->garbage * 2 > (size_t)fs->rootDir[file_index].storedBytes) {
+        result = extent_compact(fs, file_index, em);
+    }
+    extent_map_free(fs, file_index);
+    return result;
+}
+
+// Free the map of a compressed file whose cached extent could not be written
+// back, cutting the file to the end of the last extent its records hold
+static void extent_discard(fs_t *fs, int file_index) {
+    extent_map *em = &fs->extent_maps[file_index];
+    files *entry = &fs->rootDir[file_index];
+    if (em->dirty) {
+        size_t stored_end = 0;
+        for (int e = 0; e < em->count; e++) {
+            if (em->slots[e].offset != NO_RECORD) {
+                stored_end = (size_t)e * COMPRESS_EXTENT_BYTES + em->slots[e].length;
+            }
+        }
+        if (entry->sizeInBytes > stored_end) {
+            fprintf(stderr, "Warning: '%s' cut to %zu bytes, the rest could not be written.\n", entry->filename, stored_end);
+            entry->sizeInBytes = stored_end;
+            dir_changed(fs, file_index);
+        }
+    }
+    extent_map_free(fs, file_index);
+}
+
+// Make extent e the cached one, writing back the one cached before. Its
+// bytes are read in if load is set; otherwise nothing live in it survives the
+// caller's write, and it starts out as zeros.
+static int extent_cache(fs_t *fs, int file_index, extent_map *em, int e, int load) {
+    if (em->cached && em->index == e) {
+        return 0;
+    }
+    if (extent_flush(fs, file_index) == -1) {
+        return -1;
+    }
+    em->cached = 0;
+    if (em->data == NULL && (em->data = malloc(COMPRESS_EXTENT_BYTES)) == NULL) {
+        fprintf(stderr, "Error: Out of memory for extent cache.\n");
+        return -1;
+    }
+    if (!load) {
+        memset(em->data, 0, COMPRESS_EXTENT_BYTES);
+    } else if (extent_read(fs, file_index, em, e, em->data) == -1) {
+        return -1;
+    }
+    em->index = e;
+    em->cached = 1;
+    return 0;
+}
+
+// fs_read of a compressed file. An extent the read wants all of is
+// decompressed straight into buf; the others go through the cache.
+static int compressed_read(fs_t *fs, int fildes, void *buf, size_t nbyte) {
+    int file_index = fs->file_descriptors[fildes].file_index;
+    size_t offset = fs->file_descriptors[fildes].offset;
+    size_t size = fs->rootDir[file_index].sizeInBytes;
+    if (offset >= size) {
+        return 0; // Nothing to read
+    }
+    if (nbyte > size - offset) {
+        nbyte = size - offset;
+    }
+    extent_map *em = extent_map_get(fs, file_index);
+    if (em == NULL) {
+        return -1;
+    }
+
+    for (size_t done = 0; done < nbyte;) {
+        size_t position = offset + done;
+        int e = position / COMPRESS_EXTENT_BYTES;
+        size_t within = position % COMPRESS_EXTENT_BYTES;
+        size_t bytes = COMPRESS_EXTENT_BYTES - within;
+        if (bytes > nbyte - done) {
+            bytes = nbyte - done;
+        }
+        if (bytes == COMPRESS_EXTENT_BYTES && !(em->cached && em->index == e)) {
+            if (extent_read(fs, file_index, em, e, (char *)buf + done) == -1) {
+                return -1;
+            }
+        } else {
+            if (extent_cache(fs, file_index, em, e, 1) == -1) {
+                return -1;
+            }
+            memcpy((char *)buf + done, em->data + within, bytes);
+        }
+        done += bytes;
+    }
+
+    fs->file_descriptors[fildes].offset = offset + nbyte;
+    return nbyte;
+}
+
+// fs_write of a compressed file: the bytes are merged into the cached extent,
+// which is compressed once the writes move on to another one. The stream's
+// chain is grown first to hold the extent's record even if it does not
+// compress at all, so a full disk cuts the write short here instead of
+// failing when the extent is written back.
+static int compressed_write(fs_t *fs, int fildes, const void *buf, size_t nbyte) {
+    int file_index = fs->file_descriptors[fildes].file_index;
+    files *entry = &fs->rootDir[file_index];
+    size_t offset = fs->file_descriptors[fildes].offset;
+
+    // No file outgrows the data region, or a stream of INT_MAX bytes
+    size_t max_file_size = (size_t)fs->fat_entries * fs->block_size;
+    if (max_file_size > INT_MAX) {
+        max_file_size = INT_MAX;
+    }
+    if (offset + nbyte > max_file_size) {
+        nbyte = offset < max_file_size ? max_file_size - offset : 0;
+        if (nbyte == 0) {
+            fprintf(stderr, "Error: Maximum file size reached.\n");
+            return 0;
+        }
+    }
+    if (nbyte == 0) {
+        return 0;
+    }
+
+    extent_map *em = extent_map_get(fs, file_index);
+    if (em == NULL || extent_map_reserve(em, (offset + nbyte - 1) / COMPRESS_EXTENT_BYTES + 1) == -1) {
+        return -1;
+    }
+
+    size_t done = 0;
+    while (done < nbyte) {
+        size_t position = offset + done;
+        int e = position / COMPRESS_EXTENT_BYTES;
+        size_t within = position % COMPRESS_EXTENT_BYTES;
+        size_t bytes = COMPRESS_EXTENT_BYTES - within;
+        if (bytes > nbyte - done) {
+            bytes = nbyte - done;
+        }
+        // The extent is read in only if it keeps live bytes outside the write
+        size_t start = (size_t)e * COMPRESS_EXTENT_BYTES;
+        size_t live_end = entry->sizeInBytes < start + COMPRESS_EXTENT_BYTES ? entry->sizeInBytes : start + COMPRESS_EXTENT_BYTES;
+        int load = live_end > start && (within > 0 || position + bytes < live_end);
+        if (extent_cache(fs, file_index, em, e, load) == -1) {
+            if (done == 0) {
+                return -1;
+            }
+            break; // What was taken so far stays written
+        }
+
+        // Room for the record, raw: as much of the write as fits
+        size_t end = position + bytes > live_end ? position + bytes : live_end;
+        size_t fits = start + stream_room(fs, file_index, end - start);
+        if (fits < end) {
+            if (fits <= position || fits < live_end) {
+                if (!em->dirty) {
+                    em->cached = 0; // Maybe not read in, as the write was to cover it
+                }
+                break; // Disk is full
+            }
+            bytes = fits - position;
+        }
+        memcpy(em->data + within, (const char *)buf + done, bytes);
+        em->dirty = 1;
+        done += bytes;
+
+        // Grow the file with each extent, so that writing it back covers it
+        if (position + bytes > entry->sizeInBytes) {
+            entry->sizeInBytes = position + bytes;
+            dir_changed(fs, file_index);
+        }
+    }
+
+    fs->file_descriptors[fildes].offset = offset + done;
+    return done;
+}
+
+// fs_truncate of a compressed file: the records of extents past the new end
+// become garbage, and the stream is compacted if that leaves it mostly
+// garbage (down to no chain at all for length 0). Fails only before anything
+// has changed; compaction merely saves space, so the garbage stays if there
+// is no room for it. The caller sets the size.
+static int compressed_truncate(fs_t *fs, int file_index, size_t length) {
+    extent_map *em = extent_map_get(fs, file_index);
+    if (em == NULL) {
+        return -1;
+    }
+    int keep = (length + COMPRESS_EXTENT_BYTES - 1) / COMPRESS_EXTENT_BYTES;
+    if (em->cached && em->index >= keep) {
+        em->cached = 0; // Cut off whole, nothing to write back
+        em->dirty = 0;
+    } else if (extent_flush(fs, file_index) == -1) {
+        return -1;
+    }
+
+    for (int e = keep; e < em->count; e++) {
+        if (em->slots[e].offset != NO_RECORD) {
+            em->garbage += sizeof(record_header) + em->slots[e].stored;
+        }
+    }
+    em->count = keep;
+    if (em->garbage * 2 > (size_t)fs->rootDir[file_index].storedBytes) {
+        extent_compact(fs, file_index, em);
+    }
+    return 0;
+}
+
+
+// Deduplicated files (fs_set_deduplication). The chain of a deduplicated
+// file holds its block table, storedBytes long: for each logical block, the
+// data block holding its bytes and their fingerprint. The data blocks are
+// stored by content. Each is written once, never changes in place, and is
+// named by every table entry, of any file, whose block has the same bytes;
+// a block of zeros names none and takes no space. A data block is not on any
+// chain (its FAT entry ends a chain of one), and fs->refs counts the entries
+// naming it, so it is freed with the last of them.
+// fs->dedup_index finds the data block with a fingerprint. A block found
+// there is compared byte for byte before it is shared, so a collision only
+// costs a block of its own.
+//
+// Neither the counts nor the index are stored: mount rebuilds both from the
+// tables (sharedBlocks is set once any file is deduplicated). A crash may
+// leave a data block allocated that no committed table names any more.
+
+#define DEDUP_HOLE -1   // dedup_entry.block of a block of zeros
+
+// Read the first count entries of a deduplicated file's block table into
+// entries by walking its chain. Entries past the end of the table (a size
+// may be committed before the table catches up with it) are holes. Returns
+// count, or on a short chain, a failed read or a damaged entry the number of
+// entries before it.
+static int dedup_read_table(fs_t *fs, int file_index, dedup_entry *entries, int count) {
+    files *entry = &fs->rootDir[file_index];
+    int per_block = fs->block_size / sizeof(dedup_entry);
+    int stored = entry->storedBytes / sizeof(dedup_entry);
+    if (stored > count) {
+        stored = count;
+    }
+
+    char data[DISK_MAX_BLOCK_SIZE]; // Only the first block_size bytes are used
+    int block = entry->firstDataBlock;
+    for (int i = 0; i < stored; i += per_block) {
+        if (block < 0 || block >= fs->fat_entries) {
+            fprintf(stderr, "Error: Chain of '%s' is shorter than its block table.\n", entry->filename);
+            return i;
+        }
+        if (block_read_ex(fs->disk, fs->bs.dataOffset + block, data) == -1) {
+            fprintf(stderr, "Error: Failed to read data block %d.\n", block);
+            return i;
+        }
+        int n = stored - i < per_block ? stored - i : per_block;
+        memcpy(entries + i, data, n * sizeof(dedup_entry));
+        block = fat_get(fs, block);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (i >= stored) {
+            entries[i].block = DEDUP_HOLE;
+            entries[i].unused = 0;
+            entries[i].hash = 0;
+        } else if (entries[i].block != DEDUP_HOLE && (entries[i].block < 0 || entries[i].block >= fs->fat_entries)) {
+            fprintf(stderr, "Error: Block table of '%s' is damaged.\n", entry->filename);
+            return i;
+        }
+    }
+    return count;
+}
+
+// Read the block table of a deduplicated file from its chain into a fresh
+// array (NULL for an empty file) of *count entries
+static int dedup_load_entries(fs_t *fs, int file_index, dedup_entry **entries, int *count) {
+    *count = (fs->rootDir[file_index].sizeInBytes + fs->block_size - 1) / fs->block_size;
+    *entries = NULL;
+    if (*count == 0) {
+        return 0;
+    }
+    *entries = malloc(*count * sizeof(dedup_entry));
+    if (*entries == NULL) {
+        fprintf(stderr, "Error: Out of memory for block table.\n");
+        return -1;
+    }
+    if (dedup_read_table(fs, file_index, *entries, *count) != *count) {
+        free(*entries);
+        *entries = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Count the entries of a deduplicated file's block table into fs->refs, and
+// index the data blocks they name. A data block that is free in the FAT was
+// allocated after the last commit and named by a table rewritten in place
+// before a crash; it is taken back. A table that cannot be read whole does
+// not keep the volume from mounting: the file is cut to the part before the
+// damage.
+static int count_table_refs(fs_t *fs, int file_index) {
+    if (fs->dedup_index.next == NULL && dedup_index_init(&fs->dedup_index, fs->fat_entries) == -1) {
+        fprintf(stderr, "Error: Out of memory for fingerprint index.\n");
+        return -1;
+    }
+    files *entry = &fs->rootDir[file_index];
+    int count = (entry->sizeInBytes + fs->block_size - 1) / fs->block_size;
+    dedup_entry *entries = malloc((count > 0 ? count : 1) * sizeof(dedup_entry));
+    if (entries == NULL) {
+        fprintf(stderr, "Error: Out of memory for block table.\n");
+        return -1;
+    }
+    int good = dedup_read_table(fs, file_index, entries, count);
+    if (good < count) {
+        fprintf(stderr, "Warning: '%s' cut to %zu bytes at its damaged block table.\n", entry->filename,
+                (size_t)good * fs->block_size);
+        count = good;
+        entry->sizeInBytes = (size_t)good * fs->block_size;
+        entry->storedBytes = good * sizeof(dedup_entry);
+        dir_changed(fs, file_index);
+    }
+
+    for (int i = 0; i < count; i++) {
+        int block = entries[i].block;
+        if (block == DEDUP_HOLE || fs->refs[block]++ > 0) {
+            continue;
+        }
+        if (fat_get(fs, block) == -2) {
+            set_fat(fs, block, -1);
+            free_space_claim(&fs->space, block);
+        }
+        dedup_index_insert(&fs->dedup_index, block, entries[i].hash);
+    }
+    free(entries);
+    return 0;
+}
+
+// A block table entry lets go of data block block: the block leaves the
+// index with the last entry naming it, and is freed (see drop_block_locked)
+static void dedup_drop(fs_t *fs, int block) {
+    pthread_mutex_lock(&fs->alloc_lock);
+    if (fs->refs[block] <= 1) {
+        dedup_index_remove(&fs->dedup_index, block);
+    }
+    drop_block_locked(fs, block);
+    pthread_mutex_unlock(&fs->alloc_lock);
+}
+
+// Make room for count more blocks on a block table's dropped list, so that
+// the change that lets go of them cannot fail half way
+static int dedup_dropped_room(dedup_table *t, int count) {
+    if (t->dropped_count + count <= t->dropped_capacity) {
+        return 0;
+    }
+    int capacity = t->dropped_capacity > 0 ? t->dropped_capacity : 16;
+    while (capacity < t->dropped_count + count) {
+        capacity *= 2;
+    }
+    int *dropped = realloc(t->dropped, capacity * sizeof(int));
+    if (dropped == NULL) {
+        fprintf(stderr, "Error: Out of memory for block table.\n");
+        return -1;
+    }
+    t->dropped = dropped;
+    t->dropped_capacity = capacity;
+    return 0;
+}
+
+// Let go of the blocks on a block table's dropped list, once no table on
+// disk names them (see free_block_locked for when they are reused)
+static void dedup_drop_listed(fs_t *fs, dedup_table *t) {
+    for (int i = 0; i < t->dropped_count; i++) {
+        dedup_drop(fs, t->dropped[i]);
+    }
+    t->dropped_count = 0;
+}
+
+// Note that entries first .. last of a block table have changed
+static void dedup_mark(fs_t *fs, dedup_table *t, int first, int last) {
+    int per_block = fs->block_size / sizeof(dedup_entry);
+    first /= per_block;
+    last /= per_block;
+    if (t->dirty_last < t->dirty_first) {
+        t->dirty_first = first;
+        t->dirty_last = last;
+        return;
+    }
+    if (first < t->dirty_first) {
+        t->dirty_first = first;
+    }
+    if (last > t->dirty_last) {
+        t->dirty_last = last;
+    }
+}
+
+// Grow a block table to count entries; the new ones are holes
+static int dedup_table_grow(fs_t *fs, dedup_table *t, int count) {
+    if (count <= t->count) {
+        return 0;
+    }
+    if (count > t->capacity) {
+        int capacity = t->capacity > 0 ? t->capacity : 16;
+        while (capacity < count) {
+            capacity *= 2;
+        }
+        dedup_entry *entries = realloc(t->entries, capacity * sizeof(dedup_entry));
+        if (entries == NULL) {
+            fprintf(stderr, "Error: Out of memory for block table.\n");
+            return -1;
+        }
+        t->entries = entries;
+        t->capacity = capacity;
+    }
+    memset(t->entries + t->count, 0, (count - t->count) * sizeof(dedup_entry));
+    for (int i = t->count; i < count; i++) {
+        t->entries[i].block = DEDUP_HOLE;
+    }
+    dedup_mark(fs, t, t->count, count - 1);
+    t->count = count;
+    return 0;
+}
+
+static void dedup_table_free(fs_t *fs, int file_index) {
+    dedup_table *t = &fs->dedup_tables[file_index];
+    if (t->has_spare) {
+        pthread_mutex_lock(&fs->alloc_lock);
+        drop_block_locked(fs, t->spare);
+        pthread_mutex_unlock(&fs->alloc_lock);
+    }
+    free(t->entries);
+    free(t->data);
+    free(t->dropped);
+    memset(t, 0, sizeof(*t));
+}
+
+// The block table of a deduplicated file, read from its chain on first use.
+// NULL if it cannot be had.
+static dedup_table *dedup_table_get(fs_t *fs, int file_index) {
+    dedup_table *t = &fs->dedup_tables[file_index];
+    if (t->entries != NULL) {
+        return t;
+    }
+    int count = (fs->rootDir[file_index].sizeInBytes + fs->block_size - 1) / fs->block_size;
+    int capacity = count > 16 ? count : 16;
+    t->entries = malloc(capacity * sizeof(dedup_entry));
+    if (t->entries == NULL) {
+        fprintf(stderr, "Error: Out of memory for block table.\n");
+        return NULL;
+    }
+    t->capacity = capacity;
+    t->count = count;
+    t->dirty_first = 0;
+    t->dirty_last = -1;
+    if (dedup_read_table(fs, file_index, t->entries, count) != count) {
+        dedup_table_free(fs, file_index);
+        return NULL;
+    }
+    // Entries past the stored table (holes) still have to reach the chain
+    int stored = fs->rootDir[file_index].storedBytes / sizeof(dedup_entry);
+    if (stored < count) {
+        dedup_mark(fs, t, stored, count - 1);
+    }
+    return t;
+}
+
+// Store block index of a deduplicated file as the block_size bytes of data:
+// as a hole if they are all zeros, in a data block that already holds them
+// if there is one, otherwise in a fresh data block, the table's spare one if
+// use_spare is set. The block it replaces goes on the dropped list, as the
+// table on disk names it until the table is written.
+static int dedup_store(fs_t *fs, dedup_table *t, int index, const char *data, int use_spare) {
+    if (t->entries[index].block != DEDUP_HOLE && dedup_dropped_room(t, 1) == -1) {
+        return -1;
+    }
+    uint64_t hash = dedup_hash(data, fs->block_size);
+    int block = DEDUP_HOLE;
+    if (data[0] != 0 || memcmp(data, data + 1, fs->block_size - 1) != 0) {
+        // The candidate is held while it is compared, so it cannot be freed
+        pthread_mutex_lock(&fs->alloc_lock);
+        block = dedup_index_find(&fs->dedup_index, hash);
+        if (block != -1) {
+            fs->refs[block]++;
+        }
+        pthread_mutex_unlock(&fs->alloc_lock);
+        if (block != -1) {
+            char stored[DISK_MAX_BLOCK_SIZE];
+            if (block_read_ex(fs->disk, fs->bs.dataOffset + block, stored) == -1 ||
+                memcmp(stored, data, fs->block_size) != 0) {
+                dedup_drop(fs, block);
+                block = -1;
+            }
+        }
+
+        if (block == -1) {
+            int previous = index > 0 ? t->entries[index - 1].block : DEDUP_HOLE;
+            if (use_spare && t->has_spare) {
+                block = t->spare;
+                t->has_spare = 0;
+            } else {
+                block = allocate_chain(fs, previous != DEDUP_HOLE ? previous + 1 : -1, 1);
+            }
+            if (block == -1) {
+                fprintf(stderr, "Error: No free data blocks available.\n");
+                return -1;
+            }
+            if (block_write_ex(fs->disk, fs->bs.dataOffset + block, (char *)data) == -1) {
+                fprintf(stderr, "Error: Failed to write data block %d.\n", block);
+                dedup_drop(fs, block);
+                return -1;
+            }
+            pthread_mutex_lock(&fs->alloc_lock);
+            dedup_index_insert(&fs->dedup_index, block, hash);
+            pthread_mutex_unlock(&fs->alloc_lock);
+        }
+    }
+
+    int old = t->entries[index].block;
+    t->entries[index].block = block;
+    t->entries[index].hash = hash;
+    dedup_mark(fs, t, index, index);
+    if (old != DEDUP_HOLE) {
+        t->dropped[t->dropped_count++] = old;
+    }
+    return 0;
+}
+
+// Store the buffered block of a deduplicated file if it has changed. The
+// bytes past the end of the file are zeroed first, so that the last block
+// of equal files is shared too.
+static int dedup_store_buffer(fs_t *fs, int file_index, dedup_table *t) {
+    if (!t->cached || !t->dirty) {
+        return 0;
+    }
+    size_t start = (size_t)t->index * fs->block_size;
+    size_t size = fs->rootDir[file_index].sizeInBytes;
+    if (size < start + fs->block_size) {
+        size_t live = size > start ? size - start : 0;
+        memset(t->data + live, 0, fs->block_size - live);
+    }
+    if (dedup_store(fs, t, t->index, t->data, 1) == -1) {
+        return -1;
+    }
+    t->dirty = 0;
+    return 0;
+}
+
+// Write the blocks of a deduplicated file's table that have changed to its
+// chain, set storedBytes to the length of the table and let go of the blocks
+// it no longer names
+static int dedup_write_table(fs_t *fs, int file_index, dedup_table *t) {
+    files *entry = &fs->rootDir[file_index];
+    size_t table_bytes = (size_t)t->count * sizeof(dedup_entry);
+    int last = (int)((table_bytes + fs->block_size - 1) / fs->block_size) - 1;
+    if (t->dirty_last > last) {
+        t->dirty_last = last;
+    }
+    if (t->dirty_first <= t->dirty_last) {
+        size_t offset = (size_t)t->dirty_first * fs->block_size;
+        size_t end = (size_t)(t->dirty_last + 1) * fs->block_size;
+        if (end > table_bytes) {
+            end = table_bytes;
+        }
+        if (stream_write(fs, file_index, offset, (const char *)t->entries + offset, end - offset) == -1) {
+            return -1;
+        }
+    }
+    t->dirty_first = 0;
+    t->dirty_last = -1;
+
+    if ((size_t)entry->storedBytes != table_bytes) {
+        entry->storedBytes = table_bytes;
+        dir_changed(fs, file_index);
+    }
+    dedup_drop_listed(fs, t);
+    return 0;
+}
+
+// Store the buffered block of a deduplicated file, then write out the
+// changes to its table. The table is written even if the block cannot be
+// stored (on a full disk), so that only that block is left to retry.
+static int dedup_flush(fs_t *fs, int file_index) {
+    dedup_table *t = &fs->dedup_tables[file_index];
+    if (t->entries == NULL) {
+        return 0;
+    }
+    int result = dedup_store_buffer(fs, file_index, t);
+    if (dedup_write_table(fs, file_index, t) == -1) {
+        result = -1;
+    }
+    return result;
+}
+
+// Flush a deduplicated file nobody has open any more and free its table. If
+// that fails the table stays, so that the next open, close or sync tries
+// again; unmount gives up on it with dedup_discard.
+static int dedup_release(fs_t *fs, int file_index) {
+    if (!fs->read_only && dedup_flush(fs, file_index) == -1) {
+        return -1;
+    }
+    dedup_table_free(fs, file_index);
+    return 0;
+}
+
+// Free the table of a deduplicated file whose changes could not be written
+// back, cutting the file to what the table on disk covers. The data blocks
+// only the lost changes name stay allocated to nothing.
+static void dedup_discard(fs_t *fs, int file_index) {
+    files *entry = &fs->rootDir[file_index];
+    size_t stored_end = (size_t)(entry->storedBytes / sizeof(dedup_entry)) * fs->block_size;
+    if (entry->sizeInBytes > stored_end) {
+        fprintf(stderr, "Warning: '%s' cut to %zu bytes, the rest could not be written.\n", entry->filename, stored_end);
+        entry->sizeInBytes = stored_end;
+        dir_changed(fs, file_index);
+    }
+    dedup_table_free(fs, file_index);
+}
+
+// Make block index of a deduplicated file the buffered one, storing the one
+// buffered before. Its bytes are read in if load is set; otherwise nothing
+// live in it survives the caller's write, and it starts out as zeros.
+static int dedup_cache(fs_t *fs, int file_index, dedup_table *t, int index, int load) {
+    if (t->cached && t->index == index) {
+        return 0;
+    }
+    if (dedup_store_buffer(fs, file_index, t) == -1) {
+        return -1;
+    }
+    t->cached = 0;
+    if (t->data == NULL && (t->data = malloc(fs->block_size)) == NULL) {
+        fprintf(stderr, "Error: Out of memory for write buffer.\n");
+        return -1;
+    }
+    int block = t->entries[index].block;
+    if (!load || block == DEDUP_HOLE) {
+        memset(t->data, 0, fs->block_size);
+    } else if (block_read_ex(fs->disk, fs->bs.dataOffset + block, t->data) == -1) {
+        fprintf(stderr, "Error: Failed to read data block %d.\n", block);
+        return -1;
+    }
+    t->index = index;
+    t->cached = 1;
+    return 0;
+}
+
+// Set a data block aside for the buffered block before it first changes, so
+// that storing it later cannot run out of space. The block goes unused if
+// the buffered block turns out to be a hole or a copy of a stored one.
+static int dedup_reserve(fs_t *fs, dedup_table *t, int index) {
+    if (t->has_spare) {
+        return 0;
+    }
+    int previous = index > 0 ? t->entries[index - 1].block : DEDUP_HOLE;
+    int block = allocate_chain(fs, previous != DEDUP_HOLE ? previous + 1 : -1, 1);
+    if (block == -1) {
+        fprintf(stderr, "Error: No free data blocks available.\n");
+        return -1;
+    }
+    t->spare = block;
+    t->has_spare = 1;
+    return 0;
+}
+
+// fs_read of a deduplicated file: one vectored read per run of its blocks
+// that are consecutive on the disk, zeros for holes, and the buffered block
+// from memory
+static int dedup_read(fs_t *fs, int fildes, void *buf, size_t nbyte) {
+    int file_index = fs->file_descriptors[fildes].file_index;
+    size_t offset = fs->file_descriptors[fildes].offset;
+    size_t size = fs->rootDir[file_index].sizeInBytes;
+    if (offset >= size) {
+        return 0; // Nothing to read
+    }
+    if (nbyte > size - offset) {
+        nbyte = size - offset;
+    }
+    dedup_table *t = dedup_table_get(fs, file_index);
+    if (t == NULL) {
+        return -1;
+    }
+
+    for (size_t done = 0; done < nbyte;) {
+        size_t position = offset + done;
+        int index = position / fs->block_size;
+        size_t block_offset = position % fs->block_size;
+        size_t bytes = fs->block_size - block_offset;
+        int block = t->entries[index].block;
+        if (t->cached && t->index == index) {
+            bytes = bytes < nbyte - done ? bytes : nbyte - done;
+            memcpy((char *)buf + done, t->data + block_offset, bytes);
+        } else if (block == DEDUP_HOLE) {
+            bytes = bytes < nbyte - done ? bytes : nbyte - done;
+            memset((char *)buf + done, 0, bytes);
+        } else {
+            int run_length = 1;
+            while (bytes < nbyte - done && t->entries[index + run_length].block == block + run_length &&
+                   !(t->cached && t->index == index + run_length)) {
+                run_length++;
+                bytes += fs->block_size;
+            }
+            if (bytes > nbyte - done) {
+                bytes = nbyte - done;
+            }
+            io_run run = {block, run_length, index, block_offset, (char *)buf + done, bytes, 0};
+            if (read_run(fs, &run, NULL) == -1) {
+                return -1;
+            }
+        }
+        done += bytes;
+    }
+
+    fs->file_descriptors[fildes].offset = offset + nbyte;
+    return nbyte;
+}
+
+// fs_write of a deduplicated file: a block the write covers whole is stored
+// straight from buf, the others are merged into the buffered block, which is
+// stored once the writes move on to another one. Before an entry changes,
+// the chain is grown to hold it and the table block holding it is copied if
+// a clone or snapshot shares it, and a data block is set aside for the
+// buffered block, so a full disk cuts the write short instead of losing
+// data later.
+static int dedup_write(fs_t *fs, int fildes, const void *buf, size_t nbyte) {
+    int file_index = fs->file_descriptors[fildes].file_index;
+    files *entry = &fs->rootDir[file_index];
+    size_t offset = fs->file_descriptors[fildes].offset;
+
+    // No file outgrows the data region
+    size_t max_file_size = (size_t)fs->fat_entries * fs->block_size;
+    if (offset + nbyte > max_file_size) {
+        nbyte = offset < max_file_size ? max_file_size - offset : 0;
+        if (nbyte == 0) {
+            fprintf(stderr, "Error: Maximum file size reached.\n");
+            return 0;
+        }
+    }
+    if (nbyte == 0) {
+        return 0;
+    }
+
+    dedup_table *t = dedup_table_get(fs, file_index);
+    if (t == NULL) {
+        return -1;
+    }
+
+    size_t done = 0;
+    int reserved = -1; // Block of the table last made ready for writing
+    while (done < nbyte) {
+        size_t position = offset + done;
+        int index = position / fs->block_size;
+        size_t block_offset = position % fs->block_size;
+        size_t bytes = fs->block_size - block_offset;
+        if (bytes > nbyte - done) {
+            bytes = nbyte - done;
+        }
+        // The table block holding the entry must be writable before the
+        // entry changes: grown for new entries, copied if shared or frozen
+        int table_block = (size_t)index * sizeof(dedup_entry) / fs->block_size;
+        if (index >= t->count || table_block != reserved) {
+            size_t from = (size_t)(index < t->count ? index : t->count) * sizeof(dedup_entry);
+            if (stream_reserve(fs, file_index, from, (size_t)(index + 1) * sizeof(dedup_entry) - from) == NULL) {
+                break; // Disk is full
+            }
+            reserved = table_block;
+        }
+        if (dedup_table_grow(fs, t, index + 1) == -1) {
+            if (done == 0) {
+                return -1;
+            }
+            break; // What was stored so far stays written
+        }
+        if (bytes == fs->block_size) {
+            if (t->cached && t->index == index) {
+                t->cached = 0;
+                t->dirty = 0;
+            }
+            if (dedup_store(fs, t, index, (const char *)buf + done, 0) == -1) {
+                if (done == 0) {
+                    return -1;
+                }
+                break;
+            }
+        } else {
+            size_t start = (size_t)index * fs->block_size;
+            size_t live = entry->sizeInBytes > start ? entry->sizeInBytes - start : 0;
+            if (dedup_cache(fs, file_index, t, index, keeps_live_bytes(fs, block_offset, bytes, live)) == -1) {
+                if (done == 0) {
+                    return -1;
+                }
+                break;
+            }
+            if (!t->dirty && dedup_reserve(fs, t, index) == -1) {
+                t->cached = 0; // Maybe not read in, as the write was to cover it
+                if (done == 0) {
+                    return -1;
+                }
+                break;
+            }
+            memcpy(t->data + block_offset, (const char *)buf + done, bytes);
+            t->dirty = 1;
+        }
+        done += bytes;
+
+        // Grow the file with each block, so that storing it covers it
+        if (position + bytes > entry->sizeInBytes) {
+            entry->sizeInBytes = position + bytes;
+            dir_changed(fs, file_index);
+        }
+    }
+
+    fs->file_descriptors[fildes].offset = offset + done;
+    return done;
+}
+
+// fs_truncate of a deduplicated file: the entries past the new end let go of
+// their data blocks, and the chain is cut to what is left of the table.
+// Fails only before anything has changed. The caller sets the size.
+static int dedup_truncate(fs_t *fs, int file_index, size_t length) {
+    dedup_table *t = dedup_table_get(fs, file_index);
+    if (t == NULL) {
+        return -1;
+    }
+    int keep = (length + fs->block_size - 1) / fs->block_size;
+    if (keep < t->count && dedup_dropped_room(t, t->count - keep) == -1) {
+        return -1;
+    }
+    if (t->cached && t->index >= keep) {
+        t->cached = 0;
+        t->dirty = 0;
+    }
+    for (int i = keep; i < t->count; i++) {
+        if (t->entries[i].block != DEDUP_HOLE) {
+            t->dropped[t->dropped_count++] = t->entries[i].block;
+        }
+    }
+    if (keep < t->count) {
+        t->count = keep;
+    }
+    // The entries are gone, so the truncate stands from here: a table that
+    // cannot be written now stays dirty for the next flush, and a chain that
+    // cannot be cut keeps its blocks
+    if (dedup_write_table(fs, file_index, t) == 0) {
+        free_chain_after(fs, file_index, (fs->rootDir[file_index].storedBytes + fs->block_size - 1) / fs->block_size);
+    }
+    return 0;
+}
+
+// Let go of the data blocks of a deduplicated file that is being deleted:
+// those its table names, as kept in memory if it is (changes that could not
+// be written back are only there) along with those it has dropped since it
+// was written, otherwise as on disk
+static int dedup_drop_all(fs_t *fs, int file_index) {
+    dedup_table *t = &fs->dedup_tables[file_index];
+    dedup_entry *entries = t->entries;
+    int count = t->count;
+    if (entries == NULL && dedup_load_entries(fs, file_index, &entries, &count) == -1) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (entries[i].block != DEDUP_HOLE) {
+            dedup_drop(fs, entries[i].block);
+        }
+    }
+    if (entries != t->entries) {
+        free(entries);
+    }
+    dedup_drop_listed(fs, t);
+    return 0;
+}
+
+
+void initFAT(int FAT[], int entries){
+  for (int i = 0; i < entries; i++)
+  {
+    FAT[i] = -2;
+  }
+}
+
+// Open the image for an instance, in blocks of block_size bytes. The default
+// instance uses the default disk, so block_read(), disk_cache_stats() etc.
+// still reach what mount_fs opened; every other instance gets a disk of its own.
+static disk_t *attach_disk(fs_t *fs, char *disk_name, int block_size) {
+    if (fs == &default_fs) {
+        return open_disk_blocksize(disk_name, block_size) == -1 ? NULL : disk_default();
+    }
+    return open_disk_blocksize_ex(disk_name, block_size);
+}
+
+// Close the instance's disk, if it has one
+static int release_disk(fs_t *fs) {
+    int result = fs == &default_fs ? close_disk() : close_disk_ex(fs->disk);
+    fs->disk = NULL;
+    return result;
+}
+
+// Make everything written so far durable, logging the changes to the
+// metadata blocks marked dirty since the last commit as one journal
+// transaction. The caller holds the directory exclusively, so the FAT and the
+// root directory go out as one consistent snapshot.
+static int commit_metadata(fs_t *fs) {
+    if (fs->read_only) {
+        return 0; // Nothing can have changed
+    }
+    if (journal_commit(&fs->journal, fs->disk, &fs->bs, fs->FAT1, fs->rootDir, &fs->meta_dirty) == -1) {
+        return -1; // Still dirty, the next commit tries again
+    }
+    meta_dirty_clear(&fs->meta_dirty);
+
+    // The blocks freed since the last commit are free on disk now too
+    pthread_mutex_lock(&fs->alloc_lock);
+    for (int word = 0; fs->pending_count > 0 && word < (fs->fat_entries + 63) / 64; word++) {
+        while (fs->pending[word] != 0) {
+            int block = word * 64 + __builtin_ctzll(fs->pending[word]);
+            fs->pending[word] &= fs->pending[word] - 1;
+            fs->pending_count--;
+            if (fs->FAT1[block] == -2 && (fs->frozen == NULL || fs->frozen[block] == 0)) {
+                free_space_release(&fs->space, block);
+            }
+        }
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return 0;
+}
+
+// Make the blocks freed since the last commit reusable if fewer than wanted
+// blocks are free without them: write back every buffer and commit. Caller
+// holds the directory exclusively.
+static int reclaim_pending_locked(fs_t *fs, int wanted) {
+    pthread_mutex_lock(&fs->alloc_lock);
+    int short_of_space = fs->pending_count > 0 &&
+                         free_space_count(&fs->space) + fs->fat_unloaded * fs->fat_per_block < wanted;
+    pthread_mutex_unlock(&fs->alloc_lock);
+    if (!short_of_space) {
+        return 0;
+    }
+    if (write_buffers_flush_all(fs) == -1) {
+        return -1;
+    }
+    return commit_metadata(fs);
+}
+
+// Free the in-memory metadata of a mount
+static void free_metadata(fs_t *fs) {
+    free_space_destroy(&fs->space);
+    dir_index_destroy(&fs->dir_index);
+    journal_close(&fs->journal);
+    meta_dirty_free(&fs->meta_dirty);
+    free(fs->FAT1);
+    fs->FAT1 = NULL;
+    free(fs->fat_loaded);
+    fs->fat_loaded = NULL;
+    fs->dir_loaded = 0;
+    free(fs->refs);
+    fs->refs = NULL;
+    dedup_index_destroy(&fs->dedup_index);
+    free(fs->frozen);
+    fs->frozen = NULL;
+    free(fs->pending);
+    fs->pending = NULL;
+    fs->pending_count = 0;
+}
+
+int make_fs(char *disk_name) {
+    fs_geometry geometry = {BLOCK_SIZE, DISK_BLOCKS, 0}; // What make_disk creates
+    return make_fs_ex(disk_name, &geometry);
+}
+
+//make the file system by calling make_disk
+//The new image is built in local tables, so mounted file systems are untouched
+int make_fs_ex(char *disk_name, const fs_geometry *geometry) {
+    boot_sector bs;
+    disk_t *disk;
+    int block_size = geometry->block_size;
+
+    if (block_size < DISK_MIN_BLOCK_SIZE || block_size > DISK_MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0) {
+        fprintf(stderr, "Error: Block size must be a power of two from %d to %d bytes.\n", DISK_MIN_BLOCK_SIZE, DISK_MAX_BLOCK_SIZE);
+        return -1;
+    }
+
+    // The regions follow each other: boot sector, FAT1, FAT2, root directory,
+    // journal, data. The root directory and the journal take the same number
+    // of bytes whatever the block size; the FATs get one entry per block left.
+    memset(&bs, 0, sizeof(bs));
+    bs.blockSize = block_size;
+    bs.totalBlocks = geometry->blocks;
+    bs.locationOfBoot = 0;
+    bs.sizeOfBoot = 1;
+    bs.sizeOfRoot = (MAX_DIR_ENTRIES * (int)sizeof(files) + block_size - 1) / block_size;
+    bs.sizeOfJournal = (JOURNAL_BYTES + block_size - 1) / block_size;
+    int fixed_blocks = bs.sizeOfBoot + bs.sizeOfRoot + bs.sizeOfJournal;
+    if (geometry->blocks <= fixed_blocks) {
+        fprintf(stderr, "Error: A disk of %d blocks is too small.\n", geometry->blocks);
+        return -1;
+    }
+    bs.sizeOfFat1 = ((size_t)(geometry->blocks - fixed_blocks) * sizeof(int) + block_size - 1) / block_size;
+    bs.sizeOfFat2 = bs.sizeOfFat1;
+    bs.fat1_location = bs.locationOfBoot + bs.sizeOfBoot;
+    bs.fat2_location = bs.fat1_location + bs.sizeOfFat1;
+    bs.root_location = bs.fat2_location + bs.sizeOfFat2;
+    bs.journal_location = bs.root_location + bs.sizeOfRoot; // Metadata journal, between root and data
+    bs.dataOffset = bs.journal_location + bs.sizeOfJournal;
+    bs.num_files = 0;
+    if (bs.dataOffset >= geometry->blocks) {
+        fprintf(stderr, "Error: A disk of %d blocks is too small.\n", geometry->blocks);
+        return -1;
+    }
+
+    if (make_disk_ex(disk_name, (off_t)geometry->blocks * block_size, geometry->preallocate ? DISK_PREALLOCATE : DISK_SPARSE) == -1) {
+        printf("Disk could not be created\n");
+        return -1;
+    }
+
+    if ((disk = open_disk_blocksize_ex(disk_name, block_size)) == NULL) {
+        printf("Disk could not be opened\n");
+        return -1;
+    }
+
+    // Only the metadata regions are written; the data region stays a hole
+    int fat_entries = bs.sizeOfFat1 * (block_size / (int)sizeof(int));
+    int *fat = malloc((size_t)bs.sizeOfFat1 * block_size);
+    char *rootDir = calloc(bs.sizeOfRoot, block_size); // No files yet
+    if (fat == NULL || rootDir == NULL) {
+        fprintf(stderr, "Error: Out of memory for the new file system.\n");
+        free(fat);
+        free(rootDir);
+        close_disk_ex(disk);
+        return -1;
+    }
+    initFAT(fat, fat_entries);
+
+    // Write boot sector, both FATs and the root directory region
+    int result = write_padded_block(disk, 0, &bs, sizeof(bs));
+    if (result == 0) {
+        result = block_write_range_ex(disk, bs.fat1_location, bs.sizeOfFat1, (char *)fat);
+    }
+    if (result == 0) {
+        result = block_write_range_ex(disk, bs.fat2_location, bs.sizeOfFat2, (char *)fat);
+    }
+    if (result == 0) {
+        result = block_write_range_ex(disk, bs.root_location, bs.sizeOfRoot, rootDir);
+    }
+    free(fat);
+    free(rootDir);
+    if (result == -1) {
+        close_disk_ex(disk);
+        return -1;
+    }
+
+    // Start with an empty journal
+    if (journal_format(disk, bs.journal_location, bs.sizeOfJournal) == -1) {
+        close_disk_ex(disk);
+        return -1;
+    }
+
+    // Close the disk; mounting opens it again
+    close_disk_ex(disk);
+
+    return 0;
+}
+
+// Images made before the directory region had a single block of 64 entries
+// with 15-character names. Copy them into a region of the current format in
+// the blocks right after that one, which the old layout leaves unused, and
+// only then point the boot sector at it, so that a crash part way through
+// leaves the old directory in use. The journal is emptied as well, since its
+// records hold entries of the old size.
+static int upgrade_root(fs_t *fs) {
+    legacy_files old[64]; // The whole block, as those images have 4 KB blocks
+    int per_block = fs->block_size / sizeof(files);
+    int blocks = (64 + per_block - 1) / per_block;
+    int location = fs->bs.root_location + 1;
+    int journal_end = fs->bs.journal_location + fs->bs.sizeOfJournal;
+    if (location + blocks > fs->bs.dataOffset ||
+        (fs->bs.journal_location > 0 && location < journal_end && location + blocks > fs->bs.journal_location)) {
+        fprintf(stderr, "Error: No room to upgrade the root directory.\n");
+        return -1;
+    }
+
+    if (fs->block_size != sizeof(old)) {
+        fprintf(stderr, "Error: Invalid boot sector.\n");
+        return -1;
+    }
+    if (block_read_ex(fs->disk, fs->bs.root_location, (char *)old) == -1) {
+        fprintf(stderr, "Error: Failed to read root directory.\n");
+        return -1;
+    }
+
+    // A log left by a crash must be replayed by the version that wrote it
+    if (fs->bs.journal_location > 0 && journal_pending(fs->disk, fs->bs.journal_location) != 0) {
+        fprintf(stderr, "Error: Journal holds changes of an older version; mount and unmount the image with it first.\n");
+        return -1;
+    }
+
+    memset(fs->rootDir, 0, (size_t)blocks * fs->block_size);
+    for (int i = 0; i < 64; i++) {
+        fs->rootDir[i].isFile = old[i].isFile ? ENTRY_FILE : 0;
+        memcpy(fs->rootDir[i].filename, old[i].filename, sizeof(old[i].filename));
+        fs->rootDir[i].filename[sizeof(old[i].filename) - 1] = '\0';
+        fs->rootDir[i].firstDataBlock = old[i].firstDataBlock;
+        fs->rootDir[i].sizeInBytes = old[i].sizeInBytes;
+        memcpy(fs->rootDir[i].timeCreated, old[i].timeCreated, sizeof(old[i].timeCreated));
+        memcpy(fs->rootDir[i].dateCreated, old[i].dateCreated, sizeof(old[i].dateCreated));
+    }
+    if (block_write_range_ex(fs->disk, location, blocks, (char *)fs->rootDir) == -1 ||
+        (fs->bs.journal_location > 0 && journal_format(fs->disk, fs->bs.journal_location, fs->bs.sizeOfJournal) == -1) ||
+        disk_sync_ex(fs->disk) == -1) {
+        fprintf(stderr, "Error: Failed to write the upgraded root directory.\n");
+        return -1;
+    }
+
+    fs->bs.root_location = location;
+    fs->bs.sizeOfRoot = blocks;
+    if (write_padded_block(fs->disk, 0, &fs->bs, sizeof(fs->bs)) == -1 || disk_sync_ex(fs->disk) == -1) {
+        fprintf(stderr, "Error: Failed to write boot sector.\n");
+        return -1;
+    }
+    printf("Root directory upgraded to the multi-block format.\n");
+    return 0;
+}
+
+// Open an image for an instance and read and check its boot sector. On
+// failure the disk is closed again.
+static int open_image(fs_t *fs, char *disk_name) {
+    // Attempt to open the disk only if it is not already open. The boot
+    // sector is at the start of the image whatever the block size, so the
+    // default size will do to read it.
+    if ((fs->disk = attach_disk(fs, disk_name, BLOCK_SIZE)) == NULL) {
+        fprintf(stderr, "Error: Could not open disk '%s'.\n", disk_name);
+        return -1;
+    }
+
+    strncpy(fs->disk_name, disk_name, MAX_DISK_NAME_LENGTH - 1);
+    fs->disk_name[MAX_DISK_NAME_LENGTH - 1] = '\0'; // Ensure null-termination
+
+
+    // Read the boot sector (block 0)
+    char *boot_block = malloc(BLOCK_SIZE);
+    if (boot_block == NULL || block_read_ex(fs->disk, 0, boot_block) == -1) {
+        fprintf(stderr, "Error: Failed to read boot sector.\n");
+        free(boot_block);
+        release_disk(fs); // Close the disk if reading fails
+        return -1;
+    }
+    memcpy(&fs->bs, boot_block, sizeof(fs->bs));
+    free(boot_block);
+
+    // Images made before the geometry was recorded have the default one
+    if (fs->bs.blockSize == 0) {
+        fs->bs.blockSize = BLOCK_SIZE;
+    }
+    if (fs->bs.totalBlocks == 0) {
+        fs->bs.totalBlocks = DISK_BLOCKS;
+    }
+    if (fs->bs.blockSize != BLOCK_SIZE) {
+        release_disk(fs);
+        if ((fs->disk = attach_disk(fs, disk_name, fs->bs.blockSize)) == NULL) {
+            fprintf(stderr, "Error: Could not open disk '%s'.\n", disk_name);
+            return -1;
+        }
+    }
+    fs->block_size = fs->bs.blockSize;
+
+    // Verify the boot sector
+    if (fs->bs.sizeOfBoot <= 0 || fs->bs.fat1_location <= 0 || fs->bs.root_location <= 0 ||
+        fs->bs.dataOffset <= 0 || fs->bs.dataOffset >= fs->bs.totalBlocks ||
+        fs->bs.totalBlocks > disk_blocks_ex(fs->disk)) {
+        fprintf(stderr, "Error: Invalid boot sector.\n");
+        release_disk(fs); // Close the disk if verification fails
+        return -1;
+    }
+
+    // FAT1 holds one entry per data block, and FAT2 is written from it
+    fs->fat_entries = fs->bs.totalBlocks - fs->bs.dataOffset;
+    if (fs->bs.sizeOfFat1 <= 0 || fs->bs.sizeOfFat2 <= 0 || fs->bs.sizeOfFat2 > fs->bs.sizeOfFat1 ||
+        (size_t)fs->bs.sizeOfFat1 * fs->block_size < fs->fat_entries * sizeof(int)) {
+        fprintf(stderr, "Error: Invalid boot sector.\n");
+        release_disk(fs);
+        return -1;
+    }
+    return 0;
+}
+
+//mounts a file system that is stored on the virtual disk with name disk_name
+//Using the mount operation the disk becomes ready to use
+static int mount_locked(fs_t *fs, char *disk_name) {
+    if (fs->mounted) {
+        fprintf(stderr, "Error: File system is already mounted.\n");
+        return -1;
+    }
+    if (open_image(fs, disk_name) == -1) {
+        return -1;
+    }
+
+    fs->fat_per_block = fs->block_size / sizeof(int);
+    fs->FAT1 = malloc((size_t)fs->bs.sizeOfFat1 * fs->block_size);
+    fs->fat_loaded = calloc((fs->bs.sizeOfFat1 + 63) / 64, sizeof(uint64_t));
+    if (fs->FAT1 == NULL || fs->fat_loaded == NULL) {
+        fprintf(stderr, "Error: Out of memory for FAT1.\n");
+        free_metadata(fs);
+        release_disk(fs);
+        return -1;
+    }
+
+    // A lazy mount reads the FAT and the root directory as they are first
+    // used, so it costs the same however large the disk is. An image that
+    // needs recovery or an upgrade, or whose block reference or snapshot
+    // counts must be rebuilt, is read whole.
+    int lazy = mount_mode == FS_MOUNT_LAZY && fs->bs.sizeOfRoot != 0 && !fs->bs.sharedBlocks &&
+               snapshot_count(&fs->bs) == 0 &&
+               (fs->bs.journal_location == 0 || journal_pending(fs->disk, fs->bs.journal_location) == 0);
+    fs->fat_unloaded = fs->bs.sizeOfFat1;
+    fs->fat_next_unloaded = 0;
+
+    // Read FAT1
+    if (!lazy) {
+        if (read_fat_blocks(fs, 0, fs->bs.sizeOfFat1) == -1) {
+            fprintf(stderr, "Error: Failed to read FAT1.\n");
+            free_metadata(fs);
+            release_disk(fs);
+            return -1;
+        }
+        memset(fs->fat_loaded, 0xff, (fs->bs.sizeOfFat1 + 63) / 64 * sizeof(uint64_t));
+        fs->fat_unloaded = 0;
+    }
+
+    // Bring an image with the old one-block directory to the current format
+    if (fs->bs.sizeOfRoot == 0 && upgrade_root(fs) == -1) {
+        free_metadata(fs);
+        release_disk(fs);
+        return -1;
+    }
+
+    // The directory region must fit in front of the data and in rootDir
+    int per_block = fs->block_size / sizeof(files);
+    if (fs->bs.sizeOfRoot < 1 || fs->bs.sizeOfRoot > MAX_DIR_ENTRIES / per_block ||
+        fs->bs.root_location + fs->bs.sizeOfRoot > fs->bs.dataOffset) {
+        fprintf(stderr, "Error: Invalid boot sector.\n");
+        free_metadata(fs);
+        release_disk(fs);
+        return -1;
+    }
+    fs->dir_slots = fs->bs.sizeOfRoot * per_block;
+
+    // Read the root directory
+    if (!lazy && block_read_range_ex(fs->disk, fs->bs.root_location, fs->bs.sizeOfRoot, (char *)fs->rootDir) == -1) {
+        fprintf(stderr, "Error: Failed to read root directory.\n");
+        free_metadata(fs);
+        release_disk(fs);
+        return -1;
+    }
+
+    // Bring the metadata up to the last commit before a crash
+    if (meta_dirty_init(&fs->meta_dirty, &fs->bs) == -1 ||
+        journal_open(&fs->journal, fs->disk, &fs->bs, lazy ? NULL : fs->FAT1, fs->fat_entries, lazy ? NULL : fs->rootDir) == -1) {
+        fprintf(stderr, "Error: Failed to replay the journal.\n");
+        free_metadata(fs);
+        release_disk(fs);
+        return -1;
+    }
+    fs->pending = calloc((fs->fat_entries + 63) / 64, sizeof(uint64_t));
+    if (fs->pending == NULL) {
+        fprintf(stderr, "Error: Out of memory for freed blocks.\n");
+        free_metadata(fs);
+        release_disk(fs);
+        return -1;
+    }
+
+    // Index the free blocks so allocation does not have to scan the FAT,
+    // and the file names so lookups do not have to scan the directory.
+    // A lazy mount indexes each as it is read.
+    if (lazy) {
+        if (free_space_init(&fs->space, fs->fat_entries) == -1) {
+            free_metadata(fs);
+            release_disk(fs);
+            return -1;
+        }
+        fs->dir_loaded = 0;
+    } else {
+        if (free_space_build(&fs->space, fs->FAT1, fs->fat_entries) == -1 ||
+            dir_index_build(&fs->dir_index, fs->rootDir, fs->dir_slots) == -1 ||
+            (fs->bs.sharedBlocks && count_refs(fs) == -1) ||
+            (snapshot_count(&fs->bs) > 0 && load_frozen(fs) == -1)) {
+            free_metadata(fs);
+            release_disk(fs);
+            return -1;
+        }
+        fs->dir_loaded = 1;
+    }
+
+    for (int i = 0; i < fs->dir_slots; i++) {
+        fs->write_buffers[i].data = NULL;
+        write_buffer_drop(fs, i);
+        memset(&fs->extent_maps[i], 0, sizeof(extent_map));
+        memset(&fs->dedup_tables[i], 0, sizeof(dedup_table));
+    }
+
+    fs->mounted = 1; // Mark the file system as mounted
+    printf("File system successfully mounted.\n");
+    return 0;
+}
+
+// Mount snapshot name of an image read-only: its copies of FAT1 and the root
+// directory stand in for the live ones, and the journal is left alone
+static int mount_snapshot_locked(fs_t *fs, char *disk_name, char *name) {
+    if (open_image(fs, disk_name) == -1) {
+        return -1;
+    }
+    int slot = find_snapshot(&fs->bs, name);
+    if (slot == -1) {
+        fprintf(stderr, "Error: Snapshot '%s' not found.\n", name);
+        release_disk(fs);
+        return -1;
+    }
+    int per_block = fs->block_size / sizeof(files);
+    if (fs->bs.sizeOfRoot < 1 || fs->bs.sizeOfRoot > MAX_DIR_ENTRIES / per_block) {
+        fprintf(stderr, "Error: Invalid boot sector.\n");
+        release_disk(fs);
+        return -1;
+    }
+    fs->dir_slots = fs->bs.sizeOfRoot * per_block;
+
+    fs->fat_per_block = fs->block_size / sizeof(int);
+    fs->FAT1 = malloc((size_t)fs->bs.sizeOfFat1 * fs->block_size);
+    fs->fat_loaded = malloc((fs->bs.sizeOfFat1 + 63) / 64 * sizeof(uint64_t));
+    if (fs->FAT1 == NULL || fs->fat_loaded == NULL) {
+        fprintf(stderr, "Error: Out of memory for FAT1.\n");
+        free_metadata(fs);
+        release_disk(fs);
+        return -1;
+    }
+    memset(fs->fat_loaded, 0xff, (fs->bs.sizeOfFat1 + 63) / 64 * sizeof(uint64_t));
+    fs->fat_unloaded = 0;
+
+    int dir_location = fs->bs.dataOffset + fs->bs.snapshots[slot].location + fs->bs.sizeOfFat1;
+    if (read_snapshot_fat(fs, slot, fs->FAT1) == -1) {
+        free_metadata(fs);
+        release_disk(fs);
+        return -1;
+    }
+    if (block_read_range_ex(fs->disk, dir_location, fs->bs.sizeOfRoot, (char *)fs->rootDir) == -1) {
+        fprintf(stderr, "Error: Failed to read root directory of snapshot '%s'.\n", name);
+        free_metadata(fs);
+        release_disk(fs);
+        return -1;
+    }
+
+    // Nothing is ever allocated, so the free-space index stays empty
+    if (meta_dirty_init(&fs->meta_dirty, &fs->bs) == -1 ||
+        dir_index_build(&fs->dir_index, fs->rootDir, fs->dir_slots) == -1) {
+        free_metadata(fs);
+        release_disk(fs);
+        return -1;
+    }
+    fs->dir_loaded = 1;
+
+    for (int i = 0; i < fs->dir_slots; i++) {
+        fs->write_buffers[i].data = NULL;
+        write_buffer_drop(fs, i);
+        memset(&fs->extent_maps[i], 0, sizeof(extent_map));
+        memset(&fs->dedup_tables[i], 0, sizeof(dedup_table));
+    }
+
+    fs->read_only = 1;
+    fs->mounted = 1;
+    printf("Snapshot '%s' mounted read-only.\n", name);
+    return 0;
+}
+
+static int unmount_locked(fs_t *fs, char *disk_name) {
+    if (!fs->mounted) {
+        fprintf(stderr, "Error: File system is not mounted.\n");
+        return -1;
+    }
+
+    // Compare the provided disk name with the mounted disk name
+    if (strcmp(disk_name, fs->disk_name) != 0) {
+        fprintf(stderr, "Error: Disk name '%s' does not match the mounted disk '%s'.\n", disk_name, fs->disk_name);
+        return -1;
+    }
+
+    // Proceed with unmounting
+    for (int i = 0; i < MAX_FILE_DESCRIPTORS; i++) {
+        if (fs->file_descriptors[i].is_open) {
+            close_locked(fs, i);
+        }
+    }
+
+    // Let asynchronous requests finish; unreaped completions are dropped
+    aio_wait_idle(fs, 1);
+
+    // Data a close could not write back is given up on now, so that what
+    // is committed ends where the data on disk does; the caller learns of it
+    int lost = 0;
+    for (int i = 0; i < fs->dir_slots; i++) {
+        if (fs->extent_maps[i].slots != NULL && extent_release(fs, i) == -1) {
+            extent_discard(fs, i);
+            lost = 1;
+        }
+        if (fs->dedup_tables[i].entries != NULL && dedup_release(fs, i) == -1) {
+            dedup_discard(fs, i);
+            lost = 1;
+        }
+    }
+
+    // No need to open the disk again since it's already open
+
+    // Commit the metadata, then write it to its home locations so the next
+    // mount starts from an empty journal (msync for a mapped image)
+    if (!fs->read_only &&
+        (commit_metadata(fs) == -1 || journal_checkpoint(&fs->journal, fs->disk, &fs->bs) == -1)) {
+        goto cleanup;
+    }
+
+    // Mark as unmounted and close the disk
+    free_metadata(fs);
+    fs->mounted = 0;
+    if (release_disk(fs) == -1) {
+        fprintf(stderr, "Error: Failed to close the disk.\n");
+        return -1;
+    }
+
+    if (lost) {
+        fprintf(stderr, "Error: Unmounted, but data that could not be written back was lost.\n");
+        return -1;
+    }
+    printf("File system successfully unmounted.\n");
+    return 0;
+
+cleanup:
+    release_disk(fs);  // Ensure the disk is closed in case of an error
+    free_metadata(fs);
+    fs->mounted = 0;
+    return -1;
+}
+
+// Path resolution. Every entry is in the directory index, so each component
+// of a path costs one hash lookup and no directory is ever scanned.
+
+// Move *dir into its subdirectory name
+static int enter_directory(fs_t *fs, int *dir, const char *name) {
+    if (strcmp(name, ".") == 0) {
+        return 0;
+    }
+    if (strcmp(name, "..") == 0) {
+        if (*dir != ROOT_DIR_ID) {
+            *dir = fs->rootDir[*dir - 1].parent;
+        }
+        return 0;
+    }
+    int slot = dir_index_find(&fs->dir_index, fs->rootDir, *dir, name);
+    if (slot == -1) {
+        fprintf(stderr, "Error: Directory '%s' not found.\n", name);
+        return -1;
+    }
+    if (fs->rootDir[slot].isFile != ENTRY_DIR) {
+        fprintf(stderr, "Error: '%s' is not a directory.\n", name);
+        return -1;
+    }
+    *dir = slot + 1;
+    return 0;
+}
+
+// Resolve every component of path but the last, which must all be
+// directories. Stores the id of the directory they lead to in *parent and
+// the last component in name (MAX_FILENAME_LENGTH + 1 bytes; empty if path
+// names the root itself).
+static int resolve_parent(fs_t *fs, const char *path, int *parent, char *name) {
+    if (path == NULL || path[0] == '\0') {
+        fprintf(stderr, "Error: File name cannot be null or empty.\n");
+        return -1;
+    }
+
+    *parent = ROOT_DIR_ID;
+    name[0] = '\0';
+    while (1) {
+        while (*path == '/') {
+            path++;
+        }
+        if (*path == '\0') {
+            return 0;
+        }
+        if (name[0] != '\0' && enter_directory(fs, parent, name) == -1) {
+            return -1;
+        }
+
+        size_t length = strcspn(path, "/");
+        if (length > MAX_FILENAME_LENGTH) {
+            fprintf(stderr, "Error: File name too long.\n");
+            return -1;
+        }
+        memcpy(name, path, length);
+        name[length] = '\0';
+        path += length;
+    }
+}
+
+// Slot of the file or directory at path, or -1
+static int lookup_path(fs_t *fs, const char *path) {
+    int parent;
+    char name[MAX_FILENAME_LENGTH + 1];
+    if (resolve_parent(fs, path, &parent, name) == -1) {
+        return -1;
+    }
+    int slot = dir_index_find(&fs->dir_index, fs->rootDir, parent, name);
+    if (slot == -1) {
+        fprintf(stderr, "Error: File '%s' not found.\n", path);
+    }
+    return slot;
+}
+
+// Id of the directory at path, or -1
+static int lookup_directory(fs_t *fs, const char *path) {
+    int dir;
+    char name[MAX_FILENAME_LENGTH + 1];
+    if (resolve_parent(fs, path, &dir, name) == -1 || (name[0] != '\0' && enter_directory(fs, &dir, name) == -1)) {
+        return -1;
+    }
+    return dir;
+}
+
+//fs functions
+static int open_locked(fs_t *fs, char *fname) {
+    // Find the file in rootDir
+    int file_index = lookup_path(fs, fname);
+    if (file_index == -1) {
+        return -1;
+    }
+    if (fs->rootDir[file_index].isFile != ENTRY_FILE) {
+        fprintf(stderr, "Error: '%s' is a directory.\n", fname);
+        return -1;
+    }
+
+    // Find an available file descriptor
+    pthread_mutex_lock(&fs->file_locks[file_index]);
+    pthread_mutex_lock(&fs->fd_lock);
+    for (int fd = 0; fd < MAX_FILE_DESCRIPTORS; fd++) {
+        if (!fs->file_descriptors[fd].is_open) {
+            fs->file_descriptors[fd].is_open = 1;
+            fs->file_descriptors[fd].file_index = file_index;
+            fs->file_descriptors[fd].offset = 0;
+            set_cursor(fs, fd, 0, -1);
+            fs->file_descriptors[fd].ra_next = 0;
+            fs->file_descriptors[fd].ra_window = 0;
+            fs->file_descriptors[fd].ra_end = 0;
+            pthread_mutex_unlock(&fs->fd_lock);
+            pthread_mutex_unlock(&fs->file_locks[file_index]);
+            return fd;
+        }
+    }
+    pthread_mutex_unlock(&fs->fd_lock);
+    pthread_mutex_unlock(&fs->file_locks[file_index]);
+
+    fprintf(stderr, "Error: Maximum number of file descriptors reached.\n");
+    return -1;
+}
+
+static int close_locked(fs_t *fs, int fildes) {
+    if (fildes < 0 || fildes >= MAX_FILE_DESCRIPTORS) {
+        fprintf(stderr, "Error: Invalid file descriptor.\n");
+        return -1;
+    }
+
+    pthread_mutex_lock(&fs->fd_lock);
+    int is_open = fs->file_descriptors[fildes].is_open;
+    int file_index = fs->file_descriptors[fildes].file_index;
+    pthread_mutex_unlock(&fs->fd_lock);
+
+    if (!is_open) {
+        fprintf(stderr, "Error: File descriptor not open.\n");
+        return -1;
+    }
+
+    pthread_mutex_lock(&fs->file_locks[file_index]);
+    pthread_mutex_lock(&fs->fd_lock);
+    if (!fs->file_descriptors[fildes].is_open || fs->file_descriptors[fildes].file_index != file_index) {
+        // Closed by another thread while we waited for the file
+        pthread_mutex_unlock(&fs->fd_lock);
+        pthread_mutex_unlock(&fs->file_locks[file_index]);
+        fprintf(stderr, "Error: File descriptor not open.\n");
+        return -1;
+    }
+    fs->file_descriptors[fildes].is_open = 0;
+
+    // Give back blocks reserved past the end of the file once nobody has it open
+    int still_open = 0;
+    for (int fd = 0; fd < MAX_FILE_DESCRIPTORS; fd++) {
+        if (fs->file_descriptors[fd].is_open && fs->file_descriptors[fd].file_index == file_index) {
+            still_open = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fs->fd_lock);
+
+    int result = 0;
+    if (!still_open) {
+        aio_wait_file(fs, file_index);
+        result = write_buffer_release(fs, file_index);
+        // The reservation stays if the file's last block is shared and
+        // cannot be copied, or if data it is for could not be written back;
+        // it is tried again at the next close
+        if (result == 0) {
+            free_chain_after(fs, file_index, (chain_bytes(&fs->rootDir[file_index]) + fs->block_size - 1) / fs->block_size);
+        }
+        block_map_free(fs, file_index);
+    }
+    pthread_mutex_unlock(&fs->file_locks[file_index]);
+
+    return result;
+}
+
+// Add a file or directory (type ENTRY_FILE or ENTRY_DIR) at path
+static int create_entry(fs_t *fs, char *fname, int type) {
+    if (!fs->mounted) {
+        fprintf(stderr, "Error: File system is not mounted.\n");
+        return -1;
+    }
+    if (check_writable(fs) == -1) {
+        return -1;
+    }
+
+    int parent;
+    char name[MAX_FILENAME_LENGTH + 1];
+    if (resolve_parent(fs, fname, &parent, name) == -1) {
+        return -1;
+    }
+    if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        fprintf(stderr, "Error: Invalid file name '%s'.\n", fname);
+        return -1;
+    }
+
+    // Check if the file already exists
+    if (dir_index_find(&fs->dir_index, fs->rootDir, parent, name) != -1) {
+        fprintf(stderr, "Error: File already exists.\n");
+        return -1;
+    }
+
+    // Find an empty slot in the root directory
+    int i = dir_index_free_slot(&fs->dir_index);
+    if (i == -1) {
+        fprintf(stderr, "Error: Maximum number of files reached.\n");
+        return -1;
+    }
+
+    // Fill out each member of the files struct
+    fs->rootDir[i].isFile = type;        // Mark as a valid file or directory
+    fs->rootDir[i].numOpen = 0;          // File is not open yet
+    fs->rootDir[i].parent = parent;
+    snprintf(fs->rootDir[i].filename, sizeof(fs->rootDir[i].filename), "%s", name); // resolve_parent checked its length
+    fs->rootDir[i].firstDataBlock = -1;  // No data blocks allocated yet
+    fs->rootDir[i].sizeInBytes = 0;      // Initial file size is 0
+
+    // Set timeCreated and dateCreated
+    time_t now = time(NULL);
+    struct tm tm_now;
+    struct tm *t = localtime_r(&now, &tm_now);
+    snprintf(fs->rootDir[i].timeCreated, sizeof(fs->rootDir[i].timeCreated), "%02d:%02d:%02d",
+             t->tm_hour, t->tm_min, t->tm_sec);
+    snprintf(fs->rootDir[i].dateCreated, sizeof(fs->rootDir[i].dateCreated), "%02d/%02d/%02d",
+             t->tm_mon + 1, t->tm_mday, (t->tm_year + 1900) % 100); // Last two digits of the year
+
+    dir_index_insert(&fs->dir_index, fs->rootDir, i);
+    if (type == ENTRY_FILE) {
+        fs->bs.num_files++; // Increment the file count in the boot sector
+    }
+    dir_changed(fs, i);
+
+    printf("%s '%s' created and added to rootDir at index %d.\n", type == ENTRY_FILE ? "File" : "Directory", fname, i);
+    return 0;
+}
+
+static int create_locked(fs_t *fs, char *fname) {
+    return create_entry(fs, fname, ENTRY_FILE);
+}
+
+static int mkdir_locked(fs_t *fs, char *path) {
+    return create_entry(fs, path, ENTRY_DIR);
+}
+
+static int rmdir_locked(fs_t *fs, char *path) {
+    if (!fs->mounted) {
+        fprintf(stderr, "Error: File system is not mounted.\n");
+        return -1;
+    }
+    if (check_writable(fs) == -1) {
+        return -1;
+    }
+
+    int slot = lookup_path(fs, path);
+    if (slot == -1) {
+        return -1;
+    }
+    if (fs->rootDir[slot].isFile != ENTRY_DIR) {
+        fprintf(stderr, "Error: '%s' is not a directory.\n", path);
+        return -1;
+    }
+    if (dir_index_first(&fs->dir_index, slot + 1) != -1) {
+        fprintf(stderr, "Error: Directory '%s' is not empty.\n", path);
+        return -1;
+    }
+
+    dir_index_remove(&fs->dir_index, fs->rootDir, slot);
+    memset(&fs->rootDir[slot], 0, sizeof(files));
+    dir_changed(fs, slot);
+
+    printf("Directory '%s' removed successfully.\n", path);
+    return 0;
+}
+
+static int readdir_locked(fs_t *fs, char *path, struct fs_dirent *out, int max) {
+    if (!fs->mounted) {
+        fprintf(stderr, "Error: File system is not mounted.\n");
+        return -1;
+    }
+
+    int dir = lookup_directory(fs, path);
+    if (dir == -1) {
+        return -1;
+    }
+
+    int count = 0;
+    for (int slot = dir_index_first(&fs->dir_index, dir); slot != -1; slot = dir_index_next(&fs->dir_index, slot)) {
+        if (count < max) {
+            strcpy(out[count].name, fs->rootDir[slot].filename);
+            out[count].is_dir = fs->rootDir[slot].isFile == ENTRY_DIR;
+            out[count].size = 0;
+            if (!out[count].is_dir) {
+                // A writer grows the size under the file's lock
+                pthread_mutex_lock(&fs->file_locks[slot]);
+                out[count].size = fs->rootDir[slot].sizeInBytes;
+                pthread_mutex_unlock(&fs->file_locks[slot]);
+            }
+        }
+        count++;
+    }
+    return count;
+}
+
+// Clear a file's slot in the directory, once its blocks are gone
+static void remove_file_entry(fs_t *fs, int file_index) {
+    block_map_free(fs, file_index);
+    extent_map_free(fs, file_index);
+    dedup_table_free(fs, file_index);
+    dir_index_remove(&fs->dir_index, fs->rootDir, file_index);
+    memset(&fs->rootDir[file_index], 0, sizeof(files)); // Mark slot as free
+    dir_changed(fs, file_index);
+
+    // Decrease the number of files
+    if (fs->bs.num_files > 0) {
+        fs->bs.num_files--;
+    }
+}
+
+static int delete_locked(fs_t *fs, char *fname) {
+    if (!fs->mounted) {
+        fprintf(stderr, "Error: File system is not mounted.\n");
+        return -1;
+    }
+    if (check_writable(fs) == -1) {
+        return -1;
+    }
+
+    // Find the file in rootDir
+    int file_index = lookup_path(fs, fname);
+    if (file_index == -1) {
+        return -1;
+    }
+    if (fs->rootDir[file_index].isFile != ENTRY_FILE) {
+        fprintf(stderr, "Error: '%s' is a directory.\n", fname);
+        return -1;
+    }
+
+    // Check if the file is open in any file descriptor
+    for (int fd = 0; fd < MAX_FILE_DESCRIPTORS; fd++) {
+        if (fs->file_descriptors[fd].is_open && fs->file_descriptors[fd].file_index == file_index) {
+            fprintf(stderr, "Error: File '%s' is currently open.\n", fname);
+            return -1;
+        }
+    }
+
+    // Now, proceed to delete the file
+    // First, free all data blocks used by the file: for a deduplicated file,
+    // those its block table names, then its chain
+    aio_wait_file(fs, file_index);
+    if (fs->rootDir[file_index].deduplicated && dedup_drop_all(fs, file_index) == -1) {
+        return -1;
+    }
+    int current_block = fs->rootDir[file_index].firstDataBlock;
+    pthread_mutex_lock(&fs->alloc_lock);
+    while (current_block != -1) {
+        if (current_block < 0 || current_block >= fs->fat_entries) {
+            fprintf(stderr, "Error: Invalid block number %d in FAT chain.\n", current_block);
+            break;
+        }
+        int next_block = fat_get_locked(fs, current_block);
+        drop_block_locked(fs, current_block); // Mark as free
+        current_block = next_block;
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    remove_file_entry(fs, file_index);
+    printf("File '%s' deleted successfully.\n", fname);
+    return 0;
+}
+
+// Copy the data of the first blocks blocks of file from into a new chain for
+// file to, allocated whole so it comes in as few runs as the disk allows
+static int copy_chain(fs_t *fs, int from, int to, int blocks) {
+    int *source = malloc(blocks * sizeof(int));
+    int *copies = malloc(blocks * sizeof(int));
+    if (source == NULL || copies == NULL) {
+        fprintf(stderr, "Error: Out of memory for copying blocks.\n");
+        free(source);
+        free(copies);
+        return -1;
+    }
+
+    int length = 0;
+    for (int block = fs->rootDir[from].firstDataBlock; block != -1 && length < blocks; block = fat_get(fs, block)) {
+        source[length++] = block;
+    }
+    int result = -1;
+    if (length < blocks) {
+        fprintf(stderr, "Error: Chain of '%s' is shorter than the file.\n", fs->rootDir[from].filename);
+    } else if (allocate_listed(fs, -1, blocks, copies) == 0) {
+        result = copy_blocks(fs, source, copies, blocks);
+        if (result == 0) {
+            fs->rootDir[to].firstDataBlock = copies[0];
+        } else {
+            release_listed(fs, copies, blocks);
+        }
+    }
+    free(source);
+    free(copies);
+    return result;
+}
+
+// Point file to at the first blocks blocks of the chain of file from
+static int clone_chain(fs_t *fs, int from, int to, int blocks) {
+    // Give back the source's reservation first, so only blocks it uses are shared
+    if (free_chain_after(fs, from, blocks) == -1) {
+        return -1;
+    }
+    invalidate_cursors(fs, from, blocks);
+    block_map_free(fs, from);
+
+    if (enable_refs(fs) == -1) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    for (int block = fs->rootDir[from].firstDataBlock; block != -1; block = fat_get_locked(fs, block)) {
+        fs->refs[block]++;
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+    fs->rootDir[to].firstDataBlock = fs->rootDir[from].firstDataBlock;
+    return 0;
+}
+
+// Give file to a copy of the first blocks blocks of the chain of deduplicated
+// file from, its block table: the data blocks the table names are shared
+static int dedup_copy(fs_t *fs, int from, int to, int blocks) {
+    dedup_entry *entries;
+    int count;
+    if (dedup_load_entries(fs, from, &entries, &count) == -1) {
+        return -1;
+    }
+    if (copy_chain(fs, from, to, blocks) == -1) {
+        free(entries);
+        return -1;
+    }
+    pthread_mutex_lock(&fs->alloc_lock);
+    for (int i = 0; i < count; i++) {
+        if (entries[i].block != DEDUP_HOLE) {
+            fs->refs[entries[i].block]++;
+        }
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+    free(entries);
+    return 0;
+}
+
+static int copy_locked(fs_t *fs, char *src, char *dst, int flags) {
+    if (!fs->mounted) {
+        fprintf(stderr, "Error: File system is not mounted.\n");
+        return -1;
+    }
+    if ((flags & ~FS_COPY_CLONE) != 0) {
+        fprintf(stderr, "Error: Unknown copy flags %d.\n", flags);
+        return -1;
+    }
+
+    int from = lookup_path(fs, src);
+    if (from == -1) {
+        return -1;
+    }
+    if (fs->rootDir[from].isFile != ENTRY_FILE) {
+        fprintf(stderr, "Error: '%s' is a directory.\n", src);
+        return -1;
+    }
+    // A full copy may need the blocks freed since the last commit
+    if (!(flags & FS_COPY_CLONE) && !fs->rootDir[from].deduplicated &&
+        reclaim_pending_locked(fs, (chain_bytes(&fs->rootDir[from]) + fs->block_size - 1) / fs->block_size) == -1) {
+        return -1;
+    }
+    if (create_entry(fs, dst, ENTRY_FILE) == -1) {
+        return -1;
+    }
+    int to = lookup_path(fs, dst);
+
+    // Everything written to the source must be on the disk
+    aio_wait_file(fs, from);
+    int result = write_buffer_flush(fs, from);
+    size_t size = fs->rootDir[from].sizeInBytes;
+    int blocks = (chain_bytes(&fs->rootDir[from]) + fs->block_size - 1) / fs->block_size;
+    if (result == 0 && blocks > 0) {
+        if (fs->rootDir[from].deduplicated) {
+            result = dedup_copy(fs, from, to, blocks); // Its data blocks are shared either way
+        } else {
+            result = flags & FS_COPY_CLONE ? clone_chain(fs, from, to, blocks) : copy_chain(fs, from, to, blocks);
+        }
+    }
+    if (result == -1) {
+        remove_file_entry(fs, to);
+        return -1;
+    }
+
+    fs->rootDir[to].sizeInBytes = size;
+    fs->rootDir[to].compressed = fs->rootDir[from].compressed;
+    fs->rootDir[to].deduplicated = fs->rootDir[from].deduplicated;
+    fs->rootDir[to].storedBytes = fs->rootDir[from].storedBytes;
+    dir_changed(fs, to);
+    printf("File '%s' copied to '%s'.\n", src, dst);
+    return 0;
+}
+
+// Find the empty file whose way of being stored is to change, and give up
+// its chain: a compressed file's only ever holds records, a deduplicated
+// file's only its block table. what names the change for messages. Returns
+// the file's slot, or -1.
+static int prepare_storage_change(fs_t *fs, char *fname, const char *what) {
+    if (!fs->mounted) {
+        fprintf(stderr, "Error: File system is not mounted.\n");
+        return -1;
+    }
+    if (check_writable(fs) == -1) {
+        return -1;
+    }
+
+    int file_index = lookup_path(fs, fname);
+    if (file_index == -1) {
+        return -1;
+    }
+    if (fs->rootDir[file_index].isFile != ENTRY_FILE) {
+        fprintf(stderr, "Error: '%s' is a directory.\n", fname);
+        return -1;
+    }
+    if (fs->rootDir[file_index].sizeInBytes != 0) {
+        fprintf(stderr, "Error: %s of '%s' can only change while it is empty.\n", what, fname);
+        return -1;
+    }
+
+    aio_wait_file(fs, file_index);
+    write_buffer_drop(fs, file_index);
+    extent_map_free(fs, file_index);
+    dedup_table_free(fs, file_index);
+    if (free_chain_after(fs, file_index, 0) == -1) {
+        return -1;
+    }
+    invalidate_cursors(fs, file_index, 0);
+    fs->rootDir[file_index].storedBytes = 0;
+    dir_changed(fs, file_index);
+    return file_index;
+}
+
+// Turn compression of an empty file on or off
+static int set_compression_locked(fs_t *fs, char *fname, int on) {
+    int file_index = prepare_storage_change(fs, fname, "Compression");
+    if (file_index == -1) {
+        return -1;
+    }
+    if (on && fs->rootDir[file_index].deduplicated) {
+        fprintf(stderr, "Error: '%s' is deduplicated.\n", fname);
+        return -1;
+    }
+    fs->rootDir[file_index].compressed = on ? 1 : 0;
+
+    printf("Compression of '%s' turned %s.\n", fname, on ? "on" : "off");
+    return 0;
+}
+
+// Turn deduplication of an empty file on or off. The first deduplicated file
+// of an image starts the block reference counts and the fingerprint index.
+static int set_deduplication_locked(fs_t *fs, char *fname, int on) {
+    int file_index = prepare_storage_change(fs, fname, "Deduplication");
+    if (file_index == -1) {
+        return -1;
+    }
+    if (on && fs->rootDir[file_index].compressed) {
+        fprintf(stderr, "Error: '%s' is compressed.\n", fname);
+        return -1;
+    }
+    if (on) {
+        if (enable_refs(fs) == -1) {
+            return -1;
+        }
+        if (fs->dedup_index.next == NULL && dedup_index_init(&fs->dedup_index, fs->fat_entries) == -1) {
+            fprintf(stderr, "Error: Out of memory for fingerprint index.\n");
+            return -1;
+        }
+    }
+    fs->rootDir[file_index].deduplicated = on ? 1 : 0;
+
+    printf("Deduplication of '%s' turned %s.\n", fname, on ? "on" : "off");
+    return 0;
+}
+
+// Take snapshot name of the volume: one write of a copy of FAT1 and the root
+// directory into a run of free data blocks, which the commit that follows
+// marks used, then a slot of the boot sector's table pointing at it. A crash
+// between the two leaves the run allocated to nothing.
+static int snapshot_create_locked(fs_t *fs, char *name) {
+    if (!fs->mounted) {
+        fprintf(stderr, "Error: File system is not mounted.\n");
+        return -1;
+    }
+    if (check_writable(fs) == -1) {
+        return -1;
+    }
+    if (name == NULL || name[0] == '\0' || strlen(name) > FS_SNAPSHOT_NAME_LENGTH) {
+        fprintf(stderr, "Error: Invalid snapshot name.\n");
+        return -1;
+    }
+    if (find_snapshot(&fs->bs, name) != -1) {
+        fprintf(stderr, "Error: Snapshot '%s' already exists.\n", name);
+        return -1;
+    }
+    int slot = 0;
+    while (slot < FS_MAX_SNAPSHOTS && fs->bs.snapshots[slot].name[0] != '\0') {
+        slot++;
+    }
+    if (slot == FS_MAX_SNAPSHOTS) {
+        fprintf(stderr, "Error: Maximum number of snapshots reached.\n");
+        return -1;
+    }
+
+    // Everything written so far goes into the snapshot, and the copy needs
+    // all of FAT1
+    aio_wait_idle(fs, 0);
+    for (int i = 0; i < fs->dir_slots; i++) {
+        if (write_buffer_flush(fs, i) == -1) {
+            return -1;
+        }
+    }
+    pthread_mutex_lock(&fs->alloc_lock);
+    while (fault_next_fat_block_locked(fs) == 1) {
+    }
+    int unloaded = fs->fat_unloaded;
+    pthread_mutex_unlock(&fs->alloc_lock);
+    if (unloaded > 0) {
+        return -1;
+    }
+
+    int count = snapshot_blocks(&fs->bs);
+    int *blocks = malloc(count * sizeof(int));
+    char *copy = malloc((size_t)count * fs->block_size);
+    if (fs->frozen == NULL) {
+        fs->frozen = calloc(fs->fat_entries, 1);
+    }
+    if (blocks == NULL || copy == NULL || fs->frozen == NULL) {
+        fprintf(stderr, "Error: Out of memory for snapshot.\n");
+        goto fail;
+    }
+    if (allocate_listed(fs, -1, count, blocks) == -1) {
+        goto fail;
+    }
+    int location = blocks[0];
+    if (blocks[count - 1] != location + count - 1) {
+        fprintf(stderr, "Error: No run of %d free blocks for the snapshot.\n", count);
+        goto release;
+    }
+
+    // The chains of the copy end at the files' sizes, so neither reserved
+    // blocks nor other snapshots' copies are held by it
+    int *fat = (int *)copy;
+    files *dir = (files *)(copy + (size_t)fs->bs.sizeOfFat1 * fs->block_size);
+    initFAT(fat, fs->bs.sizeOfFat1 * fs->fat_per_block);
+    memcpy(dir, fs->rootDir, (size_t)fs->bs.sizeOfRoot * fs->block_size);
+    for (int i = 0; i < fs->dir_slots; i++) {
+        if (dir[i].isFile != ENTRY_FILE) {
+            continue;
+        }
+        dir[i].numOpen = 0;
+        int keep = (chain_bytes(&dir[i]) + fs->block_size - 1) / fs->block_size;
+        int prev_block = -1;
+        int block = dir[i].firstDataBlock;
+        for (int kept = 0; kept < keep && block >= 0 && block < fs->fat_entries; kept++) {
+            if (prev_block != -1) {
+                fat[prev_block] = block;
+            }
+            fat[block] = -1;
+            prev_block = block;
+            block = fs->FAT1[block];
+        }
+        if (prev_block == -1) {
+            dir[i].firstDataBlock = -1;
+        }
+    }
+    // The data blocks of deduplicated files are on no chain
+    for (int block = 0; fs->dedup_index.next != NULL && block < fs->fat_entries; block++) {
+        if (dedup_index_contains(&fs->dedup_index, block)) {
+            fat[block] = -1;
+        }
+    }
+
+    // The copy, then the allocation of its run, then the table
+    if (block_write_range_ex(fs->disk, fs->bs.dataOffset + location, count, copy) == -1 ||
+        commit_metadata(fs) == -1) {
+        fprintf(stderr, "Error: Failed to write snapshot '%s'.\n", name);
+        goto release;
+    }
+    snapshot_entry *entry = &fs->bs.snapshots[slot];
+    memset(entry, 0, sizeof(*entry));
+    strncpy(entry->name, name, FS_SNAPSHOT_NAME_LENGTH);
+    entry->location = location;
+    time_t now = time(NULL);
+    struct tm tm_now;
+    struct tm *t = localtime_r(&now, &tm_now);
+    strftime(entry->timeCreated, sizeof(entry->timeCreated), "%H:%M:%S", t);
+    strftime(entry->dateCreated, sizeof(entry->dateCreated), "%m/%d/%y", t);
+    if (write_padded_block(fs->disk, 0, &fs->bs, sizeof(fs->bs)) == -1 || disk_sync_ex(fs->disk) == -1) {
+        fprintf(stderr, "Error: Failed to write boot sector.\n");
+        memset(entry, 0, sizeof(*entry));
+        goto release;
+    }
+
+    // From now on the blocks of the copy's chains do not change in place
+    pthread_mutex_lock(&fs->alloc_lock);
+    for (int block = 0; block < fs->fat_entries; block++) {
+        if (fat[block] != -2) {
+            fs->frozen[block]++;
+        }
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+    free(blocks);
+    free(copy);
+    printf("Snapshot '%s' created.\n", name);
+    return 0;
+
+release:
+    release_listed(fs, blocks, count);
+fail:
+    if (snapshot_count(&fs->bs) == 0) {
+        free(fs->frozen);
+        fs->frozen = NULL;
+    }
+    free(blocks);
+    free(copy);
+    return -1;
+}
+
+// Delete snapshot name: its slot in the table goes first, then the blocks
+// only it held and the run of its copy are freed
+static int snapshot_delete_locked(fs_t *fs, char *name) {
+    if (!fs->mounted) {
+        fprintf(stderr, "Error: File system is not mounted.\n");
+        return -1;
+    }
+    if (check_writable(fs) == -1) {
+        return -1;
+    }
+    int slot = find_snapshot(&fs->bs, name);
+    if (slot == -1) {
+        fprintf(stderr, "Error: Snapshot '%s' not found.\n", name);
+        return -1;
+    }
+    int *fat = malloc((size_t)fs->bs.sizeOfFat1 * fs->block_size);
+    if (fat == NULL) {
+        fprintf(stderr, "Error: Out of memory for snapshot.\n");
+        return -1;
+    }
+    if (read_snapshot_fat(fs, slot, fat) == -1) {
+        free(fat);
+        return -1;
+    }
+
+    snapshot_entry entry = fs->bs.snapshots[slot];
+    memset(&fs->bs.snapshots[slot], 0, sizeof(entry));
+    if (write_padded_block(fs->disk, 0, &fs->bs, sizeof(fs->bs)) == -1 || disk_sync_ex(fs->disk) == -1) {
+        fprintf(stderr, "Error: Failed to write boot sector.\n");
+        fs->bs.snapshots[slot] = entry;
+        free(fat);
+        return -1;
+    }
+
+    // Requests in flight may still be reading blocks about to be freed
+    aio_wait_idle(fs, 0);
+    pthread_mutex_lock(&fs->alloc_lock);
+    for (int block = 0; block < fs->fat_entries; block++) {
+        if (fat[block] != -2 && --fs->frozen[block] == 0 && fs->FAT1[block] == -2) {
+            free_block_locked(fs, block);
+        }
+    }
+    for (int i = 0; i < snapshot_blocks(&fs->bs); i++) {
+        drop_block_locked(fs, entry.location + i);
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+    if (snapshot_count(&fs->bs) == 0) {
+        free(fs->frozen);
+        fs->frozen = NULL;
+    }
+    free(fat);
+    printf("Snapshot '%s' deleted.\n", name);
+    return 0;
+}
+
+// Read up to nbyte bytes at the descriptor's offset into buf, handing each
+// physically contiguous run to visit, and advance the offset past them.
+// Returns the number of bytes covered or -1.
+static int walk_read(fs_t *fs, int fildes, void *buf, size_t nbyte, run_visitor visit, void *ctx) {
+    int file_index = fs->file_descriptors[fildes].file_index;
+    size_t file_offset = fs->file_descriptors[fildes].offset;
+    size_t file_size = fs->rootDir[file_index].sizeInBytes;
+
+    // Check if the file pointer is at or beyond the end of the file
+    if (file_offset >= file_size) {
+        return 0; // Nothing to read
+    }
+
+    // Calculate the number of bytes to read
+    size_t bytes_to_read = nbyte;
+    if (file_offset + nbyte > file_size) {
+        bytes_to_read = file_size - file_offset;
+    }
+
+    size_t bytes_remaining = bytes_to_read;
+    size_t buffer_offset = 0; // Offset into buf
+    size_t block_offset = file_offset % fs->block_size;
+    int block_index_within_file = file_offset / fs->block_size;
+
+    // Get the starting data block
+    if (fs->rootDir[file_index].firstDataBlock == -1) {
+        // No data blocks allocated yet
+        return 0;
+    }
+
+    // Find the starting block, hopping from the descriptor's cursor
+    int current_block = locate_block(fs, fildes, block_index_within_file);
+    int current_index = block_index_within_file;
+    if (current_block == -1) {
+        // Reached end of file before expected
+        return -1;
+    }
+
+    while (bytes_remaining > 0 && current_block != -1) {
+        // Collect a run of physically contiguous blocks so it can be read in one call
+        int run_start = current_block;
+        int run_length = 1;
+        size_t run_bytes = fs->block_size - block_offset;
+        while (run_bytes < bytes_remaining && fat_get(fs, current_block) == current_block + 1) {
+            current_block++;
+            run_length++;
+            run_bytes += fs->block_size;
+        }
+        if (run_bytes > bytes_remaining) {
+            run_bytes = bytes_remaining;
+        }
+
+        io_run run = {run_start, run_length, current_index, block_offset, (char *)buf + buffer_offset, run_bytes, 0};
+        if (visit(fs, &run, ctx) == -1) {
+            return -1;
+        }
+
+        buffer_offset += run_bytes;
+        bytes_remaining -= run_bytes;
+        file_offset += run_bytes;
+        block_offset = 0; // Reset block offset for subsequent blocks
+
+        // Leave the cursor on the last block read, then move to the next one
+        current_index += run_length - 1;
+        set_cursor(fs, fildes, current_index, current_block);
+        current_block = fat_get(fs, current_block);
+        current_index++;
     }
 
     // Update the file descriptor's offset
-    file_descriptors[fildes].offset = file_offset;
+    fs->file_descriptors[fildes].offset = file_offset;
 
     // Return the number of bytes actually read
     return bytes_to_read - bytes_remaining;
 }
 
-int fs_write(int fildes, void *buf, size_t nbyte) {
-    if (!is_mounted) {
+static int read_locked(fs_t *fs, int fildes, void *buf, size_t nbyte) {
+    size_t start = fs->file_descriptors[fildes].offset;
+    aio_wait_file(fs, fs->file_descriptors[fildes].file_index);
+    if (fs->rootDir[fs->file_descriptors[fildes].file_index].compressed) {
+        return compressed_read(fs, fildes, buf, nbyte);
+    }
+    if (fs->rootDir[fs->file_descriptors[fildes].file_index].deduplicated) {
+        return dedup_read(fs, fildes, buf, nbyte);
+    }
+    if (write_buffer_flush(fs, fs->file_descriptors[fildes].file_index) == -1) {
+        return -1;
+    }
+    int bytes_read = walk_read(fs, fildes, buf, nbyte, read_run, NULL);
+    if (bytes_read > 0) {
+        readahead(fs, fildes, start, start + bytes_read);
+    }
+    return bytes_read;
+}
+
+static int read_view_locked(fs_t *fs, int fildes, size_t nbyte, struct fs_iovec *out, int *cnt) {
+    if (out == NULL || cnt == NULL || *cnt <= 0) {
+        fprintf(stderr, "Error: Invalid view array.\n");
+        return -1;
+    }
+
+    int capacity = *cnt;
+    *cnt = 0;
+
+    int file_index = fs->file_descriptors[fildes].file_index;
+    aio_wait_file(fs, file_index);
+    if (write_buffer_flush(fs, file_index) == -1) {
+        return -1;
+    }
+    size_t file_offset = fs->file_descriptors[fildes].offset;
+    size_t file_size = fs->rootDir[file_index].sizeInBytes;
+
+    // Check if the file pointer is at or beyond the end of the file
+    if (file_offset >= file_size || fs->rootDir[file_index].firstDataBlock == -1) {
+        return 0; // Nothing to read
+    }
+
+    size_t bytes_to_read = nbyte;
+    if (file_offset + nbyte > file_size) {
+        bytes_to_read = file_size - file_offset;
+    }
+
+    // Without a mapped image or a block cache the bytes have to be staged in
+    // one private buffer, as do those of a compressed or deduplicated file
+    int mapped = block_ptr_ex(fs->disk, fs->bs.dataOffset) != NULL;
+    if ((!mapped && !disk_cached_ex(fs->disk)) || fs->rootDir[file_index].compressed ||
+        fs->rootDir[file_index].deduplicated) {
+        char *staging = malloc(bytes_to_read);
+        if (staging == NULL) {
+            fprintf(stderr, "Error: Out of memory for read view.\n");
+            return -1;
+        }
+        int bytes_read = read_locked(fs, fildes, staging, bytes_to_read);
+        if (bytes_read <= 0) {
+            free(staging);
+            return bytes_read;
+        }
+        out[0].base = staging;
+        out[0].len = bytes_read;
+        out[0].backing = staging;
+        *cnt = 1;
+        return bytes_read;
+    }
+
+    size_t bytes_remaining = bytes_to_read;
+    size_t block_offset = file_offset % fs->block_size;
+    int block_index_within_file = file_offset / fs->block_size;
+
+    // Find the starting block, hopping from the descriptor's cursor
+    int current_block = locate_block(fs, fildes, block_index_within_file);
+    int current_index = block_index_within_file;
+    if (current_block == -1) {
+        // Reached end of file before expected
+        return -1;
+    }
+
+    // Hand out one piece per physically contiguous run of a mapped image, or
+    // one pinned cache block per piece otherwise
+    while (bytes_remaining > 0 && current_block != -1 && *cnt < capacity) {
+        int run_start = current_block;
+        size_t run_bytes = fs->block_size - block_offset;
+        while (mapped && run_bytes < bytes_remaining && fat_get(fs, current_block) == current_block + 1) {
+            current_block++;
+            run_bytes += fs->block_size;
+        }
+        if (run_bytes > bytes_remaining) {
+            run_bytes = bytes_remaining;
+        }
+
+        const char *data = block_pin_ex(fs->disk, fs->bs.dataOffset + run_start);
+        if (data == NULL) {
+            break; // Every cache entry is pinned, return a short view
+        }
+
+        out[*cnt].base = data + block_offset;
+        out[*cnt].len = run_bytes;
+        out[*cnt].backing = mapped ? NULL : (void *)data;
+        (*cnt)++;
+
+        bytes_remaining -= run_bytes;
+        file_offset += run_bytes;
+        block_offset = 0;
+
+        current_index += current_block - run_start;
+        set_cursor(fs, fildes, current_index, current_block);
+        current_block = fat_get(fs, current_block);
+        current_index++;
+    }
+
+    // Update the file descriptor's offset past the bytes covered by the view
+    size_t start = fs->file_descriptors[fildes].offset;
+    fs->file_descriptors[fildes].offset = file_offset;
+    if (file_offset > start) {
+        readahead(fs, fildes, start, file_offset);
+    }
+
+    return bytes_to_read - bytes_remaining;
+}
+
+void fs_release_view_ex(fs_t *fs, struct fs_iovec *view, int cnt) {
+    if (fs == NULL || view == NULL) {
+        return;
+    }
+    for (int i = 0; i < cnt; i++) {
+        // A pinned cache block, or else a staging buffer (NULL for a mapped image)
+        if (!block_unpin_ex(fs->disk, view[i].backing)) {
+            free(view[i].backing);
+        }
+        view[i].base = NULL;
+        view[i].len = 0;
+        view[i].backing = NULL;
+    }
+}
+
+// Write counterpart of walk_read: allocates blocks as needed, hands each run
+// to visit, then advances the offset and grows the file. Returns the number of
+// bytes covered (short if the disk fills up) or -1.
+static int walk_write(fs_t *fs, int fildes, void *buf, size_t nbyte, run_visitor visit, void *ctx) {
+    int file_index = fs->file_descriptors[fildes].file_index;
+    size_t file_offset = fs->file_descriptors[fildes].offset;
+    size_t file_size = fs->rootDir[file_index].sizeInBytes; // Size before this write
+
+    // Check for maximum file size: no file outgrows the data region
+    size_t max_file_size = (size_t)fs->fat_entries * fs->block_size;
+    if (file_offset + nbyte > max_file_size) {
+        nbyte = file_offset < max_file_size ? max_file_size - file_offset : 0;
+        if (nbyte == 0) {
+            fprintf(stderr, "Error: Maximum file size reached.\n");
+            return 0;
+        }
+    }
+
+    if (nbyte == 0) {
+        return 0;
+    }
+
+    size_t bytes_to_write = nbyte;
+    size_t bytes_written = 0;
+    size_t buffer_offset = 0; // Offset into buf
+    size_t block_offset = file_offset % fs->block_size;
+    int block_index_within_file = file_offset / fs->block_size;
+    int last_block_index = (file_offset + nbyte - 1) / fs->block_size; // Last block this write touches
+
+    // Blocks shared with another file or held by a snapshot get copies of
+    // their own before they change
+    if (unshare_chain(fs, file_index, last_block_index) == -1 ||
+        unfreeze_blocks(fs, file_index, file_offset, nbyte) == -1) {
+        return -1;
+    }
+
+    // Get the block to start walking from: the descriptor's cursor, or the
+    // first data block
+    int current_index; // Position of current_block within the file
+    int current_block = walk_start(fs, fildes, block_index_within_file, &current_index);
+
+    // If the file has no data blocks yet, allocate the whole write as one chain
+    if (current_block == -1) {
+        current_block = allocate_chain(fs, -1, blocks_to_allocate(fs, 0, last_block_index + 1));
+        if (current_block == -1) {
+            fprintf(stderr, "Error: No free data blocks available.\n");
+            return 0; // Disk is full
+        }
+        fs->rootDir[file_index].firstDataBlock = current_block;
+        dir_changed(fs, file_index);
+        block_map_append_chain(fs, file_index, current_block);
+        current_index = 0;
+    }
+
+    // Traverse to the correct block, extending the chain if the offset sits
+    // right at the end of the last block
+    while (current_index < block_index_within_file && current_block != -1) {
+        current_block = next_block_or_allocate(fs, file_index, current_block, current_index + 1, last_block_index - current_index);
+        current_index++;
+    }
+    if (current_block == -1) {
+        fprintf(stderr, "Warning: Disk is full. Could not allocate new data block.\n");
+        return 0;
+    }
+
+    while (bytes_to_write > 0) {
+        // Collect a run of physically contiguous blocks, allocating as we go,
+        // so the whole run is written in one call
+        int run_start = current_block;
+        int run_start_index = current_index;
+        int run_length = 1;
+        int next_block = -1;
+        size_t run_bytes = fs->block_size - block_offset;
+        while (run_bytes < bytes_to_write) {
+            next_block = next_block_or_allocate(fs, file_index, current_block, current_index + 1, last_block_index - current_index);
+            if (next_block != current_block + 1) {
+                break;
+            }
+            current_block = next_block;
+            current_index++;
+            next_block = -1;
+            run_length++;
+            run_bytes += fs->block_size;
+        }
+        if (run_bytes > bytes_to_write) {
+            run_bytes = bytes_to_write;
+        }
+
+        size_t run_offset = (size_t)run_start_index * fs->block_size; // File offset of run_start
+        size_t live_bytes = file_size > run_offset ? file_size - run_offset : 0;
+        io_run run = {run_start, run_length, run_start_index, block_offset, (char *)buf + buffer_offset, run_bytes, live_bytes};
+        if (visit(fs, &run, ctx) == -1) {
+            return -1;
+        }
+        set_cursor(fs, fildes, current_index, current_block);
+
+        buffer_offset += run_bytes;
+        bytes_to_write -= run_bytes;
+        bytes_written += run_bytes;
+        file_offset += run_bytes;
+        block_offset = 0; // Reset block offset for subsequent blocks
+
+        // Move to next block (already fetched or allocated above)
+        if (bytes_to_write > 0) {
+            if (next_block == -1) {
+                fprintf(stderr, "Warning: Disk is full. Could not allocate new data block.\n");
+                break; // No more space to write
+            }
+            current_block = next_block;
+            current_index++;
+        }
+    }
+
+    // Update file descriptor's offset
+    fs->file_descriptors[fildes].offset = file_offset;
+
+    // Update file size if necessary
+    if (file_offset > fs->rootDir[file_index].sizeInBytes) {
+        fs->rootDir[file_index].sizeInBytes = file_offset;
+        dir_changed(fs, file_index);
+    }
+
+    // Return the number of bytes actually written
+    return bytes_written;
+}
+
+static int write_locked(fs_t *fs, int fildes, void *buf, size_t nbyte) {
+    if (check_writable(fs) == -1) {
+        return -1;
+    }
+    int file_index = fs->file_descriptors[fildes].file_index;
+    aio_wait_file(fs, file_index);
+    if (fs->rootDir[file_index].compressed) {
+        return compressed_write(fs, fildes, buf, nbyte);
+    }
+    if (fs->rootDir[file_index].deduplicated) {
+        return dedup_write(fs, fildes, buf, nbyte);
+    }
+    return walk_write(fs, fildes, buf, nbyte, buffered_write_run, &file_index);
+}
+
+static int get_filesize_locked(fs_t *fs, int fildes) {
+    int file_index = fs->file_descriptors[fildes].file_index;
+    size_t file_size = fs->rootDir[file_index].sizeInBytes;
+
+    return (int)file_size;
+}
+
+static int lseek_locked(fs_t *fs, int fildes, off_t offset) {
+    if (offset < 0) {
+        fprintf(stderr, "Error: Offset cannot be negative.\n");
+        return -1;
+    }
+
+    int file_index = fs->file_descriptors[fildes].file_index;
+    size_t file_size = fs->rootDir[file_index].sizeInBytes;
+
+    if ((size_t)offset > file_size) {
+        fprintf(stderr, "Error: Offset is beyond the end of the file.\n");
+        return -1;
+    }
+
+    fs->file_descriptors[fildes].offset = (size_t)offset;
+
+    return 0;
+}
+
+static int truncate_locked(fs_t *fs, int fildes, off_t length) {
+    if (check_writable(fs) == -1) {
+        return -1;
+    }
+    if (length < 0) {
+        fprintf(stderr, "Error: Length cannot be negative.\n");
+        return -1;
+    }
+
+    int file_index = fs->file_descriptors[fildes].file_index;
+    size_t file_size = fs->rootDir[file_index].sizeInBytes;
+
+    if ((size_t)length > file_size) {
+        fprintf(stderr, "Error: Cannot extend file using fs_truncate.\n");
+        return -1;
+    }
+
+    // If length is equal to current size, nothing to do
+    if ((size_t)length == file_size) {
+        return 0;
+    }
+
+    aio_wait_file(fs, file_index);
+    if (fs->rootDir[file_index].compressed) {
+        if (compressed_truncate(fs, file_index, length) == -1) {
+            return -1;
+        }
+    } else if (fs->rootDir[file_index].deduplicated) {
+        if (dedup_truncate(fs, file_index, length) == -1) {
+            return -1;
+        }
+    } else {
+        // Calculate how many blocks we need to keep
+        int blocks_to_keep = (length + fs->block_size - 1) / fs->block_size; // Ceiling division
+
+        // Free the blocks beyond the new length. That fails, changing nothing,
+        // only if the new last block is shared and cannot be copied.
+        if (free_chain_after(fs, file_index, blocks_to_keep) == -1) {
+            return -1;
+        }
+        if (fs->write_buffers[file_index].index >= blocks_to_keep) {
+            write_buffer_drop(fs, file_index);
+        }
+        invalidate_cursors(fs, file_index, blocks_to_keep);
+    }
+
+    // If the file pointer is larger than the new length, set it to length
+    if (fs->file_descriptors[fildes].offset > (size_t)length) {
+        fs->file_descriptors[fildes].offset = (size_t)length;
+    }
+
+    // Update the file size
+    fs->rootDir[file_index].sizeInBytes = (size_t)length;
+    dir_changed(fs, file_index);
+
+    return 0;
+}
+
+// Add a piece for run to an asynchronous request, with bounce blocks for a
+// partial head/tail. Returns NULL if memory runs out.
+static aio_piece *aio_add_piece(aio_op *op, const io_run *run) {
+    if (op->num_pieces == op->capacity) {
+        int capacity = op->capacity ? op->capacity * 2 : 8;
+        aio_piece *pieces = realloc(op->pieces, capacity * sizeof(aio_piece));
+        if (pieces == NULL) {
+            fprintf(stderr, "Error: Out of memory for asynchronous request.\n");
+            return NULL;
+        }
+        op->pieces = pieces;
+        op->capacity = capacity;
+    }
+
+    aio_piece *piece = &op->pieces[op->num_pieces];
+    memset(piece, 0, sizeof(*piece));
+    piece->run = *run;
+    run_layout(op->fs, run, NULL, NULL, piece->iov, &piece->has_head, &piece->has_tail);
+    if (piece->has_head || piece->has_tail) {
+        piece->head = malloc(2 * op->fs->block_size);
+        if (piece->head == NULL) {
+            fprintf(stderr, "Error: Out of memory for asynchronous request.\n");
+            return NULL;
+        }
+        piece->tail = piece->head + op->fs->block_size;
+    }
+    piece->req.iovcnt = run_layout(op->fs, run, piece->head, piece->tail, piece->iov, &piece->has_head, &piece->has_tail);
+    op->num_pieces++;
+    return piece;
+}
+
+// run_visitors of the asynchronous walks. A mapped image has nothing to wait
+// for, so its runs are copied on the spot.
+static int queue_read_run(fs_t *fs, const io_run *run, void *ctx) {
+    if (block_ptr_ex(fs->disk, fs->bs.dataOffset + run->first_block) != NULL) {
+        return read_run(fs, run, NULL);
+    }
+    return aio_add_piece(ctx, run) != NULL ? 0 : -1;
+}
+
+static int queue_write_run(fs_t *fs, const io_run *run, void *ctx) {
+    if (block_ptr_ex(fs->disk, fs->bs.dataOffset + run->first_block) != NULL) {
+        return write_run(fs, run, NULL);
+    }
+    aio_piece *piece = aio_add_piece(ctx, run);
+    if (piece == NULL) {
+        return -1;
+    }
+    return run_fill_write(fs, run, piece->head, piece->tail, piece->has_head, piece->has_tail);
+}
+
+static void aio_free_pieces(aio_op *op) {
+    for (int i = 0; i < op->num_pieces; i++) {
+        free(op->pieces[i].head);
+    }
+    free(op->pieces);
+    op->pieces = NULL;
+    op->num_pieces = 0;
+}
+
+// Retire a request whose pieces have all completed: take it off the in-flight
+// list, then run its callback or queue it for fs_aio_reap
+static void aio_finish(aio_op *op) {
+    fs_t *fs = op->fs;
+    aio_free_pieces(op);
+
+    pthread_mutex_lock(&fs->aio_lock);
+    aio_op **link = &fs->aio_ops;
+    while (*link != op) {
+        link = &(*link)->next;
+    }
+    *link = op->next;
+    op->next = NULL;
+
+    if (op->callback == NULL) {
+        if (fs->aio_done_tail != NULL) {
+            fs->aio_done_tail->next = op;
+        } else {
+            fs->aio_done = op;
+        }
+        fs->aio_done_tail = op;
+        fs->aio_done_count++;
+        fs->aio_running--;
+        pthread_cond_broadcast(&fs->aio_cond);
+        pthread_mutex_unlock(&fs->aio_lock);
+        return;
+    }
+    pthread_cond_broadcast(&fs->aio_cond);
+    pthread_mutex_unlock(&fs->aio_lock);
+
+    op->callback(op->arg, op->result);
+
+    pthread_mutex_lock(&fs->aio_lock);
+    fs->aio_running--;
+    pthread_cond_broadcast(&fs->aio_cond);
+    pthread_mutex_unlock(&fs->aio_lock);
+    free(op);
+}
+
+// disk_aio completion of one piece, on an engine thread
+static void aio_piece_done(struct disk_aio *req, int result) {
+    aio_piece *piece = req->arg;
+    aio_op *op = piece->op;
+
+    if (result == -1) {
+        __atomic_store_n(&op->result, -1, __ATOMIC_RELAXED);
+    } else if (!op->is_write) {
+        run_finish_read(op->fs, &piece->run, piece->head, piece->tail, piece->has_head, piece->has_tail);
+    }
+    if (__atomic_sub_fetch(&op->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        aio_finish(op);
+    }
+}
+
+// Public entry points: take the locks described at the top of the file and
+// run the matching *_locked body. The *_ex functions act on the given
+// instance; the historical API is a thin shim over default_fs.
+
+// Validate fildes and lock the file it refers to. On success the directory is
+// read-locked, the file's mutex is held and its rootDir index is returned;
+// release with unlock_descriptor. Returns -1 with nothing held on error.
+static int lock_descriptor(fs_t *fs, int fildes) {
+    if (fs == NULL) {
+        fprintf(stderr, "Error: File system is not mounted.\n");
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&fs->dir_lock);
+    if (!fs->mounted) {
+        pthread_rwlock_unlock(&fs->dir_lock);
+        fprintf(stderr, "Error: File system is not mounted.\n");
+        return -1;
+    }
+
+    int file_index = -1;
+    if (fildes >= 0 && fildes < MAX_FILE_DESCRIPTORS) {
+        pthread_mutex_lock(&fs->fd_lock);
+        if (fs->file_descriptors[fildes].is_open) {
+            file_index = fs->file_descriptors[fildes].file_index;
+        }
+        pthread_mutex_unlock(&fs->fd_lock);
+    }
+
+    if (file_index != -1) {
+        pthread_mutex_lock(&fs->file_locks[file_index]);
+        pthread_mutex_lock(&fs->fd_lock);
+        int still_valid = fs->file_descriptors[fildes].is_open && fs->file_descriptors[fildes].file_index == file_index;
+        pthread_mutex_unlock(&fs->fd_lock);
+        if (still_valid) {
+            return file_index;
+        }
+        pthread_mutex_unlock(&fs->file_locks[file_index]);
+    }
+
+    pthread_rwlock_unlock(&fs->dir_lock);
+    fprintf(stderr, "Error: Invalid or closed file descriptor.\n");
+    return -1;
+}
+
+static void unlock_descriptor(fs_t *fs, int file_index) {
+    pthread_mutex_unlock(&fs->file_locks[file_index]);
+    pthread_rwlock_unlock(&fs->dir_lock);
+}
+
+// Read the root directory of a lazy mount in and index it. Caller holds the
+// directory exclusively.
+static int load_directory(fs_t *fs) {
+    if (block_read_range_ex(fs->disk, fs->bs.root_location, fs->bs.sizeOfRoot, (char *)fs->rootDir) == -1) {
+        fprintf(stderr, "Error: Failed to read root directory.\n");
+        return -1;
+    }
+    journal_dir_loaded(&fs->journal, fs->rootDir);
+    if (dir_index_build(&fs->dir_index, fs->rootDir, fs->dir_slots) == -1) {
+        return -1;
+    }
+    __atomic_store_n(&fs->dir_loaded, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Lock the directory of a mounted instance, for reading or for writing.
+// Returns -1 with nothing held if fs is not mounted.
+static int lock_directory(fs_t *fs, int exclusive) {
+    if (fs == NULL) {
         fprintf(stderr, "Error: File system is not mounted.\n");
         return -1;
     }
+    // The first use after a lazy mount reads the directory in
+    if (!__atomic_load_n(&fs->dir_loaded, __ATOMIC_ACQUIRE)) {
+        pthread_rwlock_wrlock(&fs->dir_lock);
+        int result = fs->mounted && !fs->dir_loaded ? load_directory(fs) : 0;
+        pthread_rwlock_unlock(&fs->dir_lock);
+        if (result == -1) {
+            return -1;
+        }
+    }
+    if (exclusive) {
+        pthread_rwlock_wrlock(&fs->dir_lock);
+    } else {
+        pthread_rwlock_rdlock(&fs->dir_lock);
+    }
+    return 0;
+}
 
-    // Validate the file descriptor
-    if (fildes < 0 || fildes >= MAX_FILE_DESCRIPTORS || !file_descriptors[fildes].is_open) {
-        fprintf(stderr, "Error: Invalid or closed file descriptor.\n");
+// Plan an asynchronous read or write on fildes and queue it. Returns 0 once
+// the request is accepted (its outcome is reported on completion) or -1 if it
+// could not be started.
+static int start_async(fs_t *fs, int is_write, int fildes, void *buf, size_t nbyte, fs_aio_callback callback, void *arg) {
+    int file_index = lock_descriptor(fs, fildes);
+    if (file_index == -1) {
+        return -1;
+    }
+    if (is_write && check_writable(fs) == -1) {
+        unlock_descriptor(fs, file_index);
+        return -1;
+    }
+
+    aio_op *op = calloc(1, sizeof(aio_op));
+    if (op == NULL) {
+        unlock_descriptor(fs, file_index);
+        fprintf(stderr, "Error: Out of memory for asynchronous request.\n");
         return -1;
     }
+    size_t offset = fs->file_descriptors[fildes].offset;
+    op->fs = fs;
+    op->file_index = file_index;
+    op->first_index = offset / fs->block_size;
+    op->last_index = nbyte > 0 ? (int)((offset + nbyte - 1) / fs->block_size) : op->first_index;
+    op->is_write = is_write;
+    op->callback = callback;
+    op->arg = arg;
 
-    int file_index = file_descriptors[fildes].file_index;
-    size_t file_offset = file_descriptors[fildes].offset;
-    //size_t file_size = rootDir[file_index].sizeInBytes;
+    // Reads only have to follow earlier writes; writes follow everything
+    aio_wait_range(fs, file_index, op->first_index, op->last_index, !is_write);
 
-    // Check for maximum file size
-    if (file_offset + nbyte > MAX_FILE_SIZE) {
-        nbyte = MAX_FILE_SIZE - file_offset;
-        if (nbyte == 0) {
-            fprintf(stderr, "Error: Maximum file size reached.\n");
-            return 0;
+    // A compressed file goes through its extent cache, and a deduplicated
+    // one through its block table, so the request is done at once and
+    // completes without pieces
+    int bytes;
+    if (fs->rootDir[file_index].compressed) {
+        bytes = is_write ? compressed_write(fs, fildes, buf, nbyte) : compressed_read(fs, fildes, buf, nbyte);
+    } else if (fs->rootDir[file_index].deduplicated) {
+        bytes = is_write ? dedup_write(fs, fildes, buf, nbyte) : dedup_read(fs, fildes, buf, nbyte);
+    } else {
+        // The engine works on the disk: buffered data goes there first, and a
+        // buffered block an asynchronous write may replace is dropped
+        if (write_buffer_flush(fs, file_index) == -1) {
+            unlock_descriptor(fs, file_index);
+            free(op);
+            return -1;
         }
+        if (is_write) {
+            write_buffer_drop(fs, file_index);
+        }
+
+        bytes = is_write ? walk_write(fs, fildes, buf, nbyte, queue_write_run, op)
+                         : walk_read(fs, fildes, buf, nbyte, queue_read_run, op);
     }
+    if (bytes == -1) {
+        unlock_descriptor(fs, file_index);
+        aio_free_pieces(op);
+        free(op);
+        return -1;
+    }
+    op->result = bytes;
+    op->pending = op->num_pieces;
 
-    size_t bytes_to_write = nbyte;
-    size_t bytes_written = 0;
-    size_t buffer_offset = 0; // Offset into buf
-    size_t block_offset = file_offset % BLOCK_SIZE;
-    int block_index_within_file = file_offset / BLOCK_SIZE;
+    pthread_mutex_lock(&fs->aio_lock);
+    op->next = fs->aio_ops;
+    fs->aio_ops = op;
+    fs->aio_running++;
+    pthread_mutex_unlock(&fs->aio_lock);
+    unlock_descriptor(fs, file_index);
 
-    // Get the starting data block
-    int current_block = rootDir[file_index].firstDataBlock;
+    int num_pieces = op->num_pieces;
+    if (num_pieces == 0) {
+        aio_finish(op); // Nothing to wait for: EOF, an empty write, a mapped image or a compressed or deduplicated file
+        return 0;
+    }
 
-    // If the file has no data blocks yet, allocate one
-    if (current_block == -1) {
-        // Find a free block
-        for (int i = 0; i < 4096; i++) {
-            if (FAT1[i] == -2) { // -2 indicates a free block
-                current_block = i;
-                rootDir[file_index].firstDataBlock = current_block;
-                FAT1[current_block] = -1; // End of file
-                FAT2[current_block] = -1;
-                break;
-            }
-        }
-        if (current_block == -1) {
-            fprintf(stderr, "Error: No free data blocks available.\n");
-            return 0; // Disk is full
+    // Queue every run, up to DISK_IOV_MAX per submission. op stays alive until
+    // the last piece is queued because that piece is still pending.
+    int data_offset = fs->bs.dataOffset;
+    for (int i = 0; i < num_pieces; i += DISK_IOV_MAX) {
+        struct disk_aio *reqs[DISK_IOV_MAX];
+        int n = num_pieces - i < DISK_IOV_MAX ? num_pieces - i : DISK_IOV_MAX;
+        for (int j = 0; j < n; j++) {
+            aio_piece *piece = &op->pieces[i + j];
+            piece->op = op;
+            piece->req.is_write = is_write;
+            piece->req.start = data_offset + piece->run.first_block;
+            piece->req.iov = piece->iov;
+            piece->req.done = aio_piece_done;
+            piece->req.arg = piece;
+            reqs[j] = &piece->req;
         }
-    } else {
-        // Traverse to the correct block
-        for (int i = 0; i < block_index_within_file; i++) {
-            current_block = FAT1[current_block];
-            if (current_block == -1) {
-                // Need to allocate a new block
-                break;
+        if (disk_aio_submit_ex(fs->disk, reqs, n) == -1) {
+            for (int j = 0; j < n; j++) {
+                aio_piece_done(reqs[j], -1);
             }
         }
     }
+    return 0;
+}
 
-    while (bytes_to_write > 0) {
-        if (current_block == -1) {
-            // Need to allocate a new block
-            // Find a free block
-            int new_block = -1;
-            for (int i = 0; i < 4096; i++) {
-                if (FAT1[i] == -2) { // -2 indicates a free block
-                    new_block = i;
-                    FAT1[current_block] = new_block;
-                    FAT1[new_block] = -1; // New end of file
-                    FAT2[new_block] = -1;
-                    break;
-                }
-            }
-            if (new_block == -1) {
-                fprintf(stderr, "Warning: Disk is full. Could not allocate new data block.\n");
-                break; // No more space to write
-            }
-            current_block = new_block;
-        }
+// A new, unmounted instance with its locks set up
+static fs_t *new_instance(void) {
+    fs_t *fs = calloc(1, sizeof(fs_t));
+    if (fs == NULL) {
+        fprintf(stderr, "Error: Out of memory for file system.\n");
+        return NULL;
+    }
 
-        // Read the existing data block (if any)
-        char block_data[BLOCK_SIZE];
-        if (block_read(DATA_BLOCKS_START + current_block, block_data) == -1) {
-            fprintf(stderr, "Error: Failed to read data block %d.\n", current_block);
-            return -1;
-        }
+    pthread_rwlock_init(&fs->dir_lock, NULL);
+    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
+        pthread_mutex_init(&fs->file_locks[i], NULL);
+    }
+    pthread_mutex_init(&fs->fd_lock, NULL);
+    pthread_mutex_init(&fs->alloc_lock, NULL);
+    pthread_mutex_init(&fs->aio_lock, NULL);
+    pthread_cond_init(&fs->aio_cond, NULL);
+    return fs;
+}
 
-        size_t bytes_in_block = BLOCK_SIZE - block_offset;
-        size_t bytes_to_copy = bytes_to_write < bytes_in_block ? bytes_to_write : bytes_in_block;
+fs_t *fs_mount_ex(char *disk_name) {
+    fs_t *fs = new_instance();
+    if (fs != NULL && mount_locked(fs, disk_name) == -1) {
+        fs_unmount_ex(fs);
+        return NULL;
+    }
+    return fs;
+}
 
-        // Copy data from buf to block_data
-        memcpy(block_data + block_offset, (char *)buf + buffer_offset, bytes_to_copy);
+fs_t *fs_snapshot_mount_readonly(char *disk_name, char *name) {
+    fs_t *fs = new_instance();
+    if (fs != NULL && mount_snapshot_locked(fs, disk_name, name) == -1) {
+        fs_unmount_ex(fs);
+        return NULL;
+    }
+    return fs;
+}
 
-        // Write the updated block back to disk
-        if (block_write(DATA_BLOCKS_START + current_block, block_data) == -1) {
-            fprintf(stderr, "Error: Failed to write data block %d.\n", current_block);
-            return -1;
-        }
+int fs_unmount_ex(fs_t *fs) {
+    if (fs == NULL || fs == &default_fs) {
+        fprintf(stderr, "Error: File system was not mounted with fs_mount_ex.\n");
+        return -1;
+    }
 
-        buffer_offset += bytes_to_copy;
-        bytes_to_write -= bytes_to_copy;
-        bytes_written += bytes_to_copy;
-        file_offset += bytes_to_copy;
-        block_offset = 0; // Reset block offset for subsequent blocks
+    int result = 0;
+    pthread_rwlock_wrlock(&fs->dir_lock);
+    if (fs->mounted) {
+        result = unmount_locked(fs, fs->disk_name);
+    }
+    pthread_rwlock_unlock(&fs->dir_lock);
 
-        // Move to next block
-        if (bytes_to_write > 0) {
-            int next_block = FAT1[current_block];
-            if (next_block == -1) {
-                // Need to allocate a new block
-                int new_block = -1;
-                for (int i = 0; i < 4096; i++) {
-                    if (FAT1[i] == -2) {
-                        new_block = i;
-                        FAT1[current_block] = new_block;
-                        FAT1[new_block] = -1; // New end of file
-                        FAT2[new_block] = -1;
-                        break;
-                    }
-                }
-                if (new_block == -1) {
-                    fprintf(stderr, "Warning: Disk is full. Could not allocate new data block.\n");
-                    break; // No more space to write
-                }
-                current_block = new_block;
-            } else {
-                current_block = next_block;
-            }
-        }
+    pthread_rwlock_destroy(&fs->dir_lock);
+    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
+        pthread_mutex_destroy(&fs->file_locks[i]);
     }
+    pthread_mutex_destroy(&fs->fd_lock);
+    pthread_mutex_destroy(&fs->alloc_lock);
+    pthread_mutex_destroy(&fs->aio_lock);
+    pthread_cond_destroy(&fs->aio_cond);
+    free(fs);
+    return result;
+}
 
-    // Update file descriptor's offset
-    file_descriptors[fildes].offset = file_offset;
+int fs_open_ex(fs_t *fs, char *fname) {
+    if (lock_directory(fs, 0) == -1) {
+        return -1;
+    }
+    int result = open_locked(fs, fname);
+    pthread_rwlock_unlock(&fs->dir_lock);
+    return result;
+}
 
-    // Update file size if necessary
-    if (file_offset > rootDir[file_index].sizeInBytes) {
-        rootDir[file_index].sizeInBytes = file_offset;
+int fs_close_ex(fs_t *fs, int fildes) {
+    if (lock_directory(fs, 0) == -1) {
+        return -1;
     }
+    int result = close_locked(fs, fildes);
+    pthread_rwlock_unlock(&fs->dir_lock);
+    return result;
+}
 
-    // Return the number of bytes actually written
-    return bytes_written;
+int fs_create_ex(fs_t *fs, char *fname) {
+    if (lock_directory(fs, 1) == -1) {
+        return -1;
+    }
+    int result = create_locked(fs, fname);
+    pthread_rwlock_unlock(&fs->dir_lock);
+    return result;
 }
 
-int fs_get_filesize(int fildes) {
-    if (!is_mounted) {
-        fprintf(stderr, "Error: File system is not mounted.\n");
+int fs_copy_ex(fs_t *fs, char *src, char *dst, int flags) {
+    if (lock_directory(fs, 1) == -1) {
         return -1;
     }
+    int result = copy_locked(fs, src, dst, flags);
+    pthread_rwlock_unlock(&fs->dir_lock);
+    return result;
+}
 
-    // Validate the file descriptor
-    if (fildes < 0 || fildes >= MAX_FILE_DESCRIPTORS || !file_descriptors[fildes].is_open) {
-        fprintf(stderr, "Error: Invalid or closed file descriptor.\n");
+int fs_set_compression_ex(fs_t *fs, char *fname, int on) {
+    if (lock_directory(fs, 1) == -1) {
         return -1;
     }
+    int result = set_compression_locked(fs, fname, on);
+    pthread_rwlock_unlock(&fs->dir_lock);
+    return result;
+}
 
-    int file_index = file_descriptors[fildes].file_index;
-    size_t file_size = rootDir[file_index].sizeInBytes;
+int fs_set_deduplication_ex(fs_t *fs, char *fname, int on) {
+    if (lock_directory(fs, 1) == -1) {
+        return -1;
+    }
+    int result = set_deduplication_locked(fs, fname, on);
+    pthread_rwlock_unlock(&fs->dir_lock);
+    return result;
+}
 
-    return (int)file_size;
+int fs_snapshot_create_ex(fs_t *fs, char *name) {
+    if (lock_directory(fs, 1) == -1) {
+        return -1;
+    }
+    int result = snapshot_create_locked(fs, name);
+    pthread_rwlock_unlock(&fs->dir_lock);
+    return result;
 }
 
-int fs_lseek(int fildes, off_t offset) {
-    if (!is_mounted) {
-        fprintf(stderr, "Error: File system is not mounted.\n");
+int fs_snapshot_delete_ex(fs_t *fs, char *name) {
+    if (lock_directory(fs, 1) == -1) {
         return -1;
     }
+    int result = snapshot_delete_locked(fs, name);
+    pthread_rwlock_unlock(&fs->dir_lock);
+    return result;
+}
 
-    // Validate the file descriptor
-    if (fildes < 0 || fildes >= MAX_FILE_DESCRIPTORS || !file_descriptors[fildes].is_open) {
-        fprintf(stderr, "Error: Invalid or closed file descriptor.\n");
+int fs_delete_ex(fs_t *fs, char *fname) {
+    if (lock_directory(fs, 1) == -1) {
         return -1;
     }
+    int result = delete_locked(fs, fname);
+    pthread_rwlock_unlock(&fs->dir_lock);
+    return result;
+}
 
-    if (offset < 0) {
-        fprintf(stderr, "Error: Offset cannot be negative.\n");
+int fs_mkdir_ex(fs_t *fs, char *path) {
+    if (lock_directory(fs, 1) == -1) {
         return -1;
     }
+    int result = mkdir_locked(fs, path);
+    pthread_rwlock_unlock(&fs->dir_lock);
+    return result;
+}
 
-    int file_index = file_descriptors[fildes].file_index;
-    size_t file_size = rootDir[file_index].sizeInBytes;
+int fs_rmdir_ex(fs_t *fs, char *path) {
+    if (lock_directory(fs, 1) == -1) {
+        return -1;
+    }
+    int result = rmdir_locked(fs, path);
+    pthread_rwlock_unlock(&fs->dir_lock);
+    return result;
+}
 
-    if ((size_t)offset > file_size) {
-        fprintf(stderr, "Error: Offset is beyond the end of the file.\n");
+int fs_readdir_ex(fs_t *fs, char *path, struct fs_dirent *out, int max) {
+    if (lock_directory(fs, 0) == -1) {
+        return -1;
+    }
+    int result = readdir_locked(fs, path, out, max);
+    pthread_rwlock_unlock(&fs->dir_lock);
+    return result;
+}
+
+int fs_read_ex(fs_t *fs, int fildes, void *buf, size_t nbyte) {
+    int file_index = lock_descriptor(fs, fildes);
+    if (file_index == -1) {
+        return -1;
+    }
+    int result = read_locked(fs, fildes, buf, nbyte);
+    unlock_descriptor(fs, file_index);
+    return result;
+}
+
+int fs_read_view_ex(fs_t *fs, int fildes, size_t nbyte, struct fs_iovec *out, int *cnt) {
+    int file_index = lock_descriptor(fs, fildes);
+    if (file_index == -1) {
+        return -1;
+    }
+    int result = read_view_locked(fs, fildes, nbyte, out, cnt);
+    unlock_descriptor(fs, file_index);
+    return result;
+}
+
+int fs_write_ex(fs_t *fs, int fildes, void *buf, size_t nbyte) {
+    int file_index = lock_descriptor(fs, fildes);
+    if (file_index == -1) {
         return -1;
     }
+    int result = write_locked(fs, fildes, buf, nbyte);
+    unlock_descriptor(fs, file_index);
+
+    // Out of space while blocks freed since the last commit wait for it:
+    // commit, and write the rest into them
+    if (result >= 0 && (size_t)result < nbyte && pending_blocks(fs) > 0) {
+        if (lock_directory(fs, 1) == -1) {
+            return result;
+        }
+        int wanted = (int)((nbyte - result) / fs->block_size) + 2; // The rest may straddle a block more
+        int committed = fs->mounted ? reclaim_pending_locked(fs, wanted) : -1;
+        pthread_rwlock_unlock(&fs->dir_lock);
+        if (committed == 0 && (file_index = lock_descriptor(fs, fildes)) != -1) {
+            int more = write_locked(fs, fildes, (char *)buf + result, nbyte - result);
+            unlock_descriptor(fs, file_index);
+            if (more > 0) {
+                result += more;
+            }
+        }
+    }
+    return result;
+}
 
-    file_descriptors[fildes].offset = (size_t)offset;
+int fs_get_filesize_ex(fs_t *fs, int fildes) {
+    int file_index = lock_descriptor(fs, fildes);
+    if (file_index == -1) {
+        return -1;
+    }
+    int result = get_filesize_locked(fs, fildes);
+    unlock_descriptor(fs, file_index);
+    return result;
+}
 
+int fs_set_mount_mode(int mode) {
+    if (mode != FS_MOUNT_EAGER && mode != FS_MOUNT_LAZY) {
+        fprintf(stderr, "Error: Unknown mount mode %d.\n", mode);
+        return -1;
+    }
+    mount_mode = mode;
     return 0;
 }
 
-int fs_truncate(int fildes, off_t length) {
-    if (!is_mounted) {
+int fs_get_free_blocks_ex(fs_t *fs) {
+    if (lock_directory(fs, 0) == -1) {
+        return -1;
+    }
+    if (!fs->mounted) {
+        pthread_rwlock_unlock(&fs->dir_lock);
         fprintf(stderr, "Error: File system is not mounted.\n");
         return -1;
     }
 
-    // Validate the file descriptor
-    if (fildes < 0 || fildes >= MAX_FILE_DESCRIPTORS || !file_descriptors[fildes].is_open) {
-        fprintf(stderr, "Error: Invalid or closed file descriptor.\n");
+    // Every block of FAT1 is needed for the count
+    pthread_mutex_lock(&fs->alloc_lock);
+    while (fault_next_fat_block_locked(fs) == 1) {
+    }
+    int result = free_space_count(&fs->space) + fs->pending_count;
+    pthread_mutex_unlock(&fs->alloc_lock);
+    pthread_rwlock_unlock(&fs->dir_lock);
+    return result;
+}
+
+int fs_lseek_ex(fs_t *fs, int fildes, off_t offset) {
+    int file_index = lock_descriptor(fs, fildes);
+    if (file_index == -1) {
         return -1;
     }
+    int result = lseek_locked(fs, fildes, offset);
+    unlock_descriptor(fs, file_index);
+    return result;
+}
 
-    if (length < 0) {
-        fprintf(stderr, "Error: Length cannot be negative.\n");
+int fs_truncate_ex(fs_t *fs, int fildes, off_t length) {
+    int file_index = lock_descriptor(fs, fildes);
+    if (file_index == -1) {
         return -1;
     }
+    int result = truncate_locked(fs, fildes, length);
+    unlock_descriptor(fs, file_index);
+    return result;
+}
 
-    int file_index = file_descriptors[fildes].file_index;
-    size_t file_size = rootDir[file_index].sizeInBytes;
+int fs_read_async_ex(fs_t *fs, int fildes, void *buf, size_t nbyte, fs_aio_callback callback, void *arg) {
+    return start_async(fs, 0, fildes, buf, nbyte, callback, arg);
+}
 
-    if ((size_t)length > file_size) {
-        fprintf(stderr, "Error: Cannot extend file using fs_truncate.\n");
+int fs_write_async_ex(fs_t *fs, int fildes, void *buf, size_t nbyte, fs_aio_callback callback, void *arg) {
+    return start_async(fs, 1, fildes, buf, nbyte, callback, arg);
+}
+
+int fs_aio_reap_ex(fs_t *fs, struct fs_aio_completion *out, int max, int min) {
+    if (fs == NULL || out == NULL || max <= 0) {
+        fprintf(stderr, "Error: Invalid completion array.\n");
         return -1;
     }
+    if (min > max) {
+        min = max;
+    }
 
-    // If length is equal to current size, nothing to do
-    if ((size_t)length == file_size) {
-        return 0;
+    pthread_mutex_lock(&fs->aio_lock);
+    // Stop waiting once nothing else can complete
+    while (fs->aio_done_count < min && fs->aio_running > 0) {
+        pthread_cond_wait(&fs->aio_cond, &fs->aio_lock);
+    }
+    int count = 0;
+    while (count < max && fs->aio_done != NULL) {
+        aio_op *op = fs->aio_done;
+        fs->aio_done = op->next;
+        out[count].arg = op->arg;
+        out[count].result = op->result;
+        count++;
+        free(op);
+    }
+    if (fs->aio_done == NULL) {
+        fs->aio_done_tail = NULL;
     }
+    fs->aio_done_count -= count;
+    pthread_mutex_unlock(&fs->aio_lock);
+    return count;
+}
 
-    // If the file pointer is larger than the new length, set it to length
-    if (file_descriptors[fildes].offset > (size_t)length) {
-        file_descriptors[fildes].offset = (size_t)length;
+void fs_aio_drain_ex(fs_t *fs) {
+    if (fs != NULL) {
+        aio_wait_idle(fs, 0);
     }
+}
 
-    // Calculate how many blocks we need to keep
-    int blocks_to_keep = (length + BLOCK_SIZE - 1) / BLOCK_SIZE; // Ceiling division
 
-    // Traverse the FAT chain and free blocks beyond the new length
-    int current_block = rootDir[file_index].firstDataBlock;
-    int prev_block = -1;
-    int block_count = 0;
+int fs_fsync_ex(fs_t *fs, int fildes) {
+    if (lock_directory(fs, 1) == -1) {
+        return -1;
+    }
+    if (!fs->mounted) {
+        pthread_rwlock_unlock(&fs->dir_lock);
+        fprintf(stderr, "Error: File system is not mounted.\n");
+        return -1;
+    }
+    if (fildes < 0 || fildes >= MAX_FILE_DESCRIPTORS || !fs->file_descriptors[fildes].is_open) {
+        pthread_rwlock_unlock(&fs->dir_lock);
+        fprintf(stderr, "Error: Invalid or closed file descriptor.\n");
+        return -1;
+    }
 
-    while (current_block != -1 && block_count < blocks_to_keep) {
-        prev_block = current_block;
-        current_block = FAT1[current_block];
-        block_count++;
+    // The commit takes every file's size and chain along, so every file's
+    // buffered and in-flight data has to reach the disk first, not just this one's
+    aio_wait_idle(fs, 0);
+    int result = write_buffers_flush_all(fs);
+    if (result == 0) {
+        result = commit_metadata(fs);
     }
+    pthread_rwlock_unlock(&fs->dir_lock);
+    return result;
+}
 
-    // Now current_block is the block to free and onwards
-    while (current_block != -1) {
-        int next_block = FAT1[current_block];
-        FAT1[current_block] = -2; // Mark as free
-        FAT2[current_block] = -2;
-        current_block = next_block;
+int fs_sync_ex(fs_t *fs) {
+    if (lock_directory(fs, 1) == -1) {
+        return -1;
+    }
+    if (!fs->mounted) {
+        pthread_rwlock_unlock(&fs->dir_lock);
+        fprintf(stderr, "Error: File system is not mounted.\n");
+        return -1;
     }
 
-    // Update the FAT to indicate the new end of the file
-    if (prev_block != -1) {
-        FAT1[prev_block] = -1;
-        FAT2[prev_block] = -1;
-    } else {
-        // If prev_block is -1, that means the file is being truncated to zero length
-        rootDir[file_index].firstDataBlock = -1;
+    aio_wait_idle(fs, 0);
+    int result = write_buffers_flush_all(fs);
+    if (result == 0) {
+        result = commit_metadata(fs);
     }
+    pthread_rwlock_unlock(&fs->dir_lock);
+    return result;
+}
 
-    // Update the file size
-    rootDir[file_index].sizeInBytes = (size_t)length;
+// Default instance
 
-    return 0;
-}
\ No newline at end of file
+int mount_fs(char *disk_name) {
+    pthread_rwlock_wrlock(&default_fs.dir_lock);
+    int result = mount_locked(&default_fs, disk_name);
+    pthread_rwlock_unlock(&default_fs.dir_lock);
+    return result;
+}
+
+int unmount_fs(char *disk_name) {
+    pthread_rwlock_wrlock(&default_fs.dir_lock);
+    int result = unmount_locked(&default_fs, disk_name);
+    pthread_rwlock_unlock(&default_fs.dir_lock);
+    return result;
+}
+
+int fs_open(char *fname) {
+    return fs_open_ex(&default_fs, fname);
+}
+
+int fs_close(int fildes) {
+    return fs_close_ex(&default_fs, fildes);
+}
+
+int fs_create(char *fname) {
+    return fs_create_ex(&default_fs, fname);
+}
+
+int fs_copy(char *src, char *dst, int flags) {
+    return fs_copy_ex(&default_fs, src, dst, flags);
+}
+
+int fs_set_compression(char *fname, int on) {
+    return fs_set_compression_ex(&default_fs, fname, on);
+}
+
+int fs_set_deduplication(char *fname, int on) {
+    return fs_set_deduplication_ex(&default_fs, fname, on);
+}
+
+int fs_snapshot_create(char *name) {
+    return fs_snapshot_create_ex(&default_fs, name);
+}
+
+int fs_snapshot_delete(char *name) {
+    return fs_snapshot_delete_ex(&default_fs, name);
+}
+
+int fs_delete(char *fname) {
+    return fs_delete_ex(&default_fs, fname);
+}
+
+int fs_read(int fildes, void *buf, size_t nbyte) {
+    return fs_read_ex(&default_fs, fildes, buf, nbyte);
+}
+
+int fs_read_view(int fildes, size_t nbyte, struct fs_iovec *out, int *cnt) {
+    return fs_read_view_ex(&default_fs, fildes, nbyte, out, cnt);
+}
+
+void fs_release_view(struct fs_iovec *view, int cnt) {
+    fs_release_view_ex(&default_fs, view, cnt);
+}
+
+int fs_write(int fildes, void *buf, size_t nbyte) {
+    return fs_write_ex(&default_fs, fildes, buf, nbyte);
+}
+
+int fs_get_filesize(int fildes) {
+    return fs_get_filesize_ex(&default_fs, fildes);
+}
+
+int fs_get_free_blocks(void) {
+    return fs_get_free_blocks_ex(&default_fs);
+}
+
+int fs_lseek(int fildes, off_t offset) {
+    return fs_lseek_ex(&default_fs, fildes, offset);
+}
+
+int fs_truncate(int fildes, off_t length) {
+    return fs_truncate_ex(&default_fs, fildes, length);
+}
+
+int fs_mkdir(char *path) {
+    return fs_mkdir_ex(&default_fs, path);
+}
+
+int fs_rmdir(char *path) {
+    return fs_rmdir_ex(&default_fs, path);
+}
+
+int fs_readdir(char *path, struct fs_dirent *out, int max) {
+    return fs_readdir_ex(&default_fs, path, out, max);
+}
+
+int fs_read_async(int fildes, void *buf, size_t nbyte, fs_aio_callback callback, void *arg) {
+    return fs_read_async_ex(&default_fs, fildes, buf, nbyte, callback, arg);
+}
+
+int fs_write_async(int fildes, void *buf, size_t nbyte, fs_aio_callback callback, void *arg) {
+    return fs_write_async_ex(&default_fs, fildes, buf, nbyte, callback, arg);
+}
+
+int fs_aio_reap(struct fs_aio_completion *out, int max, int min) {
+    return fs_aio_reap_ex(&default_fs, out, max, min);
+}
+
+void fs_aio_drain(void) {
+    fs_aio_drain_ex(&default_fs);
+}
+
+int fs_fsync(int fildes) {
+    return fs_fsync_ex(&default_fs, fildes);
+}
+
+int fs_sync(void) {
+    return fs_sync_ex(&default_fs);
+}
@@ -0,0 +1,503 @@
+#include "journal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// First block of the region. Transactions follow it back to back, starting
+// with number sequence; the first block that does not hold the next valid
+// transaction ends the log.
+typedef struct {
+    unsigned int magic;
+    unsigned int sequence;    // Sequence number of the first transaction in the log
+} journal_header;
+
+// Start of a transaction, followed by fat_records fat_record and then
+// dir_records dir_record entries
+typedef struct {
+    unsigned int magic;
+    unsigned int sequence;
+    unsigned int checksum;    // Of the whole transaction, taken with this field zero
+    int num_blocks;           // Blocks the transaction takes up
+    int fat_records;
+    int dir_records;
+} txn_header;
+
+typedef struct {
+    int index;                // FAT entry, the same in FAT1 and FAT2
+    int value;
+} fat_record;
+
+typedef struct {
+    int slot;                 // Root directory slot
+    files entry;
+} dir_record;
+
+static int dirty_words(const meta_dirty *dirty) {
+    return (dirty->fat_blocks + dirty->dir_blocks + 63) / 64;
+}
+
+int meta_dirty_init(meta_dirty *dirty, const boot_sector *bs) {
+    dirty->fat_blocks = bs->sizeOfFat1;
+    dirty->dir_blocks = bs->sizeOfRoot;
+    dirty->fat_per_block = bs->blockSize / (int)sizeof(int);
+    dirty->dir_per_block = bs->blockSize / (int)sizeof(files);
+    dirty->bits = calloc(dirty_words(dirty), sizeof(uint64_t));
+    if (dirty->bits == NULL) {
+        fprintf(stderr, "Error: Out of memory for metadata tracking.\n");
+        return -1;
+    }
+    return 0;
+}
+
+void meta_dirty_free(meta_dirty *dirty) {
+    free(dirty->bits);
+    dirty->bits = NULL;
+}
+
+void meta_dirty_clear(meta_dirty *dirty) {
+    memset(dirty->bits, 0, dirty_words(dirty) * sizeof(uint64_t));
+}
+
+static void set_bit(meta_dirty *dirty, int bit) {
+    __atomic_fetch_or(&dirty->bits[bit / 64], (uint64_t)1 << (bit % 64), __ATOMIC_RELAXED);
+}
+
+static int test_bit(const meta_dirty *dirty, int bit) {
+    return (dirty->bits[bit / 64] >> (bit % 64)) & 1;
+}
+
+void meta_dirty_fat(meta_dirty *dirty, int entry) {
+    set_bit(dirty, entry / dirty->fat_per_block);
+}
+
+void meta_dirty_dir(meta_dirty *dirty, int slot) {
+    set_bit(dirty, dirty->fat_blocks + slot / dirty->dir_per_block);
+}
+
+static int fat_block_dirty(const meta_dirty *dirty, int block) {
+    return test_bit(dirty, block);
+}
+
+static int dir_block_dirty(const meta_dirty *dirty, int block) {
+    return test_bit(dirty, dirty->fat_blocks + block);
+}
+
+static int any_dirty(const meta_dirty *dirty) {
+    for (int i = 0; i < dirty_words(dirty); i++) {
+        if (dirty->bits[i] != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void merge_dirty(meta_dirty *into, const meta_dirty *from) {
+    for (int i = 0; i < dirty_words(into); i++) {
+        into->bits[i] |= from->bits[i];
+    }
+}
+
+// FNV-1a over len bytes
+static unsigned int checksum(const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static size_t txn_bytes(int fat_records, int dir_records) {
+    return sizeof(txn_header) + fat_records * sizeof(fat_record) + dir_records * sizeof(dir_record);
+}
+
+static int sync_disk(disk_t *disk) {
+    if (disk_sync_ex(disk) == -1) {
+        fprintf(stderr, "Error: Failed to sync the disk.\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Write the metadata blocks named in mask to their home locations: FAT blocks
+// from fat into both FAT1 and FAT2 and directory blocks from dir, one call per
+// run of consecutive blocks and copy
+static int write_home(disk_t *disk, const boot_sector *bs, const int *fat, const files *dir, const meta_dirty *mask) {
+    for (int first = 0; first < bs->sizeOfFat1; first++) {
+        if (!fat_block_dirty(mask, first)) {
+            continue;
+        }
+        int count = 1;
+        while (first + count < bs->sizeOfFat1 && fat_block_dirty(mask, first + count)) {
+            count++;
+        }
+
+        char *data = (char *)(fat + (size_t)first * mask->fat_per_block);
+        if (block_write_range_ex(disk, bs->fat1_location + first, count, data) == -1) {
+            fprintf(stderr, "Error: Failed to write FAT1 to disk.\n");
+            return -1;
+        }
+        int mirrored = first + count <= bs->sizeOfFat2 ? count : bs->sizeOfFat2 - first;
+        if (mirrored > 0 && block_write_range_ex(disk, bs->fat2_location + first, mirrored, data) == -1) {
+            fprintf(stderr, "Error: Failed to write FAT2 to disk.\n");
+            return -1;
+        }
+        first += count - 1;
+    }
+
+    for (int first = 0; first < bs->sizeOfRoot; first++) {
+        if (!dir_block_dirty(mask, first)) {
+            continue;
+        }
+        int count = 1;
+        while (first + count < bs->sizeOfRoot && dir_block_dirty(mask, first + count)) {
+            count++;
+        }
+        char *data = (char *)(dir + first * mask->dir_per_block);
+        if (block_write_range_ex(disk, bs->root_location + first, count, data) == -1) {
+            fprintf(stderr, "Error: Failed to write root directory to disk.\n");
+            return -1;
+        }
+        first += count - 1;
+    }
+    return 0;
+}
+
+static int write_header(disk_t *disk, int location, unsigned int sequence) {
+    char *block = calloc(1, disk_block_size_ex(disk));
+    if (block == NULL) {
+        fprintf(stderr, "Error: Out of memory for journal header.\n");
+        return -1;
+    }
+    journal_header *header = (journal_header *)block;
+    header->magic = JOURNAL_MAGIC;
+    header->sequence = sequence;
+    int result = block_write_ex(disk, location, block);
+    free(block);
+    if (result == -1) {
+        fprintf(stderr, "Error: Failed to write journal header.\n");
+        return -1;
+    }
+    return 0;
+}
+
+int journal_format(disk_t *disk, int location, int blocks) {
+    if (blocks < 2) {
+        fprintf(stderr, "Error: Journal region too small.\n");
+        return -1;
+    }
+    return write_header(disk, location, 1);
+}
+
+int journal_pending(disk_t *disk, int location) {
+    int block_size = disk_block_size_ex(disk);
+    char *blocks = malloc(2 * (size_t)block_size);
+    if (blocks == NULL) {
+        fprintf(stderr, "Error: Out of memory for journal.\n");
+        return -1;
+    }
+    if (block_read_range_ex(disk, location, 2, blocks) == -1) {
+        fprintf(stderr, "Error: Failed to read journal.\n");
+        free(blocks);
+        return -1;
+    }
+    const journal_header *header = (const journal_header *)blocks;
+    const txn_header *txn = (const txn_header *)(blocks + block_size);
+    int pending = header->magic == JOURNAL_MAGIC && txn->magic == JOURNAL_MAGIC && txn->sequence == header->sequence;
+    free(blocks);
+    return pending;
+}
+
+// Write the committed blocks home, then reset the log header
+static int checkpoint(journal *j, disk_t *disk, const boot_sector *bs) {
+    if (write_home(disk, bs, j->fat, j->dir, &j->home_dirty) == -1 || sync_disk(disk) == -1) {
+        return -1;
+    }
+    // Only now may the log be emptied: until the header is on disk, a crash
+    // replays the log over home copies that already match it
+    if (write_header(disk, j->location, j->sequence) == -1 || sync_disk(disk) == -1) {
+        return -1;
+    }
+    j->next = 1;
+    meta_dirty_clear(&j->home_dirty);
+    return 0;
+}
+
+void journal_fat_loaded(journal *j, const int *fat, int block) {
+    size_t first = (size_t)block * (j->block_size / sizeof(int));
+    memcpy(j->fat + first, fat + first, j->block_size);
+}
+
+void journal_dir_loaded(journal *j, const files *dir) {
+    memcpy(j->dir, dir, j->dir_slots * sizeof(files));
+}
+
+void journal_close(journal *j) {
+    free(j->fat);
+    j->fat = NULL;
+    meta_dirty_free(&j->home_dirty);
+}
+
+int journal_open(journal *j, disk_t *disk, const boot_sector *bs, int *fat, int fat_entries, files *dir) {
+    j->location = 0;
+    j->blocks = 0;
+    j->next = 1;
+    j->sequence = 1;
+    j->block_size = bs->blockSize;
+    j->fat_entries = fat_entries;
+    j->dir_slots = bs->sizeOfRoot * (bs->blockSize / (int)sizeof(files));
+    j->fat_bytes = (size_t)bs->sizeOfFat1 * bs->blockSize;
+    j->fat = malloc(j->fat_bytes);
+    if (j->fat == NULL || meta_dirty_init(&j->home_dirty, bs) == -1) {
+        fprintf(stderr, "Error: Out of memory for the journal.\n");
+        journal_close(j);
+        return -1;
+    }
+    if (bs->journal_location > 0 && bs->sizeOfJournal >= 2 && bs->journal_location + bs->sizeOfJournal <= bs->dataOffset) {
+        j->location = bs->journal_location;
+        j->blocks = bs->sizeOfJournal;
+    }
+
+    if (j->location == 0) {
+        // Made before journaling: metadata is only ever rewritten in place
+        if (fat != NULL) {
+            memcpy(j->fat, fat, j->fat_bytes);
+            memcpy(j->dir, dir, j->dir_slots * sizeof(files));
+        }
+        return 0;
+    }
+
+    char *region = malloc((size_t)j->blocks * j->block_size);
+    if (region == NULL) {
+        fprintf(stderr, "Error: Out of memory for journal replay.\n");
+        journal_close(j);
+        return -1;
+    }
+    if (block_read_range_ex(disk, j->location, j->blocks, region) == -1) {
+        fprintf(stderr, "Error: Failed to read journal.\n");
+        free(region);
+        journal_close(j);
+        return -1;
+    }
+
+    const journal_header *header = (const journal_header *)region;
+    int header_valid = header->magic == JOURNAL_MAGIC;
+    int applied = 0;
+    if (header_valid) {
+        j->sequence = header->sequence;
+    } else {
+        fprintf(stderr, "Warning: Journal header is invalid, nothing replayed.\n");
+    }
+
+    // Apply every complete transaction in order
+    int pos = 1;
+    while (header_valid && pos < j->blocks) {
+        txn_header *txn = (txn_header *)(region + (size_t)pos * j->block_size);
+        if (txn->magic != JOURNAL_MAGIC || txn->sequence != j->sequence ||
+            txn->num_blocks < 1 || txn->num_blocks > j->blocks - pos ||
+            txn->fat_records < 0 || txn->fat_records > j->fat_entries ||
+            txn->dir_records < 0 || txn->dir_records > j->dir_slots ||
+            txn_bytes(txn->fat_records, txn->dir_records) > (size_t)txn->num_blocks * j->block_size) {
+            break;
+        }
+        unsigned int sum = txn->checksum;
+        txn->checksum = 0;
+        if (checksum(txn, txn_bytes(txn->fat_records, txn->dir_records)) != sum) {
+            break; // Torn by a crash while it was being written
+        }
+        if (fat == NULL) {
+            fprintf(stderr, "Error: Journal must be replayed, the metadata has not been read.\n");
+            free(region);
+            journal_close(j);
+            return -1;
+        }
+
+        const fat_record *fr = (const fat_record *)(txn + 1);
+        for (int i = 0; i < txn->fat_records; i++) {
+            if (fr[i].index >= 0 && fr[i].index < j->fat_entries) {
+                fat[fr[i].index] = fr[i].value;
+                meta_dirty_fat(&j->home_dirty, fr[i].index);
+            }
+        }
+        const dir_record *dr = (const dir_record *)(fr + txn->fat_records);
+        for (int i = 0; i < txn->dir_records; i++) {
+            if (dr[i].slot >= 0 && dr[i].slot < j->dir_slots) {
+                dir[dr[i].slot] = dr[i].entry;
+                meta_dirty_dir(&j->home_dirty, dr[i].slot);
+            }
+        }
+
+        pos += txn->num_blocks;
+        j->sequence++;
+        applied++;
+    }
+
+    // Leftovers of older logs must never match a future sequence number
+    unsigned int replayed_sequence = j->sequence;
+    for (int b = 1; b < j->blocks; b++) {
+        const txn_header *txn = (const txn_header *)(region + (size_t)b * j->block_size);
+        if (txn->magic == JOURNAL_MAGIC && txn->sequence >= j->sequence) {
+            j->sequence = txn->sequence + 1;
+        }
+    }
+    free(region);
+
+    if (fat != NULL) {
+        memcpy(j->fat, fat, j->fat_bytes);
+        memcpy(j->dir, dir, j->dir_slots * sizeof(files));
+    }
+    if (applied > 0) {
+        printf("Replayed %d journal transaction(s).\n", applied);
+    }
+    if ((applied > 0 || !header_valid || j->sequence != replayed_sequence) && checkpoint(j, disk, bs) == -1) {
+        journal_close(j);
+        return -1;
+    }
+    return 0;
+}
+
+
+// 1 if FAT entry i is in a dirty block and differs from the last commit
+static int fat_changed(const journal *j, const int *fat, const meta_dirty *dirty, int i) {
+    return fat_block_dirty(dirty, i / dirty->fat_per_block) && fat[i] != j->fat[i];
+}
+
+// 1 if root directory slot i is in a dirty block and differs from the last commit
+static int dir_changed(const journal *j, const files *dir, const meta_dirty *dirty, int i) {
+    return dir_block_dirty(dirty, i / dirty->dir_per_block) && memcmp(&dir[i], &j->dir[i], sizeof(files)) != 0;
+}
+
+// Take the blocks named in changed into the committed copy; all others are
+// the same in both already
+static void copy_changed(journal *j, const int *fat, const files *dir, const meta_dirty *changed) {
+    for (int b = 0; b < changed->fat_blocks; b++) {
+        if (fat_block_dirty(changed, b)) {
+            journal_fat_loaded(j, fat, b);
+        }
+    }
+    for (int b = 0; b < changed->dir_blocks; b++) {
+        if (dir_block_dirty(changed, b)) {
+            memcpy(j->dir + b * changed->dir_per_block, dir + b * changed->dir_per_block, changed->dir_per_block * sizeof(files));
+        }
+    }
+}
+
+int journal_checkpoint(journal *j, disk_t *disk, const boot_sector *bs) {
+    if (j->location == 0 || (j->next == 1 && !any_dirty(&j->home_dirty))) {
+        return 0; // Nothing logged, the home copies are current
+    }
+    return checkpoint(j, disk, bs);
+}
+
+int journal_commit(journal *j, disk_t *disk, const boot_sector *bs, const int *fat, const files *dir, const meta_dirty *dirty) {
+    // Count the changes, narrowing dirty down to blocks that really changed
+    int fat_records = 0;
+    int dir_records = 0;
+    meta_dirty changed;
+    if (meta_dirty_init(&changed, bs) == -1) {
+        return -1;
+    }
+    for (int i = 0; i < j->fat_entries; i++) {
+        if (!fat_block_dirty(dirty, i / dirty->fat_per_block)) {
+            i += dirty->fat_per_block - 1; // Skip the clean block
+            continue;
+        }
+        if (fat[i] != j->fat[i]) {
+            fat_records++;
+            meta_dirty_fat(&changed, i);
+        }
+    }
+    for (int i = 0; i < j->dir_slots; i++) {
+        if (!dir_block_dirty(dirty, i / dirty->dir_per_block)) {
+            i += dirty->dir_per_block - 1;
+            continue;
+        }
+        if (dir_changed(j, dir, dirty, i)) {
+            dir_records++;
+            meta_dirty_dir(&changed, i);
+        }
+    }
+
+    // Data the metadata points at must be durable before the metadata is
+    if (sync_disk(disk) == -1) {
+        meta_dirty_free(&changed);
+        return -1;
+    }
+    if (fat_records == 0 && dir_records == 0) {
+        meta_dirty_free(&changed);
+        return 0;
+    }
+
+    size_t bytes = txn_bytes(fat_records, dir_records);
+    int num_blocks = (bytes + j->block_size - 1) / j->block_size;
+    if (j->location != 0 && num_blocks > j->blocks - j->next && journal_checkpoint(j, disk, bs) == -1) {
+        meta_dirty_free(&changed);
+        return -1;
+    }
+
+    // No journal, or one too small even when empty: rewrite in place
+    if (j->location == 0 || num_blocks > j->blocks - j->next) {
+        if (write_home(disk, bs, fat, dir, &changed) == -1 || sync_disk(disk) == -1) {
+            meta_dirty_free(&changed);
+            return -1;
+        }
+        copy_changed(j, fat, dir, &changed);
+        meta_dirty_free(&changed);
+        return 0;
+    }
+
+    char *buf = calloc(num_blocks, j->block_size);
+    if (buf == NULL) {
+        fprintf(stderr, "Error: Out of memory for journal transaction.\n");
+        meta_dirty_free(&changed);
+        return -1;
+    }
+    txn_header *txn = (txn_header *)buf;
+    txn->magic = JOURNAL_MAGIC;
+    txn->sequence = j->sequence;
+    txn->num_blocks = num_blocks;
+    txn->fat_records = fat_records;
+    txn->dir_records = dir_records;
+
+    fat_record *fr = (fat_record *)(txn + 1);
+    for (int i = 0; i < j->fat_entries; i++) {
+        if (!fat_block_dirty(&changed, i / changed.fat_per_block)) {
+            i += changed.fat_per_block - 1;
+            continue;
+        }
+        if (fat_changed(j, fat, &changed, i)) {
+            fr->index = i;
+            fr->value = fat[i];
+            fr++;
+        }
+    }
+    dir_record *dr = (dir_record *)fr;
+    for (int i = 0; i < j->dir_slots; i++) {
+        if (dir_changed(j, dir, &changed, i)) {
+            dr->slot = i;
+            dr->entry = dir[i];
+            dr++;
+        }
+    }
+    txn->checksum = checksum(buf, bytes);
+
+    int result = block_write_range_ex(disk, j->location + j->next, num_blocks, buf);
+    free(buf);
+    if (result == -1) {
+        fprintf(stderr, "Error: Failed to write journal transaction.\n");
+        meta_dirty_free(&changed);
+        return -1;
+    }
+    if (sync_disk(disk) == -1) {
+        meta_dirty_free(&changed);
+        return -1;
+    }
+
+    j->next += num_blocks;
+    j->sequence++;
+    merge_dirty(&j->home_dirty, &changed);
+    copy_changed(j, fat, dir, &changed);
+    meta_dirty_free(&changed);
+    return 0;
+}
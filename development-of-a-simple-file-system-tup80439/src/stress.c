@@ -0,0 +1,137 @@
+#include "fs_management.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Concurrency stress test: threads create, write, read back and delete files
+// of their own in directories they all share, list those directories, and
+// read one shared file, all at once. Run it under ThreadSanitizer (make
+// stress) to check the locking as well as the data.
+
+#define DISK_NAME "stress.img"
+#define THREADS 8
+#define ROUNDS 200
+#define DIRS 4
+#define MAX_WRITE 20000
+#define SHARED_BYTES 50000
+
+static char shared_data[SHARED_BYTES];
+static int failures;
+static pthread_mutex_t failure_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void fail(int thread, int round, const char *what) {
+    pthread_mutex_lock(&failure_lock);
+    failures++;
+    fprintf(stderr, "stress: thread %d round %d: %s\n", thread, round, what);
+    pthread_mutex_unlock(&failure_lock);
+}
+
+// Bytes of file round of thread, so every file's contents differ
+static void fill(char *buf, size_t nbyte, int thread, int round) {
+    for (size_t i = 0; i < nbyte; i++) {
+        buf[i] = (char)(i * 7 + thread * 31 + round * 13);
+    }
+}
+
+static void *worker(void *arg) {
+    int thread = (int)(long)arg;
+    char *data = malloc(MAX_WRITE);
+    char *back = malloc(SHARED_BYTES);
+    struct fs_dirent entries[64];
+    char path[64];
+
+    for (int round = 0; data != NULL && back != NULL && round < ROUNDS; round++) {
+        size_t nbyte = 1 + (size_t)(thread * 7919 + round * 104729) % MAX_WRITE;
+        snprintf(path, sizeof(path), "d%d/t%d_%d", (thread + round) % DIRS, thread, round);
+        fill(data, nbyte, thread, round);
+
+        if (fs_create(path) == -1) {
+            fail(thread, round, "create");
+            continue;
+        }
+        int fd = fs_open(path);
+        if (fd == -1) {
+            fail(thread, round, "open");
+            continue;
+        }
+        if (fs_write(fd, data, nbyte) != (int)nbyte) {
+            fail(thread, round, "write");
+        }
+        if (fs_get_filesize(fd) != (int)nbyte) {
+            fail(thread, round, "file size");
+        }
+        if (round % 16 == 0 && fs_fsync(fd) == -1) {
+            fail(thread, round, "fsync");
+        }
+        if (fs_lseek(fd, 0) == -1 || fs_read(fd, back, nbyte) != (int)nbyte || memcmp(back, data, nbyte) != 0) {
+            fail(thread, round, "read back");
+        }
+        if (fs_close(fd) == -1) {
+            fail(thread, round, "close");
+        }
+
+        if (fs_readdir((char *)(round % 2 ? "d0" : "d1"), entries, 64) == -1) {
+            fail(thread, round, "readdir");
+        }
+        fd = fs_open("d0/shared");
+        if (fd == -1 || fs_read(fd, back, SHARED_BYTES) != SHARED_BYTES || memcmp(back, shared_data, SHARED_BYTES) != 0) {
+            fail(thread, round, "shared read");
+        }
+        if (fd != -1) {
+            fs_close(fd);
+        }
+
+        if (fs_delete(path) == -1) {
+            fail(thread, round, "delete");
+        }
+    }
+    free(data);
+    free(back);
+    return NULL;
+}
+
+int main(void) {
+    if (make_fs(DISK_NAME) == -1 || mount_fs(DISK_NAME) == -1) {
+        fprintf(stderr, "stress: cannot set up %s\n", DISK_NAME);
+        return 1;
+    }
+    int free_before = fs_get_free_blocks();
+
+    char name[8];
+    for (int d = 0; d < DIRS; d++) {
+        snprintf(name, sizeof(name), "d%d", d);
+        fs_mkdir(name);
+    }
+    fill(shared_data, SHARED_BYTES, THREADS, 0);
+    fs_create("d0/shared");
+    int fd = fs_open("d0/shared");
+    if (fd == -1 || fs_write(fd, shared_data, SHARED_BYTES) != SHARED_BYTES || fs_close(fd) == -1) {
+        fprintf(stderr, "stress: cannot write the shared file\n");
+        return 1;
+    }
+
+    pthread_t threads[THREADS];
+    for (int t = 0; t < THREADS; t++) {
+        pthread_create(&threads[t], NULL, worker, (void *)(long)t);
+    }
+    for (int t = 0; t < THREADS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    // Every thread's files are gone again, so only the shared file holds blocks
+    fs_delete("d0/shared");
+    if (fs_sync() == -1 || fs_get_free_blocks() != free_before) {
+        fail(-1, -1, "blocks leaked");
+    }
+    unmount_fs(DISK_NAME);
+    unlink(DISK_NAME);
+
+    if (failures > 0) {
+        fprintf(stderr, "stress: %d failures\n", failures);
+        return 1;
+    }
+    fprintf(stderr, "stress: %d threads x %d rounds OK\n", THREADS, ROUNDS);
+    return 0;
+}